@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
 #include <strings.h>
@@ -25,9 +26,28 @@
 #include <sys/time.h>
 #include <sys/epoll.h>
 
+/* TCP Record and Replay */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #define IPADDRSIZE 16      /* Size of IP Address String        */
 #define TCPBUFFERSIZE 256  /* Data buffer size for TCP message */
 #define TCPRINGSIZE 8      /* Size of TCP message ring         */
+#define TCPCLOCKWINDOW 16  /* Heartbeats used for clock offset */
+
+#define TCPMAXPAYLOAD (1<<20) /* Largest binary payload accepted     */
+#define TCPCHUNKSPERSEND 16   /* Payload frames sent per send call   */
+
+/* Control frames are handled inside the library and never reach the message
+ * rings, text messages should therefore not start with TCPCTRL_PREFIX */
+#define TCPCTRL_PREFIX '\x01' /* First byte of a control frame  */
+#define TCPCTRL_PING   'P'    /* Heartbeat request              */
+#define TCPCTRL_PONG   'Q'    /* Heartbeat reply                */
+#define TCPCTRL_CHUNK  'C'    /* Part of a binary payload       */
+
+#define TCPRECORD_INBOUND  0 /* Record direction: message received */
+#define TCPRECORD_OUTBOUND 1 /* Record direction: message sent     */
 
 
 /*********************************** STRUCT ***********************************/
@@ -39,6 +59,11 @@ typedef struct string_t {
 typedef struct tcpmessage_t {
   char message[TCPBUFFERSIZE];
   char source_ip[IPADDRSIZE];
+  /* binary messages keep their content in payload instead of message,
+   * the payload is owned by the ring and freed when the message is cleared */
+  bool binary;
+  char *payload;
+  uint32_t length; /* number of bytes in message or payload */
 } tcpmessage_t;
 
 typedef struct tcpmessagering_t {
@@ -53,6 +78,34 @@ typedef struct tcpmessagering_t {
 } tcpmessagering_t;
 
 
+/* Heartbeat state of one connection */
+typedef struct tcplink_t {
+  uint64_t last_receive_ns; /* monotonic time of the last frame received       */
+  uint64_t last_ping_ns;    /* monotonic time the last heartbeat was sent      */
+  double srtt;              /* smoothed round trip time in seconds             */
+  double rttvar;            /* round trip time variation in seconds            */
+  int rtt_samples;          /* number of round trip times measured             */
+  /* clock offset samples, peer monotonic clock minus local monotonic clock,
+   * stored in a ring of the last TCPCLOCKWINDOW heartbeats */
+  uint64_t clock_time_ns[TCPCLOCKWINDOW];  /* local time of each sample         */
+  int64_t clock_offset_ns[TCPCLOCKWINDOW]; /* measured offset of each sample    */
+  double clock_delay_ns[TCPCLOCKWINDOW];   /* round trip delay of each sample   */
+  int clock_samples;                       /* number of samples taken           */
+  /* current estimate: offset = clock_base_ns + clock_drift*(local - clock_ref_ns) */
+  uint64_t clock_ref_ns;
+  int64_t clock_base_ns;
+  double clock_drift;
+  /* frame being received, frames are only processed once complete */
+  char rx_frame[TCPBUFFERSIZE];
+  int rx_bytes;
+  /* binary payload being reassembled, NULL if none */
+  char *rx_payload_ptr;
+  uint32_t rx_payload_length;
+  uint32_t rx_payload_received;
+  uint8_t rx_payload_id;
+} tcplink_t;
+
+
 /****************************** GLOBAL VARIABLES ******************************/
 /* pointer for error log file */
 extern FILE *error_log_;
@@ -66,9 +119,11 @@ int last_ip_digit( char ip_add[] );
 void print_time(void);
 void nsleep(uint64_t ns);
 int current_time(void);
+uint64_t monotonic_ns(void);
 
 /********************************* CLib_TCP.c *********************************/
 void tcp_lib_init(char* server_addr, int port, double update_freq );
+void tcp_heartbeat_init( double interval_sec, int miss_threshold );
 
 int tcp_server_setup( int min_client_addr, int max_client_addr );
 int tcp_server_monitor( void );
@@ -77,6 +132,10 @@ void tcp_server_cleanup( void );
 void tcp_server_process_message( void (*processing_func_ptr)(tcpmessage_t *), void (*emptyring_func_ptr)(void) );
 void tcp_server_send_message( void );
 void tcp_server_add_message_sendqueue( char* message_ptr, char* destination_ip_ptr );
+int tcp_server_add_payload_sendqueue( char* data_ptr, uint32_t length, char* destination_ip_ptr );
+int tcp_server_get_rtt( char* client_ip_ptr, double *srtt, double *rttvar );
+int tcp_server_get_clock( char* client_ip_ptr, double *offset_sec, double *drift_ppm );
+int tcp_server_peer_to_local_ns( char* client_ip_ptr, uint64_t peer_ns, uint64_t *local_ns );
 
 int tcp_client_setup( void );
 int tcp_client_reconnect( void );
@@ -86,7 +145,104 @@ void tcp_client_cleanup( void );
 void tcp_client_process_message( void (*processing_func_ptr)(tcpmessage_t *), void (*emptyring_func_ptr)(void) );
 int tcp_client_send_message( void );
 void tcp_client_add_message_sendqueue( char* message_ptr );
+int tcp_client_add_payload_sendqueue( char* data_ptr, uint32_t length );
 void tcp_client_clear_message_sendqueue( void );
+int tcp_client_get_rtt( double *srtt, double *rttvar );
+int tcp_client_get_clock( double *offset_sec, double *drift_ppm );
+int tcp_client_peer_to_local_ns( uint64_t peer_ns, uint64_t *local_ns );
+
+/****************************** CLib_TCPRecord.c ******************************/
+int tcp_record_start( char* filename );
+void tcp_record_stop( void );
+void tcp_record_message( int direction, char* peer_ip_ptr, char* data_ptr, uint32_t length, bool binary );
+int tcp_replay( char* filename, void (*processing_func_ptr)(tcpmessage_t *), bool realtime );
+
+
+/******************************** Binary Codec ********************************/
+/*
+ * Fixed layout binary records, sent as TCP payloads instead of formatted text
+ *
+ * A record is defined once with a list of its fields, for example:
+ *
+ *   #define SAMPLE_FIELDS(FIELD) \
+ *     FIELD(uint8_t,  channel) \
+ *     FIELD(uint64_t, time_ns) \
+ *     FIELD(double,   volts  )
+ *   CODEC_RECORD( sample, 1, 1, SAMPLE_FIELDS )
+ *
+ * which generates
+ *   typedef struct sample_t { uint8_t channel; uint64_t time_ns; double volts; } sample_t;
+ *   uint32_t sample_size( void );  encoded size in bytes
+ *   uint32_t sample_encode( const sample_t *record_ptr, char *buffer_ptr );
+ *   int      sample_decode( sample_t *record_ptr, const char *buffer_ptr, uint32_t length );
+ *
+ * The encoding is a 2 byte tag (record id and version) followed by the fields
+ * in order, little-endian and without padding. On little-endian hosts each
+ * field is a plain memcpy. Fields can be any integer or floating point type.
+ *
+ * Sending:    tcp_client_add_payload_sendqueue( buffer, sample_encode( &sample, buffer ) );
+ * Receiving:  if ( message->binary && CODEC_ID(message->payload) == 1 )
+ *               sample_decode( &sample, message->payload, message->length );
+ *
+ * decode returns 0 on success, -1 if the id or length does not match and -2 if
+ * the version does not match. The version is checked before the length, so
+ * a buffer of another version gives -2 even if its size changed too. A
+ * changed layout needs a new version number.
+ */
+#define CODEC_TAGSIZE 2
+#define CODEC_ID(buffer_ptr)      ((uint8_t) (buffer_ptr)[0])
+#define CODEC_VERSION(buffer_ptr) ((uint8_t) (buffer_ptr)[1])
+
+/* Copy one field into a buffer in little-endian order, return the next position */
+static inline char *codec_put( char *dst_ptr, const void *src_ptr, size_t size ) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  size_t i;
+  for (i = 0; i < size; i++) dst_ptr[i] = ((const char *) src_ptr)[size - 1 - i];
+#else
+  memcpy( dst_ptr, src_ptr, size );
+#endif
+  return dst_ptr + size;
+}
+
+/* Copy one little-endian field out of a buffer, return the next position */
+static inline const char *codec_get( void *dst_ptr, const char *src_ptr, size_t size ) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  size_t i;
+  for (i = 0; i < size; i++) ((char *) dst_ptr)[i] = src_ptr[size - 1 - i];
+#else
+  memcpy( dst_ptr, src_ptr, size );
+#endif
+  return src_ptr + size;
+}
+
+#define CODEC_FIELD_DECLARE(type, name) type name;
+#define CODEC_FIELD_SIZE(type, name)    + (uint32_t) sizeof(type)
+#define CODEC_FIELD_PUT(type, name)     ptr = codec_put( ptr, &record_ptr->name, sizeof(type) );
+#define CODEC_FIELD_GET(type, name)     cptr = codec_get( &record_ptr->name, cptr, sizeof(type) );
+
+#define CODEC_RECORD(name, id, version, FIELDS)                                     \
+  typedef struct name##_t { FIELDS(CODEC_FIELD_DECLARE) } name##_t;                 \
+                                                                                    \
+  static inline uint32_t name##_size( void ) {                                      \
+    return CODEC_TAGSIZE FIELDS(CODEC_FIELD_SIZE);                                  \
+  }                                                                                 \
+                                                                                    \
+  static inline uint32_t name##_encode( const name##_t *record_ptr, char *buffer_ptr ) { \
+    char *ptr = buffer_ptr;                                                         \
+    *ptr++ = (char) (id);                                                           \
+    *ptr++ = (char) (version);                                                      \
+    FIELDS(CODEC_FIELD_PUT)                                                         \
+    return (uint32_t) (ptr - buffer_ptr);                                           \
+  }                                                                                 \
+                                                                                    \
+  static inline int name##_decode( name##_t *record_ptr, const char *buffer_ptr, uint32_t length ) { \
+    const char *cptr = buffer_ptr + CODEC_TAGSIZE;                                  \
+    if ( length < CODEC_TAGSIZE || CODEC_ID(buffer_ptr) != (id) ) return -1;        \
+    if ( CODEC_VERSION(buffer_ptr) != (version) ) return -2;                        \
+    if ( length != name##_size() ) return -1;                                       \
+    FIELDS(CODEC_FIELD_GET)                                                         \
+    return 0;                                                                       \
+  }
 
 
 #endif
\ No newline at end of file
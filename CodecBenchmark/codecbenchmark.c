@@ -0,0 +1,109 @@
+#include <CLibrary.h>
+
+/* Compares the binary codec against formatted text for a typical sensor sample,
+ * encoding with sprintf and decoding with sscanf versus sample_encode and
+ * sample_decode. Both paths produce what would be put into a TCP send queue. */
+
+#define N_ITERATIONS 1000000
+#define N_ENCODED    1024 /* distinct encoded samples decoded in turn, a power of 2 */
+
+#define SAMPLE_FIELDS(FIELD) \
+  FIELD(uint8_t,  channel) \
+  FIELD(uint64_t, time_ns) \
+  FIELD(double,   volts  )
+CODEC_RECORD( sample, 1, 1, SAMPLE_FIELDS )
+
+
+/* pointer for error log file */
+FILE *error_log_;
+
+/* encoded samples for the decoding loops, so every field changes each time */
+static char texts_[N_ENCODED][TCPBUFFERSIZE];
+static char binaries_[N_ENCODED][TCPBUFFERSIZE];
+
+
+/* Sum of the bytes of an encoded sample, every byte written is used so the
+ * compiler cannot drop any of the encoding work */
+uint64_t Byte_Sum( const char *buffer_ptr, int length ) {
+  uint64_t sum;
+  int ii;
+
+  sum = 0;
+  for ( ii = 0; ii < length; ii++ ) {
+    sum += (unsigned char) buffer_ptr[ii];
+  }
+  return sum;
+}
+
+
+int main( void ) {
+  int ii, text_length;
+  uint64_t start_ns, text_encode_ns, text_decode_ns, binary_encode_ns, binary_decode_ns;
+  char text[TCPBUFFERSIZE];
+  char binary[TCPBUFFERSIZE];
+  uint32_t binary_length;
+  unsigned int channel;
+  uint64_t bytesum;
+  double checksum;
+  sample_t sample, decoded;
+
+  /* Open error log file */
+  error_log_ = stdout;
+
+  checksum = 0.0;
+  bytesum  = 0;
+  text_length = 0;
+
+  /* Text encoding */
+  start_ns = monotonic_ns();
+  for ( ii = 0; ii < N_ITERATIONS; ii++ ) {
+    text_length = sprintf( text, "%d %" PRIu64 " %.9f", ii & 3, (uint64_t) ii * 1000, ii * 1e-6 );
+    bytesum += Byte_Sum( text, text_length );
+  }
+  text_encode_ns = monotonic_ns() - start_ns;
+
+  /* Binary encoding */
+  binary_length = 0;
+  start_ns = monotonic_ns();
+  for ( ii = 0; ii < N_ITERATIONS; ii++ ) {
+    sample.channel = ii & 3;
+    sample.time_ns = (uint64_t) ii * 1000;
+    sample.volts   = ii * 1e-6;
+    binary_length = sample_encode( &sample, binary );
+    bytesum += Byte_Sum( binary, binary_length );
+  }
+  binary_encode_ns = monotonic_ns() - start_ns;
+
+  /* Samples to decode, outside of the timing */
+  for ( ii = 0; ii < N_ENCODED; ii++ ) {
+    sample.channel = ii & 3;
+    sample.time_ns = (uint64_t) ii * 1000;
+    sample.volts   = ii * 1e-6;
+    sprintf( texts_[ii], "%d %" PRIu64 " %.9f", sample.channel, sample.time_ns, sample.volts );
+    sample_encode( &sample, binaries_[ii] );
+  }
+
+  /* Text decoding */
+  start_ns = monotonic_ns();
+  for ( ii = 0; ii < N_ITERATIONS; ii++ ) {
+    sscanf( texts_[ii & (N_ENCODED - 1)], "%u %" SCNu64 " %lf", &channel, &decoded.time_ns, &decoded.volts );
+    checksum += decoded.volts + channel + decoded.time_ns;
+  }
+  text_decode_ns = monotonic_ns() - start_ns;
+
+  /* Binary decoding */
+  start_ns = monotonic_ns();
+  for ( ii = 0; ii < N_ITERATIONS; ii++ ) {
+    sample_decode( &decoded, binaries_[ii & (N_ENCODED - 1)], binary_length );
+    checksum += decoded.volts + decoded.channel + decoded.time_ns;
+  }
+  binary_decode_ns = monotonic_ns() - start_ns;
+
+  printf("%d samples, checksum %g, byte sum %" PRIu64 "\n", N_ITERATIONS, checksum, bytesum);
+  printf("text   encode: %7.1f ns/sample, decode: %7.1f ns/sample, size: %3d bytes\n", \
+    (double) text_encode_ns / N_ITERATIONS, (double) text_decode_ns / N_ITERATIONS, (int) strlen(text));
+  printf("binary encode: %7.1f ns/sample, decode: %7.1f ns/sample, size: %3d bytes\n", \
+    (double) binary_encode_ns / N_ITERATIONS, (double) binary_decode_ns / N_ITERATIONS, (int) binary_length);
+
+  return 0;
+}
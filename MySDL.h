@@ -1,6 +1,53 @@
 #ifndef MYSDL_H
 #define MYSDL_H
 
+#define JOYSTICKMAXAXIS    16  /* Most axes in a joystick state snapshot    */
+#define JOYSTICKMAXBUTTON  32  /* Most buttons of each mode in a snapshot   */
+#define JOYSTICKMAXDEVICES 8   /* Most joysticks open at once               */
+#define JOYSTICKIDS        256 /* SDL axis and button numbers are 8 bits    */
+
+
+/* Joystick values, see Joystick_Monitor for the values. The counts tell
+ * presses apart that give the same value. */
+typedef struct joystickstate_s {
+  uint64_t version;    /* updates published, 0 before the first one       */
+  uint64_t time_ns;    /* monotonic_ns() of the update                    */
+  uint32_t connected;  /* 1 while the device is attached, 0 once removed  */
+  uint32_t reconnects; /* times the device came back after a removal      */
+  double axis_value[JOYSTICKMAXAXIS];
+  int button_value_sl[JOYSTICKMAXBUTTON];
+  int button_value_sh[JOYSTICKMAXBUTTON];
+  uint32_t button_count_sl[JOYSTICKMAXBUTTON]; /* short and long presses so far */
+  uint32_t button_count_sh[JOYSTICKMAXBUTTON]; /* short presses so far          */
+} joystickstate_t;
+
+/* One joystick and its axis and button mapping. The mapping is kept while the
+ * device is unplugged, and applies again when a device with the same GUID is
+ * plugged in. The values are updated by Joystick_Update, and published in a
+ * snapshot that other threads read with Joystick_Dev_Read. */
+typedef struct joystick_t {
+  void *sdl_ptr;             /* SDL_Joystick, NULL while unplugged            */
+  int instance_id;           /* SDL instance of the device, -1 while unplugged */
+  uint8_t guid[16];          /* SDL GUID, to find the device when plugged back */
+  int n_axis, n_button_sl, n_button_sh;
+  double long_press_sec, hold_sec;
+  int axis_name[JOYSTICKMAXAXIS], axis_min[JOYSTICKMAXAXIS], axis_max[JOYSTICKMAXAXIS];
+  int axis_dz[JOYSTICKMAXAXIS], axis_inv[JOYSTICKMAXAXIS];
+  int button_name_sl[JOYSTICKMAXBUTTON], button_name_sh[JOYSTICKMAXBUTTON];
+  uint64_t press_time_sl[JOYSTICKMAXBUTTON], press_time_sh[JOYSTICKMAXBUTTON]; /* monotonic_ns() of the press */
+  /* min-heap of the short press/hold buttons waiting for their hold time, by
+   * deadline, and the position of each button in it (-1 if not waiting) */
+  int hold_heap[JOYSTICKMAXBUTTON], hold_index[JOYSTICKMAXBUTTON];
+  int n_hold;
+  /* slot of each SDL axis and button number in the arrays above, -1 if unused */
+  int axis_slot[JOYSTICKIDS], button_slot_sl[JOYSTICKIDS], button_slot_sh[JOYSTICKIDS];
+  joystickstate_t state;     /* values, owned by the thread calling Joystick_Update */
+  bool changed;              /* state changed since it was published          */
+  /* published snapshot, a seqlock: the sequence is odd while the words change */
+  uint64_t seq __attribute__((aligned(64)));
+  uint64_t words[(sizeof(joystickstate_t) + 7) / 8] __attribute__((aligned(64)));
+} joystick_t;
+
 
 int Joystick_Init( int device_num, int n_axis, int n_button_sl, int n_button_sh );
 void Joystick_Init_Axis( const int *axis_name, const int *axis_min, const int *axis_max, \
@@ -9,7 +56,23 @@ void Joystick_Init_Button_SL( const int *button_name, double long_press_sec);
 void Joystick_Init_Button_SH( const int *button_name, double hold_sec);
 void Joystick_Display_Action( void );
 void Joystick_Monitor( double *axis_value, int *button_value_sl, int *button_value_sh );
+int Joystick_Wait( int timeout_ms, double *axis_value, int *button_value_sl, int *button_value_sh );
+int Joystick_Timeout_Ms( int max_ms );
+int Joystick_Event_Fd( void );
+int Joystick_Service_Start( void );
+void Joystick_Service_Read( joystickstate_t *state_ptr );
+void Joystick_Service_Stop( void );
 void Joystick_Cleanup( void );
 
+int Joystick_Dev_Open( joystick_t *joy_ptr, int device_num, int n_axis, int n_button_sl, int n_button_sh );
+void Joystick_Dev_Init_Axis( joystick_t *joy_ptr, const int *axis_name, const int *axis_min, \
+  const int *axis_max, const int *axis_dz, const int* axis_inv );
+void Joystick_Dev_Init_Button_SL( joystick_t *joy_ptr, const int *button_name, double long_press_sec );
+void Joystick_Dev_Init_Button_SH( joystick_t *joy_ptr, const int *button_name, double hold_sec );
+void Joystick_Dev_Read( joystick_t *joy_ptr, joystickstate_t *state_ptr );
+void Joystick_Dev_Close( joystick_t *joy_ptr );
+void Joystick_Update( void );
+int Joystick_Update_Wait( int timeout_ms );
+
 
-#endif
\ No newline at end of file
+#endif
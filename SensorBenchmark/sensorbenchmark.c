@@ -0,0 +1,111 @@
+#include <CLibrary.h>
+#include <Sensors.h>
+
+/* Measures the I2C traffic and time of the sensor drivers against the
+ * simulated devices of Sensors_I2CSim.c, so driver changes can be compared
+ * without hardware. The bus runs at 400 kHz, transfers take the time they
+ * would take on the wire. */
+
+#define N_READS     200
+#define N_RAW       1000
+#define N_FRAMES    100
+#define BUS_HZ      400000.0
+#define ADC_ADDR    0x48
+#define PWM_ADDR    0x40
+
+
+/* pointer for error log file */
+FILE *error_log_;
+
+
+/* Input of the simulated ADC, a 10 Hz sine on every input */
+double Sine_Input( int input, uint64_t time_ns ) {
+  return 1.0 + 0.5 * sin( 2.0 * M_PI * 10.0 * time_ns * 1e-9 + input );
+}
+
+
+/* Print the traffic and time per operation since the last reset */
+void Print_Stats( const char *name, int n_ops, uint64_t elapsed_ns ) {
+  i2cstats_t stats;
+
+  I2C_Get_Stats( &stats );
+  printf("%-24s %7.2f transfers, %7.2f messages, %7.2f bytes, %9.1f us per op\n", name, \
+    (double) stats.transfers / n_ops, (double) stats.messages / n_ops, \
+    (double) (stats.bytes_written + stats.bytes_read) / n_ops, elapsed_ns * 1e-3 / n_ops);
+  I2C_Reset_Stats();
+  return;
+}
+
+
+int main( void ) {
+  int ii, jj;
+  uint64_t start_ns;
+  double checksum;
+  int16_t raw[N_RAW];
+  uint64_t time_ns[N_RAW];
+  uint16_t frame[PCA9685_CHANNELS];
+
+  /* Open error log file */
+  error_log_ = stdout;
+
+  I2C_Set_Backend( &I2C_Sim_Backend );
+  I2C_Sim_Set_Bus_Speed( BUS_HZ );
+  if (I2C_Sim_Add_ADS1115( I2C_DEFAULT_BUS, ADC_ADDR, Sine_Input ) == -1) return -1;
+  if (I2C_Sim_Add_PCA9685( I2C_DEFAULT_BUS, PWM_ADDR ) == -1) return -1;
+  if (ADS1115_Init( ADC_ADDR, 4.096, 860 ) == -1) return -1;
+  if (PCA9685_Init( PWM_ADDR, 50, true ) == -1) return -1;
+  checksum = 0.0;
+
+  /* Single-shot reads, alternating channels */
+  I2C_Reset_Stats();
+  start_ns = monotonic_ns();
+  for ( ii = 0; ii < N_READS; ii++ ) {
+    checksum += ADS1115_SingleEnded_Read( ii & 1 );
+  }
+  Print_Stats( "ADS1115 single-shot", N_READS, monotonic_ns() - start_ns );
+
+  /* Batched continuous reads of one channel */
+  I2C_Reset_Stats();
+  start_ns = monotonic_ns();
+  if (ADS1115_Read_Raw( 0, raw, time_ns, N_RAW ) == -1) return -1;
+  Print_Stats( "ADS1115 continuous", N_RAW, monotonic_ns() - start_ns );
+  for ( ii = 0; ii < N_RAW; ii++ ) checksum += raw[ii];
+
+  /* Full frames of the 16 PWM channels */
+  I2C_Reset_Stats();
+  start_ns = monotonic_ns();
+  for ( ii = 0; ii < N_FRAMES; ii++ ) {
+    for ( jj = 0; jj < PCA9685_CHANNELS; jj++ ) {
+      PCA9685_setPinPWM( jj, (ii * 16 + jj) & 0x0FFF );
+    }
+  }
+  Print_Stats( "PCA9685 16 pin writes", N_FRAMES, monotonic_ns() - start_ns );
+
+  /* The same frames in one block write each */
+  I2C_Reset_Stats();
+  start_ns = monotonic_ns();
+  for ( ii = 0; ii < N_FRAMES; ii++ ) {
+    for ( jj = 0; jj < PCA9685_CHANNELS; jj++ ) {
+      frame[jj] = (ii * 16 + jj) & 0x0FFF;
+    }
+    if (PCA9685_setPinsPWM( 0, frame, PCA9685_CHANNELS ) == -1) return -1;
+  }
+  Print_Stats( "PCA9685 frame write", N_FRAMES, monotonic_ns() - start_ns );
+
+  /* A control loop setting every pin each tick, while only two move */
+  I2C_Reset_Stats();
+  start_ns = monotonic_ns();
+  for ( ii = 0; ii < N_FRAMES; ii++ ) {
+    for ( jj = 0; jj < PCA9685_CHANNELS; jj++ ) {
+      PCA9685_updatePinPWM( jj, (jj == 3 || jj == 4) ? 1000 + ii : 2000 );
+    }
+    if (PCA9685_flush() == -1) return -1;
+  }
+  Print_Stats( "PCA9685 shadow flush", N_FRAMES, monotonic_ns() - start_ns );
+
+  printf("checksum %g, PWM frequency %.2f Hz\n", checksum, I2C_Sim_PCA9685_Frequency( I2C_DEFAULT_BUS, PWM_ADDR ));
+
+  PCA9685_cleanup();
+  I2C_Sim_Clear();
+  return 0;
+}
@@ -1,6 +1,211 @@
 #ifndef SENSORS_H
 #define SENSORS_H
 
+/* ADS1115 channels: 0-3 are single-ended inputs AIN0-AIN3 against GND,
+ * the following are differential pairs, positive input first */
+#define ADS1115_DIFF_0_1   4 /* AIN0 - AIN1 */
+#define ADS1115_DIFF_0_3   5 /* AIN0 - AIN3 */
+#define ADS1115_DIFF_1_3   6 /* AIN1 - AIN3 */
+#define ADS1115_DIFF_2_3   7 /* AIN2 - AIN3 */
+#define ADS1115_CHANNELS   8 /* number of channels, size of tables indexed by channel */
+
+#define ADCRINGSIZE 1024 /* Samples in a scan ring, must be a power of 2 */
+#define ADCSCANMAX  16   /* Most channels in a scan list               */
+#define ADCSCANDEVICES 4 /* Most devices in a scan, one bus has 4 addresses */
+
+#define FILTERMAXSTAGES  8  /* Most stages in a filter                      */
+#define FILTERMAXTAPS    64 /* Longest boxcar or median window              */
+#define FILTERMAXBIQUADS 8  /* Most sections in a biquad stage              */
+#define FILTERMAXCIC     4  /* Highest CIC order                            */
+#define FILTERHISTORY    (2*FILTERMAXTAPS) /* Past samples kept by a stage  */
+
+#define FILTER_BOXCAR 0 /* Moving average        */
+#define FILTER_BIQUAD 1 /* IIR biquad cascade    */
+#define FILTER_MEDIAN 2 /* Median of N           */
+#define FILTER_CIC    3 /* CIC decimator         */
+
+#define PCA9685_CHANNELS 16 /* PWM outputs of a PCA9685 */
+#define PCA9685MAXBOARDS 16 /* Most boards in a chain, one write each fits a transfer */
+
+#define SERVOMAXCHANNELS (PCA9685MAXBOARDS*PCA9685_CHANNELS) /* Channels of a motion engine */
+#define SERVO_IDLE     0 /* Channel not driven by the motion engine  */
+#define SERVO_VELOCITY 1 /* Moving to a target within speed limits   */
+#define SERVO_KEYFRAME 2 /* Moving to a target at a given time       */
+
+#define I2C_DEFAULT_BUS 1   /* Bus of the Raspberry Pi header pins 3 and 5  */
+#define I2CMAXBUS       8   /* Most buses open at the same time             */
+#define I2CMAXBATCH     16  /* Most register accesses in one I2C_Transfer   */
+#define I2CMAXWRITE     128 /* Most bytes written in one register access    */
+
+/*********************************** STRUCT ***********************************/
+/* GPIO line delivering edge events */
+typedef struct gpioedge_t {
+  int fd;    /* line event file descriptor, or eventfd for a mock line */
+  bool mock; /* true for a mock line, edges come from GPIO_Edge_Trigger_Mock */
+} gpioedge_t;
+
+/* One register access of an I2C batch */
+typedef struct i2cxfer_t {
+  uint8_t addr;    /* 7-bit address of the device                     */
+  uint8_t reg;     /* first register                                  */
+  bool read;       /* true to read the registers, false to write them */
+  uint8_t *data;   /* bytes to write, or buffer for the bytes read    */
+  uint16_t length; /* number of bytes                                 */
+} i2cxfer_t;
+
+/* Backend that carries out I2C transfers, see I2C_Set_Backend */
+typedef struct i2cbackend_t {
+  int (*open_func_ptr)( int bus );                                   /* returns a file descriptor */
+  void (*close_func_ptr)( int fd );
+  int (*transfer_func_ptr)( int fd, i2cxfer_t *xfers, int n_xfers ); /* as I2C_Transfer          */
+} i2cbackend_t;
+
+/* I2C traffic counters */
+typedef struct i2cstats_t {
+  uint64_t transfers;     /* calls of I2C_Transfer, system calls with /dev/i2c-N */
+  uint64_t messages;      /* I2C messages, each with a start and an address      */
+  uint64_t bytes_written; /* bytes written, register pointers included           */
+  uint64_t bytes_read;    /* bytes read                                          */
+} i2cstats_t;
+
+/* One ADS1115 device */
+typedef struct ads1115_t {
+  int i2c_fd;             /* file descriptor of the bus, -1 when closed                   */
+  int bus;                /* I2C bus number, -1 for the default bus                       */
+  int i2c_addr;           /* I2C address                                                  */
+  uint16_t config;        /* single-shot config register value without the mux            */
+  uint16_t register_config; /* config register as last written, without the OS bit      */
+  double lsb;             /* volts per count at the programmed voltage range              */
+  uint64_t conversion_ns; /* nominal time of one conversion at the programmed data rate   */
+  uint64_t ready_ns;      /* monotonic time the running single-shot conversion is done    */
+  bool continuous;        /* true while the ADC is in continuous-conversion mode          */
+  uint64_t last_read_ns;  /* monotonic time of the last read in continuous mode           */
+  gpioedge_t *ready_ptr;  /* ALERT/RDY pin, NULL to poll the OS bit instead               */
+} ads1115_t;
+
+/* One PCA9685 board */
+typedef struct pca9685_t {
+  int i2c_fd;                         /* file descriptor of the bus, -1 when closed           */
+  int bus;                            /* I2C bus number, -1 for the default bus               */
+  int i2c_addr;                       /* I2C address                                          */
+  uint8_t mode1;                      /* MODE1 bits kept while running: AI, ALLCALL           */
+  double freq;                        /* PWM frequency as set by the prescaler, Hz            */
+  uint8_t shadow[4*PCA9685_CHANNELS]; /* LED0_ON_L..LED15_OFF_H as set by the program         */
+  uint16_t dirty;                     /* pins changed in shadow, not written yet, bit n for n */
+} pca9685_t;
+
+/* PCA9685 boards on one bus driven together, channel 16 * board + pin */
+typedef struct pca9685chain_t {
+  pca9685_t boards[PCA9685MAXBOARDS];
+  int n_boards;
+  pca9685_t all;     /* the LED All Call address, reaching every board */
+} pca9685chain_t;
+
+/* Background writer of a PCA9685 chain. Setters post the newest value of a
+ * channel without blocking, and the thread writes the posted channels once
+ * per flush period, so values posted in between are coalesced. */
+typedef struct pca9685actuator_t {
+  pca9685chain_t *chain_ptr;                 /* the chain, only used by the thread while running */
+  uint16_t values[PCA9685MAXBOARDS*PCA9685_CHANNELS]; /* newest value posted for each channel */
+  uint32_t posted[PCA9685MAXBOARDS] __attribute__((aligned(64))); /* channels posted, bit n for pin n */
+  uint32_t freq_mhz;                         /* frequency change posted in mHz, 0 for none        */
+  int periods;                               /* PWM periods per flush                             */
+  uint64_t period_ns;                        /* time between flushes                              */
+  uint64_t flushes;                          /* flushes that wrote to the bus                     */
+  uint64_t overruns;                         /* flush periods missed                              */
+  bool running;                              /* cleared to stop the thread                        */
+  pthread_t thread;
+} pca9685actuator_t;
+
+/* Servo motion engine driving the channels of a PCA9685 chain, see
+ * Sensors_Servo.c. Positions are in PWM ticks out of 4096, one array entry
+ * per channel so the thread works on whole arrays. */
+typedef struct servomotion_t {
+  pca9685chain_t *chain_ptr;            /* the chain, only used by the thread while running */
+  int n_channels;                       /* channels of the chain                           */
+  uint64_t period_ns;                   /* time between setpoints                          */
+  uint64_t start_ns;                    /* monotonic time of the start                     */
+  uint64_t overruns;                    /* setpoint periods missed                         */
+  /* motion state, used by the thread only */
+  double position[SERVOMAXCHANNELS];    /* setpoint                                        */
+  double velocity[SERVOMAXCHANNELS];    /* ticks per second                                */
+  double target[SERVOMAXCHANNELS];      /* end of the move                                 */
+  double max_velocity[SERVOMAXCHANNELS];     /* ticks per second                           */
+  double max_acceleration[SERVOMAXCHANNELS]; /* ticks per second squared                   */
+  double key_start[SERVOMAXCHANNELS];   /* position at the start of a keyframe move        */
+  double key_velocity[SERVOMAXCHANNELS];/* velocity at the start of a keyframe move        */
+  double key_time[SERVOMAXCHANNELS];    /* start of a keyframe move, seconds from start_ns */
+  double key_duration[SERVOMAXCHANNELS];/* duration of a keyframe move, seconds            */
+  double mode[SERVOMAXCHANNELS];        /* SERVO_*, as double to select in the same loops  */
+  /* commands, handed to the thread under the mutex */
+  pthread_mutex_t mutex;
+  bool cmd_pending[SERVOMAXCHANNELS];   /* a command is waiting for the channel            */
+  int cmd_mode[SERVOMAXCHANNELS];       /* SERVO_*                                         */
+  double cmd_target[SERVOMAXCHANNELS];
+  double cmd_duration[SERVOMAXCHANNELS];
+  double cmd_max_velocity[SERVOMAXCHANNELS];     /* 0 to keep the limits                   */
+  double cmd_max_acceleration[SERVOMAXCHANNELS];
+  double setpoints[SERVOMAXCHANNELS];   /* copy of position for Servo_Position             */
+  bool running;                         /* cleared to stop the thread                      */
+  pthread_t thread;
+} servomotion_t;
+
+/* One ADC conversion */
+typedef struct adcsample_t {
+  uint64_t time_ns; /* monotonic_ns() when the conversion was read */
+  double volts;     /* converted voltage                           */
+  int16_t raw;      /* conversion result in counts                 */
+  uint8_t channel;  /* channel that was converted                  */
+  uint8_t device;   /* index of the device in the scan             */
+} adcsample_t;
+
+/* Lock-free ring of samples with one writer (the scan thread) and one reader.
+ * head and tail only ever increase, and are kept on separate cache lines. */
+typedef struct adcring_t {
+  uint32_t head __attribute__((aligned(64))); /* next slot to write, written by the scan thread */
+  uint32_t dropped;                           /* samples lost because the ring was full        */
+  uint32_t failed;                            /* samples lost because the I2C read failed      */
+  uint32_t tail __attribute__((aligned(64))); /* next slot to read, written by the reader       */
+  adcsample_t samples[ADCRINGSIZE] __attribute__((aligned(64)));
+} adcring_t;
+
+/* Background scan of a list of ADC channels on the devices of one bus */
+typedef struct adcscan_t {
+  ads1115_t *devices[ADCSCANDEVICES]; /* devices to convert           */
+  int n_devices;                      /* number of devices            */
+  int channels[ADCSCANMAX]; /* channels to convert, in order              */
+  int n_channels;           /* number of channels in the list             */
+  uint64_t period_ns;       /* time between scans of the list, 0 for none */
+  bool running;             /* cleared to stop the thread                 */
+  bool batch_read;          /* read all devices in one transfer           */
+  pthread_t thread;
+  adcring_t ring;
+} adcscan_t;
+
+
+/* One stage of a filter, see Sensors_Filter.c */
+typedef struct filterstage_t {
+  int type;                           /* FILTER_*                                     */
+  int length;                         /* window, number of sections or decimation     */
+  int order;                          /* CIC order                                    */
+  double coeffs[FILTERMAXBIQUADS][5]; /* b0, b1, b2, a1, a2 of each section           */
+  double state[FILTERMAXBIQUADS][2];  /* section state                                 */
+  double cic_sums[FILTERMAXCIC + 1];  /* CIC moving sums, then the block sum          */
+  double history[FILTERHISTORY];      /* past samples                                 */
+  double sum;                         /* running sum of the boxcar                    */
+  int position;                       /* next slot in history                         */
+  int count;                          /* samples in the window, or in the CIC block   */
+  uint64_t time_ns;                   /* processing time spent in the stage           */
+  uint64_t n_samples;                 /* samples that went into the stage             */
+} filterstage_t;
+
+/* Chain of filter stages for one stream of samples */
+typedef struct filter_t {
+  filterstage_t stages[FILTERMAXSTAGES];
+  int n_stages;
+} filter_t;
+
+
 /****************************** GLOBAL VARIABLES ******************************/
 /* pointer for error log file */
 extern FILE *error_log_;
@@ -8,10 +213,105 @@ extern FILE *error_log_;
 /***************************** Sensors_ADS1115.c *****************************/
 int ADS1115_Init( int i2c_addr, double VRange, int DateRate );
 double ADS1115_SingleEnded_Read( int channel );
+int ADS1115_Continuous_Start( int channel );
+double ADS1115_Continuous_Read( void );
+void ADS1115_Continuous_Stop( void );
+int ADS1115_Ready_Pin_Init( gpioedge_t *ready_ptr );
+int ADS1115_Scan_Start( adcscan_t *scan_ptr, const int *channels, int n_channels, double scan_rate );
+int ADS1115_Scan_Read( adcscan_t *scan_ptr, adcsample_t *samples, int max_samples );
+void ADS1115_Scan_Stop( adcscan_t *scan_ptr );
+int ADS1115_Dev_Open( ads1115_t *adc_ptr, int bus, int i2c_addr, double VRange, int DateRate );
+void ADS1115_Dev_Close( ads1115_t *adc_ptr );
+double ADS1115_Dev_Read( ads1115_t *adc_ptr, int channel );
+int ADS1115_Dev_Continuous_Start( ads1115_t *adc_ptr, int channel );
+double ADS1115_Dev_Continuous_Read( ads1115_t *adc_ptr );
+void ADS1115_Dev_Continuous_Stop( ads1115_t *adc_ptr );
+int ADS1115_Dev_Ready_Pin_Init( ads1115_t *adc_ptr, gpioedge_t *ready_ptr );
+int ADS1115_Read_Raw( int channel, int16_t *raw, uint64_t *time_ns, int n_samples );
+int ADS1115_Dev_Read_Raw( ads1115_t *adc_ptr, int channel, int16_t *raw, uint64_t *time_ns, int n_samples );
+int ADS1115_Bus_Scan_Start( adcscan_t *scan_ptr, ads1115_t **devices, int n_devices, \
+  const int *channels, int n_channels, double scan_rate );
+
+/**************************** Sensors_Calibrate.c ****************************/
+void ADC_Calibrate( const int16_t *raw, int n_samples, double gain, double offset, double *values );
+void ADC_Calibrate_Channels( const int16_t *raw, const uint8_t *channels, int n_samples, \
+  const double *gain, const double *offset, double *values );
+void ADC_Calibrate_Interleaved( const int16_t *raw, int n_samples, int n_channels, \
+  const double *gain, const double *offset, double *values );
+
+/****************************** Sensors_Filter.c ******************************/
+void Filter_Init( filter_t *filter_ptr );
+int Filter_Add_Boxcar( filter_t *filter_ptr, int length );
+int Filter_Add_Biquad( filter_t *filter_ptr, const double coeffs[][5], int n_biquads );
+int Filter_Add_Lowpass( filter_t *filter_ptr, double cutoff, double sample_rate, int n_biquads );
+int Filter_Add_Median( filter_t *filter_ptr, int length );
+int Filter_Add_CIC( filter_t *filter_ptr, int factor, int order );
+int Filter_Process( filter_t *filter_ptr, const double *input, int n_samples, double *output );
+double Filter_Stage_Cost( filter_t *filter_ptr, int stage );
+void Filter_Reset( filter_t *filter_ptr );
+
+/****************************** Sensors_Servo.c ******************************/
+int Servo_Start( servomotion_t *motion_ptr, pca9685chain_t *chain_ptr, double rate );
+int Servo_Set_Limits( servomotion_t *motion_ptr, int channel, double max_velocity, double max_acceleration );
+int Servo_Move( servomotion_t *motion_ptr, int channel, double target );
+int Servo_Keyframe( servomotion_t *motion_ptr, int channel, double target, double duration );
+int Servo_Release( servomotion_t *motion_ptr, int channel );
+double Servo_Position( servomotion_t *motion_ptr, int channel );
+void Servo_Stop( servomotion_t *motion_ptr );
+
+/******************************* Sensors_I2C.c *******************************/
+int I2C_Open( int bus );
+void I2C_Close( int fd );
+int I2C_Write( int fd, uint8_t addr, uint8_t reg, const uint8_t *data, int length );
+int I2C_Read( int fd, uint8_t addr, uint8_t reg, uint8_t *data, int length );
+int I2C_Transfer( int fd, i2cxfer_t *xfers, int n_xfers );
+void I2C_Set_Backend( const i2cbackend_t *backend_ptr );
+void I2C_Get_Stats( i2cstats_t *stats_ptr );
+void I2C_Reset_Stats( void );
+
+/***************************** Sensors_I2CSim.c *****************************/
+extern const i2cbackend_t I2C_Sim_Backend;
+int I2C_Sim_Add_ADS1115( int bus, uint8_t addr, double (*input_func_ptr)(int input, uint64_t time_ns) );
+int I2C_Sim_Add_PCA9685( int bus, uint8_t addr );
+void I2C_Sim_Clear( void );
+void I2C_Sim_Set_Bus_Speed( double bus_hz );
+double I2C_Sim_PCA9685_Frequency( int bus, uint8_t addr );
+int I2C_Sim_PCA9685_Channel( int bus, uint8_t addr, int channel, uint16_t *on_ptr, uint16_t *off_ptr );
+
+/******************************* Sensors_GPIO.c *******************************/
+int GPIO_Edge_Open( gpioedge_t *edge_ptr, const char *chip_path, int line, bool rising );
+int GPIO_Edge_Open_Mock( gpioedge_t *edge_ptr );
+void GPIO_Edge_Trigger_Mock( gpioedge_t *edge_ptr );
+int GPIO_Edge_Wait( gpioedge_t *edge_ptr, uint64_t timeout_ns );
+int GPIO_Edge_Flush( gpioedge_t *edge_ptr );
+void GPIO_Edge_Close( gpioedge_t *edge_ptr );
 
 /***************************** Sensors_PCA9685.c *****************************/
 int PCA9685_Init( int i2c_addr, double freq, bool totempole );
 void PCA9685_setPinPWM( uint8_t PinNum, uint16_t PWMval);
+int PCA9685_setPinsPWM( uint8_t FirstPin, const uint16_t *PWMvals, int n_pins );
+void PCA9685_updatePinPWM( uint8_t PinNum, uint16_t PWMval );
+int PCA9685_updatePinsPWM( uint8_t FirstPin, const uint16_t *PWMvals, int n_pins );
+int PCA9685_flush( void );
+int PCA9685_Dev_Open( pca9685_t *pwm_ptr, int bus, int i2c_addr, double freq, bool totempole );
+void PCA9685_Dev_Close( pca9685_t *pwm_ptr );
+void PCA9685_Dev_setPinPWM( pca9685_t *pwm_ptr, uint8_t PinNum, uint16_t PWMval );
+int PCA9685_Dev_setPinsPWM( pca9685_t *pwm_ptr, uint8_t FirstPin, const uint16_t *PWMvals, int n_pins );
+void PCA9685_Dev_updatePinPWM( pca9685_t *pwm_ptr, uint8_t PinNum, uint16_t PWMval );
+int PCA9685_Dev_updatePinsPWM( pca9685_t *pwm_ptr, uint8_t FirstPin, const uint16_t *PWMvals, int n_pins );
+int PCA9685_Dev_flush( pca9685_t *pwm_ptr );
+int PCA9685_Chain_Open( pca9685chain_t *chain_ptr, int bus, const int *i2c_addrs, int n_boards, \
+  double freq, bool totempole );
+void PCA9685_Chain_Close( pca9685chain_t *chain_ptr );
+void PCA9685_Chain_setPWMFreq( pca9685chain_t *chain_ptr, double freq );
+int PCA9685_Chain_setAllPWM( pca9685chain_t *chain_ptr, uint16_t PWMval );
+void PCA9685_Chain_updatePWM( pca9685chain_t *chain_ptr, int channel, uint16_t PWMval );
+int PCA9685_Chain_updatePWMs( pca9685chain_t *chain_ptr, int first_channel, const uint16_t *PWMvals, int n_channels );
+int PCA9685_Chain_flush( pca9685chain_t *chain_ptr );
+int PCA9685_Actuator_Start( pca9685actuator_t *act_ptr, pca9685chain_t *chain_ptr, int periods );
+void PCA9685_Actuator_Set( pca9685actuator_t *act_ptr, int channel, uint16_t PWMval );
+void PCA9685_Actuator_Set_Freq( pca9685actuator_t *act_ptr, double freq );
+void PCA9685_Actuator_Stop( pca9685actuator_t *act_ptr );
 void PCA9685_cleanup( void );
 
 
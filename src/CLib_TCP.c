@@ -10,8 +10,22 @@
  * Or is automatically handled by
  * tcp_server_send_message
  * by treating the respective client as disconnected
+ *
+ * Every frame on the wire is exactly TCPBUFFERSIZE bytes. Text messages are
+ * sent as one NULL terminated frame. Binary payloads of any size up to
+ * TCPMAXPAYLOAD are split into TCPCTRL_CHUNK control frames and reassembled on
+ * the receiving end, see tcp_send_chunk and tcp_handle_chunk.
  */
 
+/* Layout of a TCPCTRL_CHUNK frame:
+ *   [0] TCPCTRL_PREFIX, [1] TCPCTRL_CHUNK, [2] flags, [3] payload id,
+ *   [4..7] total payload length, [8..9] bytes of data in this frame (both in
+ *   network byte order), then the data */
+#define TCPCHUNK_HEADERSIZE 10
+#define TCPCHUNK_DATASIZE   (TCPBUFFERSIZE - TCPCHUNK_HEADERSIZE)
+#define TCPCHUNK_FIRST      0x01 /* first frame of a payload */
+#define TCPCHUNK_LAST       0x02 /* last frame of a payload  */
+
 /************ Static Variables Available in and only in this file ************/
 /* IP setting for this TCP instance */
 static char* server_ipaddr_; /* TCP server IP address            */
@@ -46,21 +60,54 @@ static tcpmessagering_t server_message_in_ring_, server_message_out_ring_;
 /* message queues for the client */
 static tcpmessagering_t client_message_in_ring_, client_message_out_ring_;
 
+/* outbound binary payload queues, kept apart from the message queues so a
+ * large payload does not hold up the messages behind it */
+static tcpmessagering_t server_payload_out_ring_, client_payload_out_ring_;
+/* number of bytes already sent of the payload at the head of each queue */
+static uint32_t server_payload_sent_, client_payload_sent_;
+/* id of the payload currently being sent, to detect mixed up frames */
+static uint8_t server_payload_id_, client_payload_id_;
+
 
 /* Counter for number of connected clients */
 static int connected_client_couter_;
 
 
+/* Heartbeat settings, heartbeat is disabled if the interval is 0 */
+static uint64_t heartbeat_interval_ns_ = 0;
+static int heartbeat_miss_threshold_;
+/* Heartbeat state for each client of the server, in the same order as
+ * server_events_monitored_ptr_ */
+static tcplink_t *server_links_ptr_;
+/* Heartbeat state of the client */
+static tcplink_t client_link_;
+
+
 /************ Static Functions Limited to Access within this File ************/
 static void tcp_ring_init( tcpmessagering_t *ring_ptr );
 static void tcp_clear_message( tcpmessage_t *message_ptr );
 static void tcp_increment_ring_ptr_processing( tcpmessagering_t *ring_ptr );
 static void tcp_increment_ring_ptr_new( tcpmessagering_t *ring_ptr );
 static void tcp_add_message( tcpmessagering_t *ring_ptr, char* message_ptr, char* source_ip_ptr);
+static int tcp_add_payload( tcpmessagering_t *ring_ptr, char* payload_ptr, uint32_t length, char* source_ip_ptr);
 static void tcp_process_message( tcpmessagering_t *ring_ptr, \
   void (*processing_func_ptr)(tcpmessage_t *), void (*emptyring_func_ptr)(void) );
 static void tcp_clear_ring( tcpmessagering_t *ring_ptr );
 
+static void tcp_server_disconnect( int array_position );
+static void tcp_server_heartbeat( void );
+static void tcp_client_disconnect( void );
+static void tcp_link_reset( tcplink_t *link_ptr );
+static void tcp_link_update_rtt( tcplink_t *link_ptr, uint64_t rtt_ns );
+static void tcp_link_update_clock( tcplink_t *link_ptr, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4 );
+static int tcp_link_peer_to_local_ns( tcplink_t *link_ptr, uint64_t peer_ns, uint64_t *local_ns );
+static int tcp_send_control( int sd, char type, uint64_t echo_ns, uint64_t receive_ns );
+static void tcp_handle_control( int sd, tcplink_t *link_ptr, char *frame_ptr, \
+  tcpmessagering_t *ring_ptr, char* source_ip_ptr );
+static int tcp_send_chunk( int sd, tcpmessage_t *payload_msg_ptr, uint32_t *sent_ptr, uint8_t payload_id );
+static void tcp_handle_chunk( tcplink_t *link_ptr, char *frame_ptr, tcpmessagering_t *ring_ptr, char* source_ip_ptr );
+static int tcp_link_read( int sd, tcplink_t *link_ptr );
+
 
 
 /************************** Libarary Initialization **************************/
@@ -84,11 +131,36 @@ void tcp_lib_init(char* server_addr, int port, double update_freq ) {
   /* Initalize the message rings for the client */
   tcp_ring_init( &client_message_in_ring_  );
   tcp_ring_init( &client_message_out_ring_ );
+  /* Initalize the binary payload rings */
+  tcp_ring_init( &server_payload_out_ring_ );
+  tcp_ring_init( &client_payload_out_ring_ );
+  server_payload_sent_ = 0;
+  client_payload_sent_ = 0;
 
   return;
 }
 
 
+/* Enable application level heartbeats on both the server and the client
+ * Each end sends a heartbeat every interval_sec and measures the round trip
+ * time from the reply. If nothing at all is received from the other end for
+ * miss_threshold intervals, the connection is treated as dead and closed, the
+ * same way as if the other end disconnected.
+ * Both ends of a connection should enable heartbeats with the same settings.
+ *
+ * Arguments:
+ *   interval_sec:   [Input] time between heartbeats in seconds, 0 to disable
+ *   miss_threshold: [Input] number of intervals without any received data
+ *                           before the connection is treated as dead
+ * Return None
+ */
+void tcp_heartbeat_init( double interval_sec, int miss_threshold ) {
+  heartbeat_interval_ns_    = (uint64_t) (interval_sec * 1e9);
+  heartbeat_miss_threshold_ = miss_threshold;
+  return;
+}
+
+
 /*************************** Server Side Functions ***************************/
 /* Setup server side for TCP
  * Arguments:
@@ -116,6 +188,12 @@ int tcp_server_setup( int min_client_addr, int max_client_addr ) {
     fprintf(stderr, "Out of memory!\n");
     exit(1);
   }
+  /* allocate server_links_ptr_ */
+  server_links_ptr_ = (tcplink_t*) calloc(num_clients_+1, sizeof(tcplink_t));
+  if (server_links_ptr_ == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(1);
+  }
 
   /* Type of socket created */
   address.sin_family = AF_INET;
@@ -193,10 +271,10 @@ int tcp_server_monitor( void ) {
   int event_count, i;
   /* message length */
   int bytes_read;
-  /* data buffer */
-  char buffer[TCPBUFFERSIZE];
   /* temp socket descripters */
   int sd, new_socket;
+  /* heartbeat and receive state of the client */
+  tcplink_t *link_ptr;
 
   /* array_postion in server_events_monitored_ptr_ */
   int array_position;
@@ -253,6 +331,8 @@ int tcp_server_monitor( void ) {
       (server_events_monitored_ptr_ + array_position)->events = EPOLLIN; /* watch for input events */
       (server_events_monitored_ptr_ + array_position)->data.fd = new_socket;
       epoll_ctl(server_epoll_fd_, EPOLL_CTL_ADD, new_socket, (server_events_monitored_ptr_ + array_position));
+      /* Start heartbeat monitoring from now */
+      tcp_link_reset( server_links_ptr_ + array_position );
 
       /* Increment connected client counter */
       connected_client_couter_ += 1;
@@ -262,45 +342,54 @@ int tcp_server_monitor( void ) {
       /* else it is some IO operation on some client socket */
       sd = (active_events_ptr + i)->data.fd;
 
-      /* Clear buffer first */
-      memset( buffer, '\0', sizeof(buffer) );
-
-      /* Read incomming message and store in buffer,
-       * and return the number of bytes read to bytes_read */
-      bytes_read = read( sd , buffer, TCPBUFFERSIZE );
-      /* Ensure NULL Terminate */
-      buffer[TCPBUFFERSIZE-1] = '\0';
+      /* Get client detail */
+      getpeername(sd , (struct sockaddr*)&address , (socklen_t*)&addrlen);
+      array_position = last_ip_digit(inet_ntoa(address.sin_addr))-min_client_addr_+1;
+      link_ptr = server_links_ptr_ + array_position;
+
+      /* Read every complete frame waiting on the socket into the receive
+       * buffer of the client, so the frames of a payload do not pile up and
+       * control frames are handled as soon as they arrive */
+      while ( (bytes_read = tcp_link_read( sd, link_ptr )) == TCPBUFFERSIZE ) {
+        if ( link_ptr->rx_frame[0] == TCPCTRL_PREFIX ) {
+          /* Control frames are handled here and not added to the ring */
+          tcp_handle_control( sd, link_ptr, link_ptr->rx_frame, \
+            &server_message_in_ring_, inet_ntoa(address.sin_addr) );
+        }
+        else {
+          /* Ensure NULL Terminate */
+          link_ptr->rx_frame[TCPBUFFERSIZE-1] = '\0';
+          /* Add message and sender IP to the TCP message ring. */
+          tcp_add_message( &server_message_in_ring_, link_ptr->rx_frame, inet_ntoa(address.sin_addr) );
+          /* Record the message if recording is active */
+          tcp_record_message( TCPRECORD_INBOUND, inet_ntoa(address.sin_addr), \
+            link_ptr->rx_frame, strlen(link_ptr->rx_frame), false );
+        }
+      }
 
-      if ( bytes_read == 0) {
-        /* If valread is 0, then the client disconnected, get details and print */
-        getpeername(sd , (struct sockaddr*)&address , (socklen_t*)&addrlen);
+      if ( bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ) {
+        /* If valread is 0, then the client disconnected, a failed read also
+         * ends the connection, print details */
         print_time();
-        fprintf(error_log_, "Client disconnected , ip %s , port %d \n" ,
-              inet_ntoa(address.sin_addr) , ntohs(address.sin_port));
+        if ( bytes_read == 0 ) {
+          fprintf(error_log_, "Client disconnected , ip %s , port %d \n" ,
+                inet_ntoa(address.sin_addr) , ntohs(address.sin_port));
+        }
+        else {
+          fprintf(error_log_, "Read from client failed , ip %s , port %d , errno code %i\n" ,
+                inet_ntoa(address.sin_addr) , ntohs(address.sin_port), errno);
+        }
         fflush(error_log_);
 
         /* Remove the client socket from server_events_monitored_ptr_, and close the socket */
-        array_position = last_ip_digit(inet_ntoa(address.sin_addr))-min_client_addr_+1;
-        (server_events_monitored_ptr_ + array_position)->data.fd = -1;
-        epoll_ctl(server_epoll_fd_, EPOLL_CTL_DEL, sd, (server_events_monitored_ptr_ + array_position));
-        close( sd );
-
-        /* Decrement connected client counter */
-        connected_client_couter_ -= 1;
-      }
-
-      /* Else, a message is sent from the clinet */
-      else {
-        /* Get client detail */
-        getpeername(sd , (struct sockaddr*)&address , (socklen_t*)&addrlen);
-
-        /* Add message and sender IP to the TCP message ring.
-         * Note that Buffer is already NULL terminated */
-        tcp_add_message( &server_message_in_ring_, buffer, inet_ntoa(address.sin_addr) );
+        tcp_server_disconnect( array_position );
       }
     }
   }
 
+  /* Send heartbeats and close dead connections */
+  tcp_server_heartbeat( );
+
   free( active_events_ptr );
   return connected_client_couter_;
 }
@@ -314,9 +403,6 @@ int tcp_server_monitor( void ) {
 void tcp_server_cleanup( void ) {
   int i;
 
-  /* Free dynamic allocation */
-  free( server_events_monitored_ptr_ );
-
   /* close client sockets */
   for ( i = 1; i < num_clients_+1; i++) {
     if ( (server_events_monitored_ptr_ + i)->data.fd > 0 ) {
@@ -324,6 +410,13 @@ void tcp_server_cleanup( void ) {
     }
   }
 
+  /* Free dynamic allocation */
+  for ( i = 1; i < num_clients_+1; i++) {
+    free( (server_links_ptr_ + i)->rx_payload_ptr );
+  }
+  free( server_events_monitored_ptr_ );
+  free( server_links_ptr_ );
+
   /* close server_socket_ */
   close( server_socket_ );
 
@@ -378,6 +471,8 @@ void tcp_server_send_message( void ) {
   int sd;
   /* send return value */
   int returnval;
+  /* number of payload frames sent */
+  int chunks;
 
   /* keep sending message as long as the ring is not empty */
   while ( server_message_out_ring_.ptr_processing != server_message_out_ring_.ptr_new ) {
@@ -396,6 +491,13 @@ void tcp_server_send_message( void ) {
       /* otherwise, send the message to the client */
       returnval = send(sd , server_message_out_ring_.ptr_processing->message, TCPBUFFERSIZE, 0 );
 
+      /* Record the message if it was sent and recording is active */
+      if (returnval != -1) {
+        tcp_record_message( TCPRECORD_OUTBOUND, server_message_out_ring_.ptr_processing->source_ip, \
+          server_message_out_ring_.ptr_processing->message, \
+          strlen(server_message_out_ring_.ptr_processing->message), false );
+      }
+
       /* If send failed */
       if (returnval == -1) {
         /* if send failure due to broken pipe, meaning the client disconnected */
@@ -410,12 +512,7 @@ void tcp_server_send_message( void ) {
           fflush(error_log_);
 
           /* Remove the client socket from server_events_monitored_ptr_, and close the socket */
-          (server_events_monitored_ptr_ + array_position)->data.fd = -1;
-          epoll_ctl(server_epoll_fd_, EPOLL_CTL_DEL, sd, (server_events_monitored_ptr_ + array_position));
-          close( sd );
-
-          /* Decrement connected client counter */
-          connected_client_couter_ -= 1;
+          tcp_server_disconnect( array_position );
         }
         else {
           print_time();
@@ -434,6 +531,47 @@ void tcp_server_send_message( void ) {
     /* increment the proccessing pointer */
     tcp_increment_ring_ptr_processing( &server_message_out_ring_ );
   }
+
+  /* then send at most TCPCHUNKSPERSEND frames of binary payloads, so a large
+   * payload is spread over several calls and the messages added in between
+   * do not have to wait for all of it */
+  for ( chunks = 0; chunks < TCPCHUNKSPERSEND && \
+        server_payload_out_ring_.ptr_processing != server_payload_out_ring_.ptr_new; chunks++ ) {
+    array_position = last_ip_digit(server_payload_out_ring_.ptr_processing->source_ip)-min_client_addr_+1;
+    sd = (server_events_monitored_ptr_ + array_position)->data.fd;
+    if ( sd == -1 ) {
+      print_time();
+      fprintf(error_log_, "Payload sending failure, IP Address: %s is not connected, %u bytes dropped\n", \
+        server_payload_out_ring_.ptr_processing->source_ip, server_payload_out_ring_.ptr_processing->length);
+      fflush(error_log_);
+      returnval = -1;
+    }
+    else {
+      returnval = tcp_send_chunk( sd, server_payload_out_ring_.ptr_processing, \
+        &server_payload_sent_, server_payload_id_ );
+      if ( returnval == -1 ) {
+        print_time();
+        fprintf(error_log_, "Payload sending failure on ip %s, errno code %i, %u bytes dropped\n", \
+          server_payload_out_ring_.ptr_processing->source_ip, errno, server_payload_out_ring_.ptr_processing->length);
+        fflush(error_log_);
+        /* if send failure due to broken pipe, meaning the client disconnected */
+        if ( errno == EPIPE ) tcp_server_disconnect( array_position );
+      }
+      else if ( server_payload_sent_ == server_payload_out_ring_.ptr_processing->length ) {
+        /* Record the payload once it is completely sent */
+        tcp_record_message( TCPRECORD_OUTBOUND, server_payload_out_ring_.ptr_processing->source_ip, \
+          server_payload_out_ring_.ptr_processing->payload, server_payload_out_ring_.ptr_processing->length, true );
+      }
+    }
+
+    /* as for the messages, a failed payload is dropped */
+    if ( returnval == -1 || server_payload_sent_ == server_payload_out_ring_.ptr_processing->length ) {
+      tcp_clear_message( server_payload_out_ring_.ptr_processing );
+      tcp_increment_ring_ptr_processing( &server_payload_out_ring_ );
+      server_payload_sent_ = 0;
+      server_payload_id_ ++;
+    }
+  }
   return;
 }
 
@@ -442,7 +580,8 @@ void tcp_server_send_message( void ) {
  * Arguments
  *   message:        [Input]
  *                   string to put as the message
- *                   messages with more than TCPBUFFERSIZE-1 characters will have the end discarded
+ *                   messages with more than TCPBUFFERSIZE-1 characters will have the end discarded,
+ *                   use tcp_server_add_payload_sendqueue for longer messages
  *   destination_ip: [Input]
  *                   string to put as the destination ip address for this new message
  *                   string with more than IPADDRSIZE-1 characters will have the end discarded
@@ -455,6 +594,186 @@ void tcp_server_add_message_sendqueue( char* message_ptr, char* destination_ip_p
 }
 
 
+/* Add one binary payload to the outbound payload queue of the server
+ * The payload is copied, and is sent in parts by tcp_server_send_message.
+ * It is received as one message with binary set to true.
+ *
+ * Arguments
+ *   data:           [Input]
+ *                   the bytes to send, can contain any value including NULL
+ *   length:         [Input]
+ *                   number of bytes, at most TCPMAXPAYLOAD
+ *   destination_ip: [Input]
+ *                   string to put as the destination ip address for this payload
+ *
+ * Return:
+ *    0: on success
+ *   -1: if the payload is too large or the queue is full, the payload is not sent
+ */
+int tcp_server_add_payload_sendqueue( char* data_ptr, uint32_t length, char* destination_ip_ptr ) {
+  char *payload_ptr;
+
+  if ( length > TCPMAXPAYLOAD ) {
+    print_time();
+    fprintf(error_log_, "Payload of %u bytes is larger than TCPMAXPAYLOAD, not sent\n", length);
+    fflush(error_log_);
+    return -1;
+  }
+
+  payload_ptr = (char *) malloc( length > 0 ? length : 1 );
+  if (payload_ptr == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(1);
+  }
+  memcpy( payload_ptr, data_ptr, length );
+  if ( tcp_add_payload( &server_payload_out_ring_, payload_ptr, length, destination_ip_ptr ) == -1 ) {
+    free( payload_ptr );
+    print_time();
+    fprintf(error_log_, "Payload queue full, payload of %u bytes to %s not sent\n", length, destination_ip_ptr);
+    fflush(error_log_);
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Get the round trip time to a client measured by the heartbeats
+ * Arguments
+ *   client_ip: [Input]  IP address string of the client
+ *   srtt:      [Output] smoothed round trip time in seconds
+ *   rttvar:    [Output] round trip time variation in seconds
+ *
+ * Return:
+ *    0: on success
+ *   -1: if the client is not connected or no round trip has been measured yet
+ */
+int tcp_server_get_rtt( char* client_ip_ptr, double *srtt, double *rttvar ) {
+  int array_position;
+
+  array_position = last_ip_digit(client_ip_ptr)-min_client_addr_+1;
+  if ( array_position < 1 || array_position > num_clients_ ) return -1;
+  if ( (server_events_monitored_ptr_ + array_position)->data.fd == -1 ) return -1;
+  if ( (server_links_ptr_ + array_position)->rtt_samples == 0 ) return -1;
+
+  *srtt   = (server_links_ptr_ + array_position)->srtt;
+  *rttvar = (server_links_ptr_ + array_position)->rttvar;
+  return 0;
+}
+
+
+/* Get the clock offset of a client measured by the heartbeats
+ * Arguments
+ *   client_ip:  [Input]  IP address string of the client
+ *   offset_sec: [Output] current offset in seconds, client monotonic_ns()
+ *                        minus server monotonic_ns()
+ *   drift_ppm:  [Output] rate at which the offset changes, in parts per million
+ *
+ * Return:
+ *    0: on success
+ *   -1: if the client is not connected or no offset has been measured yet
+ */
+int tcp_server_get_clock( char* client_ip_ptr, double *offset_sec, double *drift_ppm ) {
+  int array_position;
+  tcplink_t *link_ptr;
+
+  array_position = last_ip_digit(client_ip_ptr)-min_client_addr_+1;
+  if ( array_position < 1 || array_position > num_clients_ ) return -1;
+  if ( (server_events_monitored_ptr_ + array_position)->data.fd == -1 ) return -1;
+  link_ptr = server_links_ptr_ + array_position;
+  if ( link_ptr->clock_samples == 0 ) return -1;
+
+  *offset_sec = ( link_ptr->clock_base_ns + \
+    link_ptr->clock_drift * (double)(int64_t)(monotonic_ns() - link_ptr->clock_ref_ns) ) * 1e-9;
+  *drift_ppm  = link_ptr->clock_drift * 1e6;
+  return 0;
+}
+
+
+/* Convert a monotonic_ns() timestamp taken on a client into the server's
+ * monotonic_ns() timebase, using the clock offset measured by the heartbeats
+ * Arguments
+ *   client_ip: [Input]  IP address string of the client
+ *   peer_ns:   [Input]  timestamp from monotonic_ns() on the client
+ *   local_ns:  [Output] the same instant in monotonic_ns() of the server
+ *
+ * Return:
+ *    0: on success
+ *   -1: if the client is not connected or no offset has been measured yet
+ */
+int tcp_server_peer_to_local_ns( char* client_ip_ptr, uint64_t peer_ns, uint64_t *local_ns ) {
+  int array_position;
+
+  array_position = last_ip_digit(client_ip_ptr)-min_client_addr_+1;
+  if ( array_position < 1 || array_position > num_clients_ ) return -1;
+  if ( (server_events_monitored_ptr_ + array_position)->data.fd == -1 ) return -1;
+
+  return tcp_link_peer_to_local_ns( server_links_ptr_ + array_position, peer_ns, local_ns );
+}
+
+
+/* Remove a client from server_events_monitored_ptr_ and epoll, and close its
+ * socket. This is the common cleanup for every way a client can disconnect.
+ *
+ * Arguments:
+ *   array_position: [Input] position of the client in server_events_monitored_ptr_
+ *
+ * Return: None
+ */
+void tcp_server_disconnect( int array_position ) {
+  int sd;
+
+  sd = (server_events_monitored_ptr_ + array_position)->data.fd;
+  (server_events_monitored_ptr_ + array_position)->data.fd = -1;
+  epoll_ctl(server_epoll_fd_, EPOLL_CTL_DEL, sd, (server_events_monitored_ptr_ + array_position));
+  close( sd );
+
+  /* Decrement connected client counter */
+  connected_client_couter_ -= 1;
+  return;
+}
+
+
+/* Send heartbeats to the connected clients that are due for one, and
+ * disconnect the clients that have not sent anything for
+ * heartbeat_miss_threshold_ heartbeat intervals
+ * Arguments: None
+ * Return   : None
+ */
+void tcp_server_heartbeat( void ) {
+  int i, sd;
+  uint64_t now_ns;
+  tcplink_t *link_ptr;
+  struct sockaddr_in address;
+  int addrlen;
+  addrlen = sizeof(address);
+
+  /* Heartbeat disabled */
+  if ( heartbeat_interval_ns_ == 0 ) return;
+
+  now_ns = monotonic_ns();
+  for ( i = 1; i < num_clients_+1; i++ ) {
+    sd = (server_events_monitored_ptr_ + i)->data.fd;
+    if ( sd == -1 ) continue;
+    link_ptr = server_links_ptr_ + i;
+
+    if ( now_ns - link_ptr->last_receive_ns > heartbeat_miss_threshold_ * heartbeat_interval_ns_ ) {
+      /* Nothing received for too long, the connection is dead */
+      getpeername(sd , (struct sockaddr*)&address , (socklen_t*)&addrlen);
+      print_time();
+      fprintf(error_log_, "Heartbeat lost, client disconnected , ip %s\n", inet_ntoa(address.sin_addr));
+      fflush(error_log_);
+      tcp_server_disconnect( i );
+    }
+    else if ( now_ns - link_ptr->last_ping_ns >= heartbeat_interval_ns_ ) {
+      /* Send the next heartbeat, a failed send is caught by the missed heartbeats */
+      link_ptr->last_ping_ns = now_ns;
+      tcp_send_control( sd, TCPCTRL_PING, 0, 0 );
+    }
+  }
+  return;
+}
+
+
 /*************************** Client Side Functions ***************************/
 /* Setup client side for TCP
  * Arguments: None
@@ -503,6 +822,9 @@ int tcp_client_reconnect( void ) {
     fprintf(error_log_, "Connected to server!\n");
     fflush(error_log_);
 
+    /* Start heartbeat monitoring from now */
+    tcp_link_reset( &client_link_ );
+
     /* Add server_socket_ to epoll monitor */
     client_events_monitored_.events = EPOLLIN; /* watch for input events */
     client_events_monitored_.data.fd = client_socket_;
@@ -524,8 +846,7 @@ int tcp_client_reconnect( void ) {
 int tcp_client_monitor( void ) {
   struct epoll_event active_events;
   int event_count, bytes_read;
-
-  char buffer[TCPBUFFERSIZE];
+  uint64_t now_ns;
 
 
   /**************************** Monitor Activity ******************************/
@@ -537,39 +858,64 @@ int tcp_client_monitor( void ) {
 
   /*************************** Deal With Activity *****************************/
   if ( event_count == 1 ) {
-    /* Clear buffer first */
-    memset( buffer, '\0', sizeof(buffer) );
-
-    /* Read incomming message and store in buffer,
-     * and return the number of bytes read to bytes_read */
-    bytes_read = read( client_socket_ , buffer, TCPBUFFERSIZE );
-    /* Ensure NULL Terminate */
-    buffer[TCPBUFFERSIZE-1] = '\0';
+    /* Read every complete frame waiting on the socket into the receive
+     * buffer, so the frames of a payload do not pile up and control frames
+     * are handled as soon as they arrive */
+    while ( (bytes_read = tcp_link_read( client_socket_, &client_link_ )) == TCPBUFFERSIZE ) {
+      if ( client_link_.rx_frame[0] == TCPCTRL_PREFIX ) {
+        /* Control frames are handled here and not added to the ring */
+        tcp_handle_control( client_socket_, &client_link_, client_link_.rx_frame, \
+          &client_message_in_ring_, server_ipaddr_ );
+      }
+      else {
+        /* Ensure NULL Terminate */
+        client_link_.rx_frame[TCPBUFFERSIZE-1] = '\0';
+        /* Else, a message is sent from the server
+         * Add message and server IP to the TCP message ring. */
+        tcp_add_message( &client_message_in_ring_, client_link_.rx_frame, server_ipaddr_ );
+        /* Record the message if recording is active */
+        tcp_record_message( TCPRECORD_INBOUND, server_ipaddr_, \
+          client_link_.rx_frame, strlen(client_link_.rx_frame), false );
+      }
+    }
 
-    if ( bytes_read == 0) {
-      /* If valread is 0, then the server disconnected. */
+    if ( bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ) {
+      /* If valread is 0, then the server disconnected, a failed read also
+       * ends the connection */
       print_time();
-      fprintf(error_log_, "Server disconnected.\n");
+      if ( bytes_read == 0 ) {
+        fprintf(error_log_, "Server disconnected.\n");
+      }
+      else {
+        fprintf(error_log_, "Read from server failed, errno code %i\n", errno);
+      }
       fflush(error_log_);
 
-      /* Remove the client socket from client_events_monitored_, and do not close the socket */
-      client_events_monitored_.data.fd = -1;
-      epoll_ctl(client_epoll_fd_, EPOLL_CTL_DEL, client_socket_, &client_events_monitored_);
+      tcp_client_disconnect( );
+      return -1;
+    }
+
+  }
 
-      /* clean up, close socket (needs to be reset before attempting to reconnect)
-       * close epoll */
-      tcp_client_cleanup( );
+  /************************ Heartbeat to the Server ***************************/
+  if ( heartbeat_interval_ns_ != 0 ) {
+    now_ns = monotonic_ns();
+    if ( now_ns - client_link_.last_receive_ns > heartbeat_miss_threshold_ * heartbeat_interval_ns_ ) {
+      /* Nothing received for too long, the connection is dead */
+      print_time();
+      fprintf(error_log_, "Heartbeat lost, server disconnected.\n");
+      fflush(error_log_);
 
+      tcp_client_disconnect( );
       return -1;
     }
-
-    else {
-      /* Else, a message is sent from the server
-       * Add message and server IP to the TCP message ring. */
-      tcp_add_message( &client_message_in_ring_, buffer, server_ipaddr_ );
+    else if ( now_ns - client_link_.last_ping_ns >= heartbeat_interval_ns_ ) {
+      /* Send the next heartbeat, a failed send is caught by the missed heartbeats */
+      client_link_.last_ping_ns = now_ns;
+      tcp_send_control( client_socket_, TCPCTRL_PING, 0, 0 );
     }
-
   }
+
   return 0;
 }
 
@@ -625,12 +971,16 @@ void tcp_client_process_message( void (*processing_func_ptr)(tcpmessage_t *), vo
  */
 int tcp_client_send_message( void ) {
   int returnvalue;
+  int chunks;
 
   /* keep sending message as long as the ring is not empty */
   while ( client_message_out_ring_.ptr_processing != client_message_out_ring_.ptr_new ) {
     /* otherwise, send the message to the client */
     returnvalue = send(client_socket_ , client_message_out_ring_.ptr_processing->message, TCPBUFFERSIZE, 0 );
     if (returnvalue != -1) { /* message successfully sent */
+      /* record the message if recording is active */
+      tcp_record_message( TCPRECORD_OUTBOUND, server_ipaddr_, client_message_out_ring_.ptr_processing->message, \
+        strlen(client_message_out_ring_.ptr_processing->message), false );
       /* clear the proccessed message */
       tcp_clear_message( client_message_out_ring_.ptr_processing );
       /* increment the proccessing pointer */
@@ -649,6 +999,38 @@ int tcp_client_send_message( void ) {
       }
     }
   }
+
+  /* then send at most TCPCHUNKSPERSEND frames of binary payloads, so a large
+   * payload is spread over several calls and the messages added in between
+   * do not have to wait for all of it */
+  for ( chunks = 0; chunks < TCPCHUNKSPERSEND && \
+        client_payload_out_ring_.ptr_processing != client_payload_out_ring_.ptr_new; chunks++ ) {
+    returnvalue = tcp_send_chunk( client_socket_, client_payload_out_ring_.ptr_processing, \
+      &client_payload_sent_, client_payload_id_ );
+    if (returnvalue == -1) { /* send failed */
+      /* as for the messages, the payload is kept, and is sent again from the
+       * start after reconnecting */
+      client_payload_sent_ = 0;
+      if (errno == EPIPE) {
+        return -1;
+      }
+      else {
+        print_time();
+        fprintf(error_log_, "Payload sending failure due to unhandled error, errno code %i\n", errno);
+        fflush(error_log_);
+        return -2;
+      }
+    }
+    else if ( client_payload_sent_ == client_payload_out_ring_.ptr_processing->length ) {
+      /* payload completely sent, record it if recording is active */
+      tcp_record_message( TCPRECORD_OUTBOUND, server_ipaddr_, client_payload_out_ring_.ptr_processing->payload, \
+        client_payload_out_ring_.ptr_processing->length, true );
+      tcp_clear_message( client_payload_out_ring_.ptr_processing );
+      tcp_increment_ring_ptr_processing( &client_payload_out_ring_ );
+      client_payload_sent_ = 0;
+      client_payload_id_ ++;
+    }
+  }
   return 0;
 }
 
@@ -657,7 +1039,8 @@ int tcp_client_send_message( void ) {
  * Arguments
  *   message:        [Input]
  *                   string to put as the message
- *                   messages with more than TCPBUFFERSIZE-1 characters will have the end discarded
+ *                   messages with more than TCPBUFFERSIZE-1 characters will have the end discarded,
+ *                   use tcp_client_add_payload_sendqueue for longer messages
  *
  * Return: None
  */
@@ -667,6 +1050,45 @@ void tcp_client_add_message_sendqueue( char* message_ptr ) {
 }
 
 
+/* Add one binary payload to the outbound payload queue of the client
+ * The payload is copied, and is sent in parts by tcp_client_send_message.
+ * It is received as one message with binary set to true.
+ *
+ * Arguments
+ *   data:   [Input] the bytes to send, can contain any value including NULL
+ *   length: [Input] number of bytes, at most TCPMAXPAYLOAD
+ *
+ * Return:
+ *    0: on success
+ *   -1: if the payload is too large or the queue is full, the payload is not sent
+ */
+int tcp_client_add_payload_sendqueue( char* data_ptr, uint32_t length ) {
+  char *payload_ptr;
+
+  if ( length > TCPMAXPAYLOAD ) {
+    print_time();
+    fprintf(error_log_, "Payload of %u bytes is larger than TCPMAXPAYLOAD, not sent\n", length);
+    fflush(error_log_);
+    return -1;
+  }
+
+  payload_ptr = (char *) malloc( length > 0 ? length : 1 );
+  if (payload_ptr == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(1);
+  }
+  memcpy( payload_ptr, data_ptr, length );
+  if ( tcp_add_payload( &client_payload_out_ring_, payload_ptr, length, server_ipaddr_ ) == -1 ) {
+    free( payload_ptr );
+    print_time();
+    fprintf(error_log_, "Payload queue full, payload of %u bytes not sent\n", length);
+    fflush(error_log_);
+    return -1;
+  }
+  return 0;
+}
+
+
 /* Clear the outbound message queue of the client
  * Arguments: None
  *
@@ -674,6 +1096,78 @@ void tcp_client_add_message_sendqueue( char* message_ptr ) {
  */
 void tcp_client_clear_message_sendqueue( void ) {
   tcp_clear_ring( &client_message_out_ring_ );
+  tcp_clear_ring( &client_payload_out_ring_ );
+  client_payload_sent_ = 0;
+  return;
+}
+
+
+/* Get the round trip time to the server measured by the heartbeats
+ * Arguments
+ *   srtt:   [Output] smoothed round trip time in seconds
+ *   rttvar: [Output] round trip time variation in seconds
+ *
+ * Return:
+ *    0: on success
+ *   -1: if no round trip has been measured yet
+ */
+int tcp_client_get_rtt( double *srtt, double *rttvar ) {
+  if ( client_link_.rtt_samples == 0 ) return -1;
+
+  *srtt   = client_link_.srtt;
+  *rttvar = client_link_.rttvar;
+  return 0;
+}
+
+
+/* Get the clock offset of the server measured by the heartbeats
+ * Arguments
+ *   offset_sec: [Output] current offset in seconds, server monotonic_ns()
+ *                        minus client monotonic_ns()
+ *   drift_ppm:  [Output] rate at which the offset changes, in parts per million
+ *
+ * Return:
+ *    0: on success
+ *   -1: if no offset has been measured yet
+ */
+int tcp_client_get_clock( double *offset_sec, double *drift_ppm ) {
+  if ( client_link_.clock_samples == 0 ) return -1;
+
+  *offset_sec = ( client_link_.clock_base_ns + \
+    client_link_.clock_drift * (double)(int64_t)(monotonic_ns() - client_link_.clock_ref_ns) ) * 1e-9;
+  *drift_ppm  = client_link_.clock_drift * 1e6;
+  return 0;
+}
+
+
+/* Convert a monotonic_ns() timestamp taken on the server into the client's
+ * monotonic_ns() timebase, using the clock offset measured by the heartbeats
+ * Arguments
+ *   peer_ns:  [Input]  timestamp from monotonic_ns() on the server
+ *   local_ns: [Output] the same instant in monotonic_ns() of the client
+ *
+ * Return:
+ *    0: on success
+ *   -1: if no offset has been measured yet
+ */
+int tcp_client_peer_to_local_ns( uint64_t peer_ns, uint64_t *local_ns ) {
+  return tcp_link_peer_to_local_ns( &client_link_, peer_ns, local_ns );
+}
+
+
+/* Remove the client socket from epoll and close it, after the server
+ * disconnected. The socket needs to be set up again before reconnecting.
+ * Arguments: None
+ * Return: None
+ */
+void tcp_client_disconnect( void ) {
+  /* Remove the client socket from client_events_monitored_, and do not close the socket */
+  client_events_monitored_.data.fd = -1;
+  epoll_ctl(client_epoll_fd_, EPOLL_CTL_DEL, client_socket_, &client_events_monitored_);
+
+  /* clean up, close socket (needs to be reset before attempting to reconnect)
+   * close epoll */
+  tcp_client_cleanup( );
   return;
 }
 
@@ -706,7 +1200,7 @@ void tcp_ring_init( tcpmessagering_t *ring_ptr ) {
 }
 
 
-/* Clear a message
+/* Clear a message, and free its binary payload if it has one
  *
  * Arguments:
  *   message_ptr: [Input/Output] pointer to a message that is type tcpmessage_t
@@ -716,6 +1210,10 @@ void tcp_ring_init( tcpmessagering_t *ring_ptr ) {
 void tcp_clear_message( tcpmessage_t *message_ptr ) {
   memset( message_ptr->message, '\0', sizeof(message_ptr->message) );
   memset( message_ptr->source_ip, '\0', sizeof(message_ptr->source_ip) );
+  free( message_ptr->payload );
+  message_ptr->payload = NULL;
+  message_ptr->binary  = false;
+  message_ptr->length  = 0;
   return;
 }
 
@@ -793,8 +1291,15 @@ void tcp_add_message( tcpmessagering_t *ring_ptr, char* message_ptr, char* sourc
   strncpy( ring_ptr->ptr_new->message  , message_ptr  , TCPBUFFERSIZE );
   strncpy( ring_ptr->ptr_new->source_ip, source_ip_ptr, IPADDRSIZE    );
   /* Ensure Null Terminate */
-  ring_ptr->ptr_new->message[TCPBUFFERSIZE - 1] = '\0';
+  if ( ring_ptr->ptr_new->message[TCPBUFFERSIZE - 1] != '\0' ) {
+    ring_ptr->ptr_new->message[TCPBUFFERSIZE - 1] = '\0';
+    print_time();
+    fprintf(error_log_, "Message longer than %d characters truncated, send it as a payload instead\n", \
+      TCPBUFFERSIZE - 1);
+    fflush(error_log_);
+  }
   ring_ptr->ptr_new->source_ip[IPADDRSIZE - 1] = '\0';
+  ring_ptr->ptr_new->length = strlen( ring_ptr->ptr_new->message );
 
   /* Increment ptr_new */
   tcp_increment_ring_ptr_new( ring_ptr );
@@ -803,6 +1308,50 @@ void tcp_add_message( tcpmessagering_t *ring_ptr, char* message_ptr, char* sourc
 }
 
 
+/* Add one binary payload to the message ring
+ *
+ * Arguments
+ *   ring_ptr:    [Input/Output]
+ *                pointer to the message ring
+ *   payload_ptr: [Input]
+ *                allocated with malloc, the ring takes ownership and frees it
+ *                when the message is cleared
+ *   length:      [Input]
+ *                number of bytes in the payload
+ *   source_ip:   [Input]
+ *                string to put as the source ip address for this new message
+ *
+ * Unlike the messages, a full ring is not cleared: the payload at the head may
+ * be partly sent, so the new payload is refused instead.
+ *
+ * Return:
+ *    0: on success
+ *   -1: if the ring is full, the payload is not added and the caller still owns it
+ */
+int tcp_add_payload( tcpmessagering_t *ring_ptr, char* payload_ptr, uint32_t length, char* source_ip_ptr) {
+  tcpmessage_t *next_ptr;
+
+  /* the ring is full if ptr_new would catch up with ptr_processing */
+  next_ptr = ( ring_ptr->ptr_new == ring_ptr->ptr_end ) ? ring_ptr->ptr_start : ring_ptr->ptr_new + 1;
+  if ( next_ptr == ring_ptr->ptr_processing ) return -1;
+
+  /* First clear the address */
+  tcp_clear_message( ring_ptr->ptr_new );
+
+  /* write to the ring */
+  strncpy( ring_ptr->ptr_new->source_ip, source_ip_ptr, IPADDRSIZE - 1 );
+  ring_ptr->ptr_new->source_ip[IPADDRSIZE - 1] = '\0';
+  ring_ptr->ptr_new->binary  = true;
+  ring_ptr->ptr_new->payload = payload_ptr;
+  ring_ptr->ptr_new->length  = length;
+
+  /* Increment ptr_new */
+  ring_ptr->ptr_new = next_ptr;
+
+  return 0;
+}
+
+
 /* Process one message in the message ring
  *
  * Arguments
@@ -851,4 +1400,389 @@ void tcp_clear_ring( tcpmessagering_t *ring_ptr ) {
    * before new data is writen to it, see tcp_add_message */
 
   return;
-}
\ No newline at end of file
+}
+
+
+/***************************** Heartbeat Functions *****************************/
+/* Reset the heartbeat state of a connection, when it is (re)established
+ *
+ * Arguments:
+ *   link_ptr: [Input/Output] pointer to the heartbeat state of the connection
+ *
+ * Return: None
+ */
+void tcp_link_reset( tcplink_t *link_ptr ) {
+  uint64_t now_ns;
+
+  now_ns = monotonic_ns();
+  link_ptr->last_receive_ns = now_ns;
+  link_ptr->last_ping_ns    = now_ns;
+  link_ptr->srtt            = 0.0;
+  link_ptr->rttvar          = 0.0;
+  link_ptr->rtt_samples     = 0;
+  link_ptr->clock_samples   = 0;
+  link_ptr->rx_bytes        = 0;
+  /* drop a payload left over from the previous connection */
+  free( link_ptr->rx_payload_ptr );
+  link_ptr->rx_payload_ptr  = NULL;
+  return;
+}
+
+
+/* Update the smoothed round trip time and its variation with a new
+ * measurement, using the estimator of RFC 6298 (gains 1/8 and 1/4)
+ *
+ * Arguments:
+ *   link_ptr: [Input/Output] pointer to the heartbeat state of the connection
+ *   rtt_ns:   [Input]        measured round trip time in nanoseconds
+ *
+ * Return: None
+ */
+void tcp_link_update_rtt( tcplink_t *link_ptr, uint64_t rtt_ns ) {
+  double rtt;
+
+  rtt = rtt_ns * 1e-9;
+  if ( link_ptr->rtt_samples == 0 ) {
+    /* first measurement */
+    link_ptr->srtt   = rtt;
+    link_ptr->rttvar = rtt / 2.0;
+  }
+  else {
+    link_ptr->rttvar = 0.75 * link_ptr->rttvar + 0.25 * fabs( link_ptr->srtt - rtt );
+    link_ptr->srtt   = 0.875 * link_ptr->srtt + 0.125 * rtt;
+  }
+  link_ptr->rtt_samples ++;
+  return;
+}
+
+
+/* Update the clock offset estimate with the timestamps of one heartbeat
+ * The offset and delay of the heartbeat are computed as in NTP. The estimate is
+ * a least squares line through the offsets of the last TCPCLOCKWINDOW
+ * heartbeats, leaving out the ones with a delay of more than twice the
+ * smallest, as those were most likely held up in one direction only.
+ *
+ * Arguments:
+ *   link_ptr: [Input/Output] pointer to the heartbeat state of the connection
+ *   t1:       [Input]        local time the heartbeat was sent
+ *   t2:       [Input]        peer time the heartbeat was received
+ *   t3:       [Input]        peer time the reply was sent
+ *   t4:       [Input]        local time the reply was received
+ *
+ * Return: None
+ */
+void tcp_link_update_clock( tcplink_t *link_ptr, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4 ) {
+  int i, n, m, index;
+  uint64_t ref_ns;
+  int64_t ref_offset_ns;
+  double min_delay_ns, x, y, sx, sy, sxx, sxy, denom, a, b;
+
+  /* store the new sample, at the local time halfway through the round trip */
+  index = link_ptr->clock_samples % TCPCLOCKWINDOW;
+  link_ptr->clock_time_ns[index]   = t1 + (t4 - t1) / 2;
+  link_ptr->clock_offset_ns[index] = ( (int64_t)(t2 - t1) + (int64_t)(t3 - t4) ) / 2;
+  link_ptr->clock_delay_ns[index]  = (double)(int64_t)(t4 - t1) - (double)(int64_t)(t3 - t2);
+  link_ptr->clock_samples ++;
+
+  n = link_ptr->clock_samples < TCPCLOCKWINDOW ? link_ptr->clock_samples : TCPCLOCKWINDOW;
+
+  /* smallest delay in the window */
+  min_delay_ns = link_ptr->clock_delay_ns[0];
+  for ( i = 1; i < n; i++ ) {
+    if ( link_ptr->clock_delay_ns[i] < min_delay_ns ) min_delay_ns = link_ptr->clock_delay_ns[i];
+  }
+
+  /* least squares fit relative to the newest sample, which keeps the sums small */
+  ref_ns        = link_ptr->clock_time_ns[index];
+  ref_offset_ns = link_ptr->clock_offset_ns[index];
+  m = 0;
+  sx = sy = sxx = sxy = 0.0;
+  for ( i = 0; i < n; i++ ) {
+    if ( link_ptr->clock_delay_ns[i] > 2.0 * min_delay_ns ) continue;
+    x = (double)(int64_t)(link_ptr->clock_time_ns[i] - ref_ns);
+    y = (double)(link_ptr->clock_offset_ns[i] - ref_offset_ns);
+    sx  += x;
+    sy  += y;
+    sxx += x * x;
+    sxy += x * y;
+    m ++;
+  }
+
+  denom = m * sxx - sx * sx;
+  if ( m >= 2 && denom > 0.0 ) {
+    b = ( m * sxy - sx * sy ) / denom;
+    a = ( sy - b * sx ) / m;
+  }
+  else {
+    /* not enough samples for a drift yet, keep the previous one */
+    b = ( link_ptr->clock_samples > 1 ) ? link_ptr->clock_drift : 0.0;
+    a = ( m > 0 ) ? sy / m : 0.0;
+  }
+
+  link_ptr->clock_ref_ns  = ref_ns;
+  link_ptr->clock_base_ns = ref_offset_ns + (int64_t) llround( a );
+  link_ptr->clock_drift   = b;
+  return;
+}
+
+
+/* Convert a peer monotonic_ns() timestamp into the local timebase
+ *
+ * Arguments:
+ *   link_ptr: [Input]  pointer to the heartbeat state of the connection
+ *   peer_ns:  [Input]  timestamp from monotonic_ns() on the peer
+ *   local_ns: [Output] the same instant in the local monotonic_ns()
+ *
+ * Return:
+ *    0: on success
+ *   -1: if no offset has been measured yet
+ */
+int tcp_link_peer_to_local_ns( tcplink_t *link_ptr, uint64_t peer_ns, uint64_t *local_ns ) {
+  uint64_t guess_ns;
+
+  if ( link_ptr->clock_samples == 0 ) return -1;
+
+  /* the offset depends on the local time itself, which is first approximated
+   * with the base offset only */
+  guess_ns  = peer_ns - link_ptr->clock_base_ns;
+  *local_ns = guess_ns - (int64_t) llround( link_ptr->clock_drift * \
+    (double)(int64_t)(guess_ns - link_ptr->clock_ref_ns) );
+  return 0;
+}
+
+
+/* Send a control frame directly on a socket, bypassing the message rings
+ * Every frame carries three timestamps: the echoed send time of the frame it
+ * replies to, the time that frame was received, and the send time of this
+ * frame. The first two are 0 for a ping.
+ *
+ * Arguments:
+ *   sd:         [Input] socket descriptor
+ *   type:       [Input] TCPCTRL_PING or TCPCTRL_PONG
+ *   echo_ns:    [Input] send time of the frame replied to
+ *   receive_ns: [Input] receive time of the frame replied to
+ *
+ * Return: the return value of send
+ */
+int tcp_send_control( int sd, char type, uint64_t echo_ns, uint64_t receive_ns ) {
+  char frame[TCPBUFFERSIZE];
+
+  memset( frame, '\0', sizeof(frame) );
+  frame[0] = TCPCTRL_PREFIX;
+  frame[1] = type;
+  snprintf( frame + 2, TCPBUFFERSIZE - 2, "%" PRIu64 " %" PRIu64 " %" PRIu64, \
+    echo_ns, receive_ns, monotonic_ns() );
+
+  return send( sd, frame, TCPBUFFERSIZE, 0 );
+}
+
+
+/* Handle a received control frame
+ *
+ * Arguments:
+ *   sd:        [Input]        socket descriptor the frame was received on
+ *   link_ptr:  [Input/Output] pointer to the heartbeat state of the connection,
+ *                             last_receive_ns should be the receive time of this frame
+ *   frame_ptr: [Input]        the received frame
+ *   ring_ptr:  [Input/Output] ring that receives reassembled payloads
+ *   source_ip: [Input]        IP address string of the other end
+ *
+ * Return: None
+ */
+void tcp_handle_control( int sd, tcplink_t *link_ptr, char *frame_ptr, \
+  tcpmessagering_t *ring_ptr, char* source_ip_ptr ) {
+  uint64_t echo_ns, receive_ns, send_ns, now_ns;
+  int64_t rtt_ns;
+
+  /* payload frames carry binary data instead of timestamps */
+  if ( frame_ptr[1] == TCPCTRL_CHUNK ) {
+    tcp_handle_chunk( link_ptr, frame_ptr, ring_ptr, source_ip_ptr );
+    return;
+  }
+
+  if ( sscanf( frame_ptr + 2, "%" SCNu64 " %" SCNu64 " %" SCNu64, \
+        &echo_ns, &receive_ns, &send_ns ) != 3 ) return;
+
+  switch (frame_ptr[1]) {
+  case TCPCTRL_PING:
+    /* reply with the timestamps, so the other end can compute the round trip
+     * and the clock offset */
+    tcp_send_control( sd, TCPCTRL_PONG, send_ns, link_ptr->last_receive_ns );
+    break;
+  case TCPCTRL_PONG:
+    /* the echoed timestamp is our own send time, the time spent by the other
+     * end between receiving and replying is not part of the round trip */
+    now_ns = link_ptr->last_receive_ns;
+    rtt_ns = (int64_t)(now_ns - echo_ns) - (int64_t)(send_ns - receive_ns);
+    tcp_link_update_rtt( link_ptr, rtt_ns > 0 ? rtt_ns : 0 );
+    tcp_link_update_clock( link_ptr, echo_ns, receive_ns, send_ns, now_ns );
+    break;
+  default:
+    break;
+  }
+  return;
+}
+
+
+/************************* Frame and Payload Functions *************************/
+/* Read from a socket into the frame buffer of a connection, without waiting
+ * TCP does not keep the boundaries between frames, a read can return part of a
+ * frame, so the frame is accumulated over several reads until it is complete.
+ * The connection is marked alive whenever a frame is complete.
+ * The reads do not block, only the sends of the socket do, so it is called in
+ * a loop until it returns -1 to take every frame that arrived.
+ *
+ * Arguments:
+ *   sd:       [Input]        socket descriptor to read from
+ *   link_ptr: [Input/Output] pointer to the state of the connection
+ *
+ * Return:
+ *   TCPBUFFERSIZE: if a complete frame is in link_ptr->rx_frame
+ *    0: if the other end disconnected
+ *   -1: with errno EAGAIN or EWOULDBLOCK if nothing more is received yet, the
+ *       frame may be incomplete, or with another errno if the read failed
+ */
+int tcp_link_read( int sd, tcplink_t *link_ptr ) {
+  int bytes_read;
+
+  while ( link_ptr->rx_bytes < TCPBUFFERSIZE ) {
+    bytes_read = recv( sd, link_ptr->rx_frame + link_ptr->rx_bytes, \
+      TCPBUFFERSIZE - link_ptr->rx_bytes, MSG_DONTWAIT );
+    if ( bytes_read == 0 ) return 0;
+    if ( bytes_read < 0 ) {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+    link_ptr->rx_bytes += bytes_read;
+  }
+
+  /* Frame complete, anything received shows that the other end is still alive */
+  link_ptr->rx_bytes = 0;
+  link_ptr->last_receive_ns = monotonic_ns();
+  return TCPBUFFERSIZE;
+}
+
+
+/* Send the next frame of a binary payload
+ *
+ * Arguments:
+ *   sd:              [Input]        socket descriptor
+ *   payload_msg_ptr: [Input]        message holding the payload
+ *   sent_ptr:        [Input/Output] number of payload bytes already sent,
+ *                                   advanced when the send succeeds
+ *   payload_id:      [Input]        id of this payload, the same for all its frames
+ *
+ * Return: the return value of send
+ */
+int tcp_send_chunk( int sd, tcpmessage_t *payload_msg_ptr, uint32_t *sent_ptr, uint8_t payload_id ) {
+  char frame[TCPBUFFERSIZE];
+  uint32_t remaining, total_n;
+  uint16_t chunk, chunk_n;
+  int returnval;
+
+  remaining = payload_msg_ptr->length - *sent_ptr;
+  chunk = remaining < TCPCHUNK_DATASIZE ? remaining : TCPCHUNK_DATASIZE;
+
+  memset( frame, '\0', sizeof(frame) );
+  frame[0] = TCPCTRL_PREFIX;
+  frame[1] = TCPCTRL_CHUNK;
+  frame[2] = ( *sent_ptr == 0 ? TCPCHUNK_FIRST : 0 ) | ( chunk == remaining ? TCPCHUNK_LAST : 0 );
+  frame[3] = payload_id;
+  total_n = htonl( payload_msg_ptr->length );
+  chunk_n = htons( chunk );
+  memcpy( frame + 4, &total_n, 4 );
+  memcpy( frame + 8, &chunk_n, 2 );
+  memcpy( frame + TCPCHUNK_HEADERSIZE, payload_msg_ptr->payload + *sent_ptr, chunk );
+
+  returnval = send( sd, frame, TCPBUFFERSIZE, 0 );
+  if ( returnval != -1 ) *sent_ptr += chunk;
+  return returnval;
+}
+
+
+/* Handle a received payload frame, and add the payload to the ring once all
+ * its frames are received. Only one payload per connection is reassembled at a
+ * time, so the memory used is bounded by TCPMAXPAYLOAD.
+ *
+ * Arguments:
+ *   link_ptr:  [Input/Output] pointer to the state of the connection
+ *   frame_ptr: [Input]        the received frame
+ *   ring_ptr:  [Input/Output] ring that receives the reassembled payload
+ *   source_ip: [Input]        IP address string of the other end
+ *
+ * Return: None
+ */
+void tcp_handle_chunk( tcplink_t *link_ptr, char *frame_ptr, tcpmessagering_t *ring_ptr, char* source_ip_ptr ) {
+  uint8_t flags, payload_id;
+  uint32_t total;
+  uint16_t chunk;
+
+  flags      = (uint8_t) frame_ptr[2];
+  payload_id = (uint8_t) frame_ptr[3];
+  memcpy( &total, frame_ptr + 4, 4 );
+  memcpy( &chunk, frame_ptr + 8, 2 );
+  total = ntohl( total );
+  chunk = ntohs( chunk );
+  if ( chunk > TCPCHUNK_DATASIZE ) return;
+
+  if ( flags & TCPCHUNK_FIRST ) {
+    /* a new payload replaces one that was never completed */
+    free( link_ptr->rx_payload_ptr );
+    link_ptr->rx_payload_ptr = NULL;
+
+    if ( total > TCPMAXPAYLOAD ) {
+      print_time();
+      fprintf(error_log_, "Payload of %u bytes from %s is larger than TCPMAXPAYLOAD, discarded\n", \
+        total, source_ip_ptr);
+      fflush(error_log_);
+      return;
+    }
+    link_ptr->rx_payload_ptr = (char *) malloc( total > 0 ? total : 1 );
+    if ( link_ptr->rx_payload_ptr == NULL ) {
+      fprintf(stderr, "Out of memory!\n");
+      exit(1);
+    }
+    link_ptr->rx_payload_length   = total;
+    link_ptr->rx_payload_received = 0;
+    link_ptr->rx_payload_id       = payload_id;
+  }
+  else if ( link_ptr->rx_payload_ptr == NULL || payload_id != link_ptr->rx_payload_id ) {
+    /* the start of this payload was discarded or missed */
+    return;
+  }
+
+  if ( link_ptr->rx_payload_received + chunk > link_ptr->rx_payload_length ) {
+    print_time();
+    fprintf(error_log_, "Malformed payload from %s, discarded\n", source_ip_ptr);
+    fflush(error_log_);
+    free( link_ptr->rx_payload_ptr );
+    link_ptr->rx_payload_ptr = NULL;
+    return;
+  }
+
+  memcpy( link_ptr->rx_payload_ptr + link_ptr->rx_payload_received, frame_ptr + TCPCHUNK_HEADERSIZE, chunk );
+  link_ptr->rx_payload_received += chunk;
+
+  if ( flags & TCPCHUNK_LAST ) {
+    if ( link_ptr->rx_payload_received == link_ptr->rx_payload_length ) {
+      /* Record the payload if recording is active */
+      tcp_record_message( TCPRECORD_INBOUND, source_ip_ptr, link_ptr->rx_payload_ptr, \
+        link_ptr->rx_payload_length, true );
+      /* the ring takes over the buffer */
+      if ( tcp_add_payload( ring_ptr, link_ptr->rx_payload_ptr, link_ptr->rx_payload_length, source_ip_ptr ) == -1 ) {
+        print_time();
+        fprintf(error_log_, "Ring full, payload from %s discarded\n", source_ip_ptr);
+        fflush(error_log_);
+        free( link_ptr->rx_payload_ptr );
+      }
+    }
+    else {
+      print_time();
+      fprintf(error_log_, "Incomplete payload from %s, discarded\n", source_ip_ptr);
+      fflush(error_log_);
+      free( link_ptr->rx_payload_ptr );
+    }
+    link_ptr->rx_payload_ptr = NULL;
+  }
+  return;
+}
@@ -0,0 +1,324 @@
+#include "CLibrary.h"
+/************************************ Note ************************************/
+/*
+ * Record and replay of TCP message streams
+ *
+ * While recording is active, every message added to an inbound ring and every
+ * message successfully sent is appended to a binary log file, together with a
+ * monotonic timestamp (relative to the start of the recording), the direction
+ * and the IPv4 address of the peer.
+ *
+ * The log is written through a memory mapping of the file, so recording a
+ * message is a memcpy and does not cost a system call. The mapping is grown
+ * by TCPRECORD_CHUNK zero filled bytes whenever it is full. The header keeps
+ * the number of bytes of records written so far, so a log that was not
+ * stopped (crash, kill) is replayed up to its last record and not into the
+ * zero filled end.
+ *
+ * tcp_replay reads a log back and feeds the inbound messages into a processing
+ * function, either with the original timing or as fast as possible.
+ *
+ * File layout (native byte order, the log is meant to be replayed on the same
+ * kind of machine it was recorded on):
+ *   header: char magic[8] = "CLTCPREC", uint32_t version, uint32_t reserved,
+ *           uint64_t length (bytes of records after the header)
+ *   record: uint64_t time_ns, uint32_t peer, uint32_t length,
+ *           uint8_t direction, uint8_t flags, uint16_t reserved,
+ *           followed by length bytes
+ */
+
+#define TCPRECORD_MAGIC   "CLTCPREC"
+#define TCPRECORD_VERSION 3
+#define TCPRECORD_CHUNK   (1<<20) /* mapping growth step, 1 MiB */
+
+#define TCPRECORD_HEADERSIZE 24 /* bytes in the file header   */
+#define TCPRECORD_ENTRYSIZE  20 /* bytes in a record header   */
+
+#define TCPRECORD_FLAG_BINARY 0x01 /* the record is a binary payload */
+
+
+/************ Static Variables Available in and only in this file ************/
+static int record_fd_ = -1;      /* file descriptor of the log, -1 if not recording */
+static char *record_map_ = NULL; /* start of the memory mapping                     */
+static size_t record_mapsize_;   /* size of the mapping (and of the file)           */
+static size_t record_offset_;    /* write position in the mapping                   */
+static uint64_t record_start_ns_;/* monotonic time at the start of the recording    */
+
+
+/************ Static Functions Limited to Access within this File ************/
+static int tcp_record_grow( size_t min_size );
+
+
+
+/* Start recording all TCP messages into a binary log file
+ * An existing file with the same name is overwritten
+ *
+ * Arguments:
+ *   filename: [Input] path of the log file
+ * Return:
+ *    0: on success
+ *   -1: on failure
+ */
+int tcp_record_start( char* filename ) {
+  uint32_t version, reserved;
+  uint64_t length;
+
+  /* Stop a recording that is already running */
+  if (record_fd_ != -1) tcp_record_stop( );
+
+  record_fd_ = open( filename, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if (record_fd_ == -1) {
+    print_time();
+    fprintf(error_log_, "Could not open TCP record file %s, errno code %i\n", filename, errno);
+    fflush(error_log_);
+    return -1;
+  }
+
+  record_map_     = NULL;
+  record_mapsize_ = 0;
+  if (tcp_record_grow( TCPRECORD_CHUNK ) == -1) {
+    close( record_fd_ );
+    record_fd_ = -1;
+    return -1;
+  }
+
+  /* write the file header */
+  version  = TCPRECORD_VERSION;
+  reserved = 0;
+  length   = 0;
+  memcpy( record_map_     , TCPRECORD_MAGIC, 8 );
+  memcpy( record_map_ +  8, &version , 4 );
+  memcpy( record_map_ + 12, &reserved, 4 );
+  memcpy( record_map_ + 16, &length  , 8 );
+  record_offset_ = TCPRECORD_HEADERSIZE;
+
+  record_start_ns_ = monotonic_ns();
+
+  return 0;
+}
+
+
+/* Stop recording, truncate the log file to its content and close it
+ * Arguments: None
+ * Return: None
+ */
+void tcp_record_stop( void ) {
+  if (record_fd_ == -1) return;
+
+  if (record_map_ != NULL) {
+    msync( record_map_, record_offset_, MS_SYNC );
+    munmap( record_map_, record_mapsize_ );
+  }
+  if (ftruncate( record_fd_, record_offset_ ) == -1) {
+    print_time();
+    fprintf(error_log_, "Could not truncate TCP record file, errno code %i\n", errno);
+    fflush(error_log_);
+  }
+  close( record_fd_ );
+
+  record_fd_  = -1;
+  record_map_ = NULL;
+  return;
+}
+
+
+/* Append one message to the log, does nothing if recording is not active
+ * This is called by the TCP functions, and does not need to be called by the
+ * user
+ *
+ * Arguments:
+ *   direction:   [Input] TCPRECORD_INBOUND or TCPRECORD_OUTBOUND
+ *   peer_ip_ptr: [Input] IP address string of the other end of the connection
+ *   data_ptr:    [Input] message text or binary payload
+ *   length:      [Input] number of bytes in the message
+ *   binary:      [Input] true if this is a binary payload
+ * Return: None
+ */
+void tcp_record_message( int direction, char* peer_ip_ptr, char* data_ptr, uint32_t length, bool binary ) {
+  uint64_t time_ns, committed;
+  uint32_t peer;
+  uint8_t  dir8, flags;
+  uint16_t reserved;
+  char *ptr;
+
+  if (record_fd_ == -1) return;
+
+  /* make sure the record fits in the mapping */
+  if (record_offset_ + TCPRECORD_ENTRYSIZE + length > record_mapsize_) {
+    if (tcp_record_grow( record_offset_ + TCPRECORD_ENTRYSIZE + length ) == -1) {
+      /* stop recording rather than writting a corrupted log */
+      tcp_record_stop( );
+      return;
+    }
+  }
+
+  time_ns  = monotonic_ns() - record_start_ns_;
+  peer     = inet_addr( peer_ip_ptr );
+  dir8     = (uint8_t) direction;
+  flags    = binary ? TCPRECORD_FLAG_BINARY : 0;
+  reserved = 0;
+
+  ptr = record_map_ + record_offset_;
+  memcpy( ptr     , &time_ns , 8 );
+  memcpy( ptr +  8, &peer    , 4 );
+  memcpy( ptr + 12, &length  , 4 );
+  memcpy( ptr + 16, &dir8    , 1 );
+  memcpy( ptr + 17, &flags   , 1 );
+  memcpy( ptr + 18, &reserved, 2 );
+  memcpy( ptr + TCPRECORD_ENTRYSIZE, data_ptr, length );
+
+  /* the record is complete, count it in the header */
+  record_offset_ += TCPRECORD_ENTRYSIZE + length;
+  committed = record_offset_ - TCPRECORD_HEADERSIZE;
+  memcpy( record_map_ + 16, &committed, 8 );
+  return;
+}
+
+
+/* Replay the inbound messages of a log file into a processing function
+ *
+ * Arguments
+ *   filename:            [Input]
+ *                        path of the log file
+ *   processing_func_ptr: [Input]
+ *                        pointer to the function that is used for processsing,
+ *                        this function should take (tcpmessage_t *) as an input
+ *                        this function will be executed once for every inbound
+ *                        message in the log, in the recorded order, binary
+ *                        payloads are passed with binary set to true
+ *   realtime:            [Input]
+ *                        true to reproduce the original timing between messages
+ *                        false to replay as fast as possible
+ *
+ * Return:
+ *   on success: number of messages replayed
+ *   on failure: -1
+ */
+int tcp_replay( char* filename, void (*processing_func_ptr)(tcpmessage_t *), bool realtime ) {
+  int fd, count;
+  struct stat file_stat;
+  char *map, *ptr, *map_end;
+  uint32_t version, peer, length;
+  uint64_t time_ns, start_ns, now_ns, committed;
+  uint8_t dir8, flags;
+  struct in_addr peer_addr;
+  tcpmessage_t message;
+
+  fd = open( filename, O_RDONLY );
+  if (fd == -1) return -1;
+  if (fstat( fd, &file_stat ) == -1 || file_stat.st_size < TCPRECORD_HEADERSIZE) {
+    close( fd );
+    return -1;
+  }
+
+  map = (char *) mmap( NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if (map == MAP_FAILED) return -1;
+  map_end = map + file_stat.st_size;
+
+  /* check the file header */
+  memcpy( &version, map + 8, 4 );
+  if (memcmp( map, TCPRECORD_MAGIC, 8 ) != 0 || version != TCPRECORD_VERSION) {
+    print_time();
+    fprintf(error_log_, "%s is not a TCP record file\n", filename);
+    fflush(error_log_);
+    munmap( map, file_stat.st_size );
+    return -1;
+  }
+
+  /* only replay the records counted in the header, the rest of the file can
+   * be the zero filled end of a recording that was not stopped */
+  memcpy( &committed, map + 16, 8 );
+  if (committed < (uint64_t) (map_end - map - TCPRECORD_HEADERSIZE)) {
+    map_end = map + TCPRECORD_HEADERSIZE + committed;
+  }
+
+  count = 0;
+  start_ns = monotonic_ns();
+  ptr = map + TCPRECORD_HEADERSIZE;
+  while (ptr + TCPRECORD_ENTRYSIZE <= map_end) {
+    memcpy( &time_ns, ptr     , 8 );
+    memcpy( &peer   , ptr +  8, 4 );
+    memcpy( &length , ptr + 12, 4 );
+    memcpy( &dir8   , ptr + 16, 1 );
+    memcpy( &flags  , ptr + 17, 1 );
+    /* stop on a truncated or invalid record */
+    if (length > map_end - ptr - TCPRECORD_ENTRYSIZE) break;
+    if (dir8 != TCPRECORD_INBOUND && dir8 != TCPRECORD_OUTBOUND) break;
+
+    if (dir8 == TCPRECORD_INBOUND) {
+      /* wait until the original time of the message */
+      if (realtime) {
+        now_ns = monotonic_ns() - start_ns;
+        if (time_ns > now_ns) nsleep( time_ns - now_ns );
+      }
+
+      /* rebuild the message as it was in the ring */
+      memset( &message, '\0', sizeof(message) );
+      if (flags & TCPRECORD_FLAG_BINARY) {
+        message.binary  = true;
+        message.payload = (char *) malloc( length > 0 ? length : 1 );
+        if (message.payload == NULL) {
+          fprintf(stderr, "Out of memory!\n");
+          exit(1);
+        }
+        memcpy( message.payload, ptr + TCPRECORD_ENTRYSIZE, length );
+        message.length = length;
+      }
+      else {
+        memcpy( message.message, ptr + TCPRECORD_ENTRYSIZE, \
+          length < TCPBUFFERSIZE ? length : TCPBUFFERSIZE - 1 );
+        message.length = strlen( message.message );
+      }
+      peer_addr.s_addr = peer;
+      strncpy( message.source_ip, inet_ntoa(peer_addr), IPADDRSIZE - 1 );
+
+      (*processing_func_ptr)( &message );
+      free( message.payload );
+      count ++;
+    }
+
+    ptr += TCPRECORD_ENTRYSIZE + length;
+  }
+
+  munmap( map, file_stat.st_size );
+  return count;
+}
+
+
+/* Grow the log file and its mapping
+ *
+ * Arguments:
+ *   min_size: [Input] the minimum size needed, the new size is rounded up to a
+ *                     multiple of TCPRECORD_CHUNK
+ * Return:
+ *    0: on success
+ *   -1: on failure
+ */
+int tcp_record_grow( size_t min_size ) {
+  size_t new_size;
+
+  new_size = ((min_size + TCPRECORD_CHUNK - 1) / TCPRECORD_CHUNK) * TCPRECORD_CHUNK;
+
+  if (record_map_ != NULL) munmap( record_map_, record_mapsize_ );
+  record_map_ = NULL;
+
+  if (ftruncate( record_fd_, new_size ) == -1) {
+    print_time();
+    fprintf(error_log_, "Could not grow TCP record file, errno code %i\n", errno);
+    fflush(error_log_);
+    return -1;
+  }
+
+  record_map_ = (char *) mmap( NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, record_fd_, 0 );
+  if (record_map_ == MAP_FAILED) {
+    record_map_ = NULL;
+    print_time();
+    fprintf(error_log_, "Could not map TCP record file, errno code %i\n", errno);
+    fflush(error_log_);
+    return -1;
+  }
+
+  record_mapsize_ = new_size;
+  return 0;
+}
@@ -41,3 +41,11 @@ int current_time(void) {
   return timeint;
 }
 
+
+/* Monotonic time in nanoseconds, not affected by changes to the wall clock.
+ * Only differences between two values are meaningful. */
+uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+}
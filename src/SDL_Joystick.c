@@ -1,20 +1,53 @@
 #include <CLibrary.h>
 #include <SDL.h>
+#include <MySDL.h>
+#include <sys/eventfd.h>
 
+#define JOYSTICK_EVENT_BATCH 64      /* events taken from the SDL queue at once    */
+#define JOYSTICK_PUMP_NS     4000000 /* SDL polling period behind Joystick_Event_Fd */
+#define JOYSTICK_SERVICE_MS  100     /* longest wait of the input service thread   */
+#define JOYSTICK_STATE_WORDS ((sizeof(joystickstate_t) + 7) / 8) /* snapshot size in 64-bit words */
+
+
+/* joystick used by the functions without a joystick argument */
+static joystick_t default_joystick_ = { .instance_id = -1 };
+
+/* open joysticks, the events of each device go to the one with its instance */
+static joystick_t *devices_[JOYSTICKMAXDEVICES];
+static int n_devices_ = 0;
 
-static SDL_Joystick *joystick_ = NULL;
 static SDL_Event event_;
+static SDL_Event events_[JOYSTICK_EVENT_BATCH];
 
-static int n_axis_, n_button_sl_, n_button_sh_;
-static double long_press_sec_, hold_sec_;
+/* eventfd signaled when SDL queues an event, and the thread that pumps SDL for it */
+static int event_fd_ = -1;
+static bool pump_running_ = false;
+static pthread_t pump_thread_;
 
-static int *axis_name_, *axis_max_, *axis_min_, *axis_dz_, *axis_inv_;
-static int *button_name_sl_, *button_name_sh_;
-static clock_t *button_press_time_sl_, *button_press_time_sh_;
+/* input service thread, updating the joysticks for Joystick_Service_Read */
+static bool service_running_ = false;
+static pthread_t service_thread_;
 
 
 static double axis_value_2_double( int axis_value, int axis_min, int axis_max, \
   int axis_dz, int axis_inv );
+static void Joystick_Init_Slots( int *slots, const int *names, int n_names );
+static joystick_t *Joystick_Find( int instance_id );
+static void Joystick_Handle_Event( const SDL_Event *event_ptr, uint64_t time_ns );
+static void Joystick_Device_Added( int device_index );
+static void Joystick_Device_Removed( int instance_id );
+static void Joystick_Copy_Values( joystick_t *joy_ptr, double *axis_value, \
+  int *button_value_sl, int *button_value_sh, bool to_joystick );
+static int Joystick_Event_Watch( void *userdata, SDL_Event *event_ptr );
+static uint64_t Joystick_Event_Ns( const SDL_Event *event_ptr, uint64_t now_ns, Uint32 now_ticks );
+static uint64_t Joystick_Hold_Deadline( joystick_t *joy_ptr, int slot );
+static void Joystick_Hold_Push( joystick_t *joy_ptr, int slot );
+static void Joystick_Hold_Remove( joystick_t *joy_ptr, int slot );
+static void Joystick_Hold_Sift( joystick_t *joy_ptr, int index );
+static void Joystick_Hold_Expire( joystick_t *joy_ptr, uint64_t until_ns );
+static void Joystick_Publish( joystick_t *joy_ptr );
+static void *Joystick_Pump_Thread( void *dummy );
+static void *Joystick_Service_Thread( void *dummy );
 
 
 
@@ -31,39 +64,7 @@ static double axis_value_2_double( int axis_value, int axis_min, int axis_max, \
  *   0 on success, -1 on failure
  */
 int Joystick_Init( int device_num, int n_axis, int n_button_sl, int n_button_sh ) {
-  n_axis_ = n_axis;
-  n_button_sl_ = n_button_sl;
-  n_button_sh_ = n_button_sh;
-
-  /* Initialize SDL */
-  SDL_Init( SDL_INIT_JOYSTICK );
-
-  /* Check if joystick is connected */
-  if (SDL_NumJoysticks() == 0) {
-    print_time();
-    fprintf(error_log_, "No joystick found. Exiting.\n");
-    fflush(error_log_);
-    return -1;
-  }
-
-  /* Open joystick */
-  joystick_ = SDL_JoystickOpen( device_num );
-  /* Display joystick information */
-  if (joystick_) {
-    printf("Joystick opened: %s\n", SDL_JoystickName(joystick_));
-    printf("Total number of    axes: %d\n", SDL_JoystickNumAxes(joystick_));
-    printf("Total number of buttons: %d\n\n", SDL_JoystickNumButtons(joystick_));
-    printf("Initializing %d axis, %d buttons with short/long press, %d buttons wiht short press/hold\n", \
-      n_axis_, n_button_sl_, n_button_sh_ );
-  }
-  else {
-    print_time();
-    fprintf(error_log_, "Could not open joystick %d.\n", device_num);
-    fflush(error_log_);
-    return -1;
-  }
-
-  return 0;
+  return Joystick_Dev_Open( &default_joystick_, device_num, n_axis, n_button_sl, n_button_sh );
 }
 
 
@@ -86,24 +87,7 @@ int Joystick_Init( int device_num, int n_axis, int n_button_sl, int n_button_sh
  */
 void Joystick_Init_Axis( const int *axis_name, const int *axis_min, const int *axis_max, \
   const int *axis_dz, const int* axis_inv){
-  int ii;
-
-  /* allocate static array */
-  axis_name_ = (int *) calloc(n_axis_, sizeof(int));
-  axis_max_  = (int *) calloc(n_axis_, sizeof(int));
-  axis_min_  = (int *) calloc(n_axis_, sizeof(int));
-  axis_dz_   = (int *) calloc(n_axis_, sizeof(int));
-  axis_inv_  = (int *) calloc(n_axis_, sizeof(int));
-
-  /* copy the values to the static arrays */
-  for ( ii = 0; ii < n_axis_; ii++ ) {
-    *(axis_name_ + ii) = *(axis_name + ii);
-    *(axis_max_  + ii) = *(axis_max  + ii);
-    *(axis_min_  + ii) = *(axis_min  + ii);
-    *(axis_dz_   + ii) = *(axis_dz   + ii);
-    *(axis_inv_  + ii) = *(axis_inv  + ii);
-  }
-
+  Joystick_Dev_Init_Axis( &default_joystick_, axis_name, axis_min, axis_max, axis_dz, axis_inv );
   return;
 }
 
@@ -119,21 +103,7 @@ void Joystick_Init_Axis( const int *axis_name, const int *axis_min, const int *a
  *   None
  */
 void Joystick_Init_Button_SL( const int *button_name, double long_press_sec){
-  int ii;
-
-
-  long_press_sec_ = long_press_sec;
-  printf("Long press length: %5.1f sec\n", long_press_sec_);
-
-  /* allocate static array */
-  button_name_sl_ = (int *) calloc(n_button_sl_, sizeof(int));
-  /* allocate press time array */
-  button_press_time_sl_ = (clock_t *) calloc(n_button_sl_, sizeof(clock_t));
-
-  /* copy the values to the static array */
-  for ( ii = 0; ii < n_button_sl_; ii++ ) {
-    *(button_name_sl_ + ii) = *(button_name + ii);
-  }
+  Joystick_Dev_Init_Button_SL( &default_joystick_, button_name, long_press_sec );
   return;
 }
 
@@ -151,21 +121,7 @@ void Joystick_Init_Button_SL( const int *button_name, double long_press_sec){
  *   None
  */
 void Joystick_Init_Button_SH( const int *button_name, double hold_sec){
-  int ii;
-
-
-  hold_sec_ = hold_sec;
-  printf("Hold button length at least: %5.1f sec\n", hold_sec_);
-
-  /* allocate static array */
-  button_name_sh_ = (int *) calloc(n_button_sh_, sizeof(int));
-  /* allocate press time array */
-  button_press_time_sh_ = (clock_t *) calloc(n_button_sh_, sizeof(clock_t));
-
-  /* copy the values to the static array */
-  for ( ii = 0; ii < n_button_sh_; ii++ ) {
-    *(button_name_sh_ + ii) = *(button_name + ii);
-  }
+  Joystick_Dev_Init_Button_SH( &default_joystick_, button_name, hold_sec );
   return;
 }
 
@@ -173,14 +129,15 @@ void Joystick_Init_Button_SH( const int *button_name, double hold_sec){
 /*
  * This function displays the joystick motion
  * including which axis is moved and its raw values, and which button is pressed
- * This function should be run in a while loop checking for the EXITING state
+ * This function should be run in a while loop checking for the EXITING state,
+ * it sleeps until an event comes or 100 ms have passed
  *
  * This function is useful for ditermining the integer name and range of the
  * axis and button
  */
 void Joystick_Display_Action( void ) {
-  /* Check if there are any events, SDL_PollEvent return 1 if there are events, 0 if no events */
-  if ( SDL_PollEvent(&event_) != 0) {
+  /* Wait for an event, SDL_WaitEventTimeout return 1 if there is an event, 0 if none came */
+  if ( SDL_WaitEventTimeout(&event_, 100) != 0) {
 
     /* If joystick axis motion */
     if ( event_.type == SDL_JOYAXISMOTION ) {
@@ -200,8 +157,10 @@ void Joystick_Display_Action( void ) {
 
 
 /*
- * This function monitors the motion of the joystick
- * This function should be run in a while loop checking for the EXITING state
+ * This function monitors the motion of the joystick, handling all the events
+ * that arrived since the last call, without waiting
+ * This function should be run in a loop that sleeps, in Joystick_Wait or on
+ * Joystick_Event_Fd, checking for the EXITING state
  *
  * Arguments
  *   axis_value:      [Input/Output, array size n_axis]
@@ -226,144 +185,472 @@ void Joystick_Display_Action( void ) {
  *                    button is still not released, value changes to 2, indicating
  *                    the button is being held down. When the held down button is
  *                    released, the value changes to 0.
+ *                    When the joystick is unplugged the axes go to 0 and the
+ *                    buttons are released.
  * Return
  *   None
  */
 void Joystick_Monitor( double *axis_value, int *button_value_sl, int *button_value_sh ) {
-  int ii;
-  double elapsedtime;
+  Joystick_Copy_Values( &default_joystick_, axis_value, button_value_sl, button_value_sh, true );
+  Joystick_Update();
+  Joystick_Copy_Values( &default_joystick_, axis_value, button_value_sl, button_value_sh, false );
+  return;
+}
 
-  /* loop over each of the initialized buttons for short press/hold mode
-   * to check if the hold_sec_ has expired */
-  for (ii = 0; ii < n_button_sh_; ii++) {
 
-    /* if the button is pressed down but has not gone into hold state */
-    if ( *(button_value_sh + ii) == -1 ) {
-      /* compute the elaspsed time */
-      elapsedtime = (double)(clock() - *(button_press_time_sh_ + ii)) / CLOCKS_PER_SEC;
-      /* if hold_sec_ expired */
-      if (elapsedtime >= hold_sec_) {
-        /* register this button as being held down */
-        *(button_value_sh + ii) = 2;
-      }
-    }
-  }
+/*
+ * This function sleeps until the joystick has an event, a short press/hold
+ * button reaches its hold time, or the timeout expires, then updates the
+ * values as Joystick_Monitor does. The process uses no CPU while waiting.
+ *
+ * Arguments
+ *   timeout_ms:      [Input] longest wait in milliseconds, 0 not to wait, -1
+ *                            to wait without limit
+ *   axis_value:      [Input/Output, array size n_axis] see Joystick_Monitor
+ *   button_value_sl: [Input/Output, array size n_button_sl] see Joystick_Monitor
+ *   button_value_sh: [Input/Output, array size n_button_sh] see Joystick_Monitor
+ * Return
+ *   1 if there were events, 0 if the wait ended without one
+ */
+int Joystick_Wait( int timeout_ms, double *axis_value, int *button_value_sl, int *button_value_sh ) {
+  int returnval;
 
+  Joystick_Copy_Values( &default_joystick_, axis_value, button_value_sl, button_value_sh, true );
+  returnval = Joystick_Update_Wait( timeout_ms );
+  Joystick_Copy_Values( &default_joystick_, axis_value, button_value_sl, button_value_sh, false );
+  return returnval;
+}
 
-  /* Check if there are any events, SDL_PollEvent return 1 if there are events, 0 if no events */
-  if ( SDL_PollEvent(&event_) != 0) {
 
-    /* If joystick axis motion */
-    if ( event_.type == SDL_JOYAXISMOTION ) {
-      /* loop over each of the initialized axis */
-      for (ii = 0; ii < n_axis_; ii++) {
-        /* if the motion is on the current axis */
-        if ( event_.jaxis.axis == *(axis_name_ + ii) ) {
-          /* record the motion value */
-          *(axis_value + ii) = \
-            axis_value_2_double( event_.jaxis.value, \
-            *(axis_min_ + ii), *(axis_max_ + ii), *(axis_dz_ + ii), *(axis_inv_ + ii) );
-        }
-      }
-    }
+/*
+ * This function gives the time until the next short press/hold button, of
+ * any open joystick, reaches its hold time, to bound the wait of an external
+ * event loop
+ *
+ * Arguments
+ *   max_ms: [Input] the result when no deadline is nearer, -1 for none
+ * Return
+ *   milliseconds, rounded up, to the next deadline or max_ms
+ */
+int Joystick_Timeout_Ms( int max_ms ) {
+  int ii, timeout_ms;
+  uint64_t now_ns, deadline_ns;
 
-    /* If joystick button press down */
-    else if ( event_.type == SDL_JOYBUTTONDOWN) {
+  now_ns = monotonic_ns();
+  for (ii = 0; ii < n_devices_; ii++) {
+    /* the nearest deadline of each joystick is on top of its heap */
+    if (devices_[ii]->n_hold == 0) continue;
+    deadline_ns = Joystick_Hold_Deadline( devices_[ii], devices_[ii]->hold_heap[0] );
+    timeout_ms  = (deadline_ns <= now_ns) ? 0 : (int) ((deadline_ns - now_ns + 999999) / 1000000);
+    if (max_ms < 0 || timeout_ms < max_ms) max_ms = timeout_ms;
+  }
+  return max_ms;
+}
 
-      /* loop over each of the initialized buttons for short/long press mode */
-      for (ii = 0; ii < n_button_sl_; ii++) {
-        /* if the button press is the current button */
-        if ( event_.jbutton.button == *(button_name_sl_ + ii) ){
-          /* record press time */
-          *(button_press_time_sl_ + ii) = clock();
-        }
-      }
 
-      /* loop over each of the initialized buttons for short press/hold mode */
-      for (ii = 0; ii < n_button_sh_; ii++) {
-        /* if the button press is the current button */
-        if ( event_.jbutton.button == *(button_name_sh_ + ii) ){
-          /* record press time */
-          *(button_press_time_sh_ + ii) = clock();
-          /* change state to -1  to indicate a press down */
-          *(button_value_sh + ii) = -1;
-        }
-      }
+/*
+ * This function gives a file descriptor that becomes readable when the
+ * joystick has events, for an external epoll or poll loop, which then calls
+ * Joystick_Monitor. Joystick_Monitor clears it. The wait of the loop should
+ * be bounded by Joystick_Timeout_Ms for the hold deadlines.
+ *
+ * SDL has no descriptor of its own, the devices are read when SDL is pumped.
+ * So a thread pumps SDL every 4 ms, which costs next to nothing, and an event
+ * watch signals an eventfd when an event is queued.
+ *
+ * Return
+ *   the file descriptor, or -1 on failure
+ */
+int Joystick_Event_Fd( void ) {
+  if (event_fd_ != -1) return event_fd_;
 
-    }
+  event_fd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  if (event_fd_ == -1) {
+    print_time();
+    fprintf(error_log_, "Could not create joystick eventfd, errno code %i\n", errno);
+    fflush(error_log_);
+    return -1;
+  }
+  SDL_AddEventWatch( Joystick_Event_Watch, NULL );
 
-    /* If joystick button release */
-    else if ( event_.type == SDL_JOYBUTTONUP ) {
+  pump_running_ = true;
+  if (pthread_create( &pump_thread_, NULL, Joystick_Pump_Thread, NULL ) != 0) {
+    print_time();
+    fprintf(error_log_, "Could not start joystick pump thread.\n");
+    fflush(error_log_);
+    pump_running_ = false;
+    SDL_DelEventWatch( Joystick_Event_Watch, NULL );
+    close( event_fd_ );
+    event_fd_ = -1;
+    return -1;
+  }
+  return event_fd_;
+}
 
-      /* loop over each of the initialized buttons for short/long press mode */
-      for (ii = 0; ii < n_button_sl_; ii++) {
-        /* if the button released is the current button */
-        if ( event_.jbutton.button == *(button_name_sl_ + ii) ){
-          /* compute the elaspsed time */
-          elapsedtime = (double)(clock() - *(button_press_time_sl_ + ii)) / CLOCKS_PER_SEC;
-
-          if ( elapsedtime >= long_press_sec_ ) {
-            /* register this button as a long press */
-            *(button_value_sl + ii) = 2;
-          }
-          else if ( elapsedtime >= 0 ) {
-            /* register this button as a short press */
-            *(button_value_sl + ii) = 1;
-          }
-        }
-      }
 
-      /* loop over each of the initialized buttons for short press/hold mode */
-      for (ii = 0; ii < n_button_sh_; ii++) {
-        /* if the button released is the current button */
-        if ( event_.jbutton.button == *(button_name_sh_ + ii) ){
-
-          /* if the button has not gone into hold state, it is a short press */
-          if ( *(button_value_sh + ii) == -1 ) {
-            /* register this button as a short press */
-            *(button_value_sh + ii) = 1;
-          }
-          /* if the button already gone into hold state, it is released from hold */
-          else if ( *(button_value_sh + ii) == 2 ) {
-            /* register this button as a released from a hold */
-            *(button_value_sh + ii) = 0;
-          }
-        }
-      }
+/*
+ * This function starts the input service thread, which from then on owns SDL:
+ * it waits for the joysticks as Joystick_Update_Wait does, and so publishes
+ * the values of every open joystick after each change. Any number of threads
+ * read the snapshots with Joystick_Service_Read or Joystick_Dev_Read, without
+ * locks. No other Joystick_ function may be used while the service runs,
+ * except those reading snapshots.
+ *
+ * Return
+ *   0 on success, -1 on failure
+ */
+int Joystick_Service_Start( void ) {
+  if (service_running_) return 0;
 
-    }
+  service_running_ = true;
+  if (pthread_create( &service_thread_, NULL, Joystick_Service_Thread, NULL ) != 0) {
+    print_time();
+    fprintf(error_log_, "Could not start joystick input service thread.\n");
+    fflush(error_log_);
+    service_running_ = false;
+    return -1;
+  }
+  return 0;
+}
 
-  } /* end if event */
+
+/*
+ * This function gives the latest snapshot of the joystick of Joystick_Init,
+ * see Joystick_Dev_Read
+ *
+ * Arguments
+ *   state_ptr: [Output] the snapshot, version 0 if the joystick never opened
+ * Return
+ *   None
+ */
+void Joystick_Service_Read( joystickstate_t *state_ptr ) {
+  Joystick_Dev_Read( &default_joystick_, state_ptr );
+  return;
+}
+
+
+/*
+ * This function stops the input service thread, the last snapshots stay
+ * readable
+ *
+ * Return
+ *   None
+ */
+void Joystick_Service_Stop( void ) {
+  if (!service_running_) return;
+  __atomic_store_n( &service_running_, false, __ATOMIC_RELEASE );
+  pthread_join( service_thread_, NULL );
   return;
 }
 
 
 /*
- * Cleanup: release memory, close joystick and exit SDL
+ * Cleanup: close every joystick and exit SDL
  * Arguments: None
  * Return: None
  */
 void Joystick_Cleanup( void ) {
-  /* Free dynamically allocated arrays */
-  free(axis_name_  );
-  free(axis_max_   );
-  free(axis_min_   );
-  free(axis_dz_    );
-  free(axis_inv_   );
-  free(button_name_sl_);
-  free(button_press_time_sl_);
-  free(button_name_sh_);
-  free(button_press_time_sh_);
-
-  /* Close joystick if opened */
-  if (SDL_JoystickGetAttached(joystick_)) {
-    SDL_JoystickClose(joystick_);
+  Joystick_Service_Stop();
+
+  /* Stop the pump thread of Joystick_Event_Fd */
+  if (event_fd_ != -1) {
+    __atomic_store_n( &pump_running_, false, __ATOMIC_RELEASE );
+    pthread_join( pump_thread_, NULL );
+    SDL_DelEventWatch( Joystick_Event_Watch, NULL );
+    close( event_fd_ );
+    event_fd_ = -1;
+  }
+
+  /* Close joysticks */
+  while (n_devices_ > 0) {
+    Joystick_Dev_Close( devices_[n_devices_ - 1] );
   }
   /* Exit SDL */
   SDL_Quit();
 }
 
 
+/*
+ * This function opens a joystick, one of several that can be open at once.
+ * Its mapping is set with the Joystick_Dev_Init_* functions. When the device
+ * is unplugged its axes go to 0 and its buttons are released, and when a
+ * device with the same GUID is plugged back in it is opened again with the
+ * same mapping, see Joystick_Update.
+ *
+ * Arguments
+ *   joy_ptr:     [Output] the joystick, must stay in place until closed
+ *   device_num:  [Input] joystick device number
+ *   n_axis:      [Input] number of axis to use/monitor, at most JOYSTICKMAXAXIS
+ *   n_button_sl: [Input] number of buttons to use/monitor for short/long press,
+ *                        at most JOYSTICKMAXBUTTON
+ *   n_button_sh: [Input] number of buttons to use/monitor for short press/hold,
+ *                        at most JOYSTICKMAXBUTTON
+ * Return
+ *   0 on success, -1 on failure
+ */
+int Joystick_Dev_Open( joystick_t *joy_ptr, int device_num, int n_axis, int n_button_sl, int n_button_sh ) {
+  SDL_Joystick *sdl_ptr;
+  SDL_JoystickGUID guid;
+  int ii;
+
+  if (n_axis > JOYSTICKMAXAXIS || n_button_sl > JOYSTICKMAXBUTTON || n_button_sh > JOYSTICKMAXBUTTON) {
+    print_time();
+    fprintf(error_log_, "Too many joystick axes or buttons, at most %d and %d\n", \
+      JOYSTICKMAXAXIS, JOYSTICKMAXBUTTON);
+    fflush(error_log_);
+    return -1;
+  }
+  if (n_devices_ == JOYSTICKMAXDEVICES) {
+    print_time();
+    fprintf(error_log_, "Too many joysticks open, at most %d\n", JOYSTICKMAXDEVICES);
+    fflush(error_log_);
+    return -1;
+  }
+
+  /* Initialize SDL */
+  SDL_Init( SDL_INIT_JOYSTICK );
+
+  /* Check if joystick is connected */
+  if (SDL_NumJoysticks() == 0) {
+    print_time();
+    fprintf(error_log_, "No joystick found. Exiting.\n");
+    fflush(error_log_);
+    return -1;
+  }
+
+  /* Open joystick */
+  sdl_ptr = SDL_JoystickOpen( device_num );
+  if (sdl_ptr == NULL) {
+    print_time();
+    fprintf(error_log_, "Could not open joystick %d.\n", device_num);
+    fflush(error_log_);
+    return -1;
+  }
+  /* Display joystick information */
+  printf("Joystick opened: %s\n", SDL_JoystickName(sdl_ptr));
+  printf("Total number of    axes: %d\n", SDL_JoystickNumAxes(sdl_ptr));
+  printf("Total number of buttons: %d\n\n", SDL_JoystickNumButtons(sdl_ptr));
+  printf("Initializing %d axis, %d buttons with short/long press, %d buttons wiht short press/hold\n", \
+    n_axis, n_button_sl, n_button_sh );
+
+  /* nothing is monitored until the Joystick_Dev_Init_* calls */
+  memset( joy_ptr, 0, sizeof(joystick_t) );
+  joy_ptr->sdl_ptr     = sdl_ptr;
+  joy_ptr->instance_id = SDL_JoystickInstanceID( sdl_ptr );
+  guid = SDL_JoystickGetGUID( sdl_ptr );
+  memcpy( joy_ptr->guid, guid.data, sizeof(joy_ptr->guid) );
+  joy_ptr->n_axis      = n_axis;
+  joy_ptr->n_button_sl = n_button_sl;
+  joy_ptr->n_button_sh = n_button_sh;
+  for (ii = 0; ii < JOYSTICKMAXBUTTON; ii++) {
+    joy_ptr->hold_index[ii] = -1;
+  }
+  Joystick_Init_Slots( joy_ptr->axis_slot, NULL, 0 );
+  Joystick_Init_Slots( joy_ptr->button_slot_sl, NULL, 0 );
+  Joystick_Init_Slots( joy_ptr->button_slot_sh, NULL, 0 );
+
+  /* publish the values before the first event */
+  joy_ptr->state.connected = 1;
+  Joystick_Publish( joy_ptr );
+
+  devices_[n_devices_] = joy_ptr;
+  n_devices_ ++;
+  return 0;
+}
+
+
+/*
+ * Intialize the axes of a joystick, see Joystick_Init_Axis
+ */
+void Joystick_Dev_Init_Axis( joystick_t *joy_ptr, const int *axis_name, const int *axis_min, \
+  const int *axis_max, const int *axis_dz, const int* axis_inv ) {
+  int ii;
+
+  /* copy the values to the joystick */
+  for ( ii = 0; ii < joy_ptr->n_axis; ii++ ) {
+    joy_ptr->axis_name[ii] = *(axis_name + ii);
+    joy_ptr->axis_max[ii]  = *(axis_max  + ii);
+    joy_ptr->axis_min[ii]  = *(axis_min  + ii);
+    joy_ptr->axis_dz[ii]   = *(axis_dz   + ii);
+    joy_ptr->axis_inv[ii]  = *(axis_inv  + ii);
+  }
+  Joystick_Init_Slots( joy_ptr->axis_slot, joy_ptr->axis_name, joy_ptr->n_axis );
+  return;
+}
+
+
+/*
+ * Intialize the buttons of a joystick in single/long press mode, see
+ * Joystick_Init_Button_SL
+ */
+void Joystick_Dev_Init_Button_SL( joystick_t *joy_ptr, const int *button_name, double long_press_sec ) {
+  int ii;
+
+  joy_ptr->long_press_sec = long_press_sec;
+  printf("Long press length: %5.1f sec\n", joy_ptr->long_press_sec);
+
+  /* copy the values to the joystick */
+  for ( ii = 0; ii < joy_ptr->n_button_sl; ii++ ) {
+    joy_ptr->button_name_sl[ii] = *(button_name + ii);
+  }
+  Joystick_Init_Slots( joy_ptr->button_slot_sl, joy_ptr->button_name_sl, joy_ptr->n_button_sl );
+  return;
+}
+
+
+/*
+ * Intialize the buttons of a joystick in single press/hold mode, see
+ * Joystick_Init_Button_SH
+ */
+void Joystick_Dev_Init_Button_SH( joystick_t *joy_ptr, const int *button_name, double hold_sec ) {
+  int ii;
+
+  joy_ptr->hold_sec = hold_sec;
+  printf("Hold button length at least: %5.1f sec\n", joy_ptr->hold_sec);
+
+  /* copy the values to the joystick */
+  for ( ii = 0; ii < joy_ptr->n_button_sh; ii++ ) {
+    joy_ptr->button_name_sh[ii] = *(button_name + ii);
+  }
+  Joystick_Init_Slots( joy_ptr->button_slot_sh, joy_ptr->button_name_sh, joy_ptr->n_button_sh );
+  return;
+}
+
+
+/*
+ * This function gives the latest snapshot of a joystick, published by
+ * Joystick_Update on the thread that updates the joysticks, such as the input
+ * service thread. It never blocks: if a snapshot is published during the
+ * copy, which takes well under a microsecond, the copy is made again. The
+ * snapshot is consistent, all of its values are from the same update.
+ *
+ * Arguments
+ *   joy_ptr:   [Input]  the joystick
+ *   state_ptr: [Output] the snapshot, version 0 if the joystick never opened
+ * Return
+ *   None
+ */
+void Joystick_Dev_Read( joystick_t *joy_ptr, joystickstate_t *state_ptr ) {
+  uint64_t words[JOYSTICK_STATE_WORDS];
+  uint64_t seq_start, seq_end;
+  unsigned int ii;
+
+  do {
+    seq_start = __atomic_load_n( &joy_ptr->seq, __ATOMIC_ACQUIRE );
+    for (ii = 0; ii < JOYSTICK_STATE_WORDS; ii++) {
+      words[ii] = __atomic_load_n( &joy_ptr->words[ii], __ATOMIC_RELAXED );
+    }
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    seq_end = __atomic_load_n( &joy_ptr->seq, __ATOMIC_RELAXED );
+  } while ( (seq_start & 1) || seq_start != seq_end );
+
+  memcpy( state_ptr, words, sizeof(joystickstate_t) );
+  return;
+}
+
+
+/*
+ * This function closes a joystick opened by Joystick_Dev_Open, it is no longer
+ * opened again when plugged in
+ *
+ * Arguments
+ *   joy_ptr: [Input] the joystick
+ * Return
+ *   None
+ */
+void Joystick_Dev_Close( joystick_t *joy_ptr ) {
+  int ii;
+
+  for (ii = 0; ii < n_devices_; ii++) {
+    if (devices_[ii] != joy_ptr) continue;
+    /* the last joystick takes its place */
+    n_devices_ --;
+    devices_[ii] = devices_[n_devices_];
+
+    /* Close joystick if opened */
+    if (joy_ptr->sdl_ptr != NULL && SDL_JoystickGetAttached( joy_ptr->sdl_ptr )) {
+      SDL_JoystickClose( joy_ptr->sdl_ptr );
+    }
+    joy_ptr->sdl_ptr     = NULL;
+    joy_ptr->instance_id = -1;
+    break;
+  }
+  return;
+}
+
+
+/*
+ * This function updates every open joystick with all the events that arrived
+ * since the last call, without waiting, and publishes the joysticks that
+ * changed for Joystick_Dev_Read. Joysticks unplugged and plugged back in are
+ * handled here. The values are in the state of each joystick, see
+ * Joystick_Monitor.
+ *
+ * Return
+ *   None
+ */
+void Joystick_Update( void ) {
+  int ii, n_events;
+  eventfd_t count;
+  uint64_t now_ns;
+  Uint32 now_ticks;
+
+  /* Clear Joystick_Event_Fd before taking the events, so an event queued
+   * from now on signals it again */
+  if (event_fd_ != -1) {
+    eventfd_read( event_fd_, &count );
+  }
+
+  /* Take every event queued since the last call, in batches, so events that
+   * come faster than the calls do not pile up. SDL_PeepEvents does not pump,
+   * so the loop ends even while new events keep coming. */
+  SDL_PumpEvents();
+  now_ns    = monotonic_ns();
+  now_ticks = SDL_GetTicks();
+  do {
+    n_events = SDL_PeepEvents( events_, JOYSTICK_EVENT_BATCH, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT );
+    for (ii = 0; ii < n_events; ii++) {
+      Joystick_Handle_Event( &events_[ii], Joystick_Event_Ns( &events_[ii], now_ns, now_ticks ) );
+    }
+  } while (n_events == JOYSTICK_EVENT_BATCH);
+
+  /* buttons held down past their hold time since the last event */
+  now_ns = monotonic_ns();
+  for (ii = 0; ii < n_devices_; ii++) {
+    Joystick_Hold_Expire( devices_[ii], now_ns );
+    if (devices_[ii]->changed) Joystick_Publish( devices_[ii] );
+  }
+  return;
+}
+
+
+/*
+ * This function sleeps until a joystick has an event, a short press/hold
+ * button reaches its hold time, or the timeout expires, then updates the
+ * joysticks as Joystick_Update does
+ *
+ * Arguments
+ *   timeout_ms: [Input] longest wait in milliseconds, 0 not to wait, -1 to
+ *                       wait without limit
+ * Return
+ *   1 if there were events, 0 if the wait ended without one
+ */
+int Joystick_Update_Wait( int timeout_ms ) {
+  int returnval;
+
+  /* wake up for the next hold deadline, the wait itself does not see it */
+  timeout_ms = Joystick_Timeout_Ms( timeout_ms );
+
+  returnval = SDL_WaitEventTimeout( &event_, timeout_ms );
+  if (returnval != 0) {
+    Joystick_Handle_Event( &event_, Joystick_Event_Ns( &event_, monotonic_ns(), SDL_GetTicks() ) );
+  }
+  /* the other events and the hold deadlines */
+  Joystick_Update();
+  return (returnval != 0) ? 1 : 0;
+}
+
+
 /*
  * Convert the axis value to a double number between -1 and 1
  *
@@ -405,4 +692,439 @@ double axis_value_2_double( int axis_value, int axis_min, int axis_max, int axis
   }
 
   return ((double) axis_inv)*result;
-}
\ No newline at end of file
+}
+
+
+/*
+ * Fill a lookup table from SDL axis or button number to slot
+ *
+ * Arguments
+ *   slots:   [Output, array size JOYSTICKIDS] slot of each number, -1 if unused
+ *   names:   [Input, array size n_names] the number of each slot
+ *   n_names: [Input] number of slots
+ * Return
+ *   None
+ */
+void Joystick_Init_Slots( int *slots, const int *names, int n_names ) {
+  int ii;
+
+  for ( ii = 0; ii < JOYSTICKIDS; ii++ ) {
+    slots[ii] = -1;
+  }
+  for ( ii = 0; ii < n_names; ii++ ) {
+    if ( names[ii] < 0 || names[ii] >= JOYSTICKIDS ) {
+      print_time();
+      fprintf(error_log_, "Joystick axis or button number %d out of range, ignored.\n", names[ii]);
+      fflush(error_log_);
+      continue;
+    }
+    slots[names[ii]] = ii;
+  }
+  return;
+}
+
+
+/*
+ * The open joystick of an SDL instance, NULL if there is none
+ */
+joystick_t *Joystick_Find( int instance_id ) {
+  int ii;
+
+  /* unplugged joysticks have no instance */
+  if (instance_id < 0) return NULL;
+  for (ii = 0; ii < n_devices_; ii++) {
+    if (devices_[ii]->instance_id == instance_id) return devices_[ii];
+  }
+  return NULL;
+}
+
+
+/*
+ * Update the joysticks with one event, see Joystick_Monitor. Button timing
+ * uses the time of the event, not the time it is handled.
+ */
+void Joystick_Handle_Event( const SDL_Event *event_ptr, uint64_t time_ns ) {
+  joystick_t *joy_ptr;
+  joystickstate_t *state_ptr;
+  int slot;
+  double elapsedtime;
+
+  /* If a joystick is plugged in or unplugged */
+  if ( event_ptr->type == SDL_JOYDEVICEADDED ) {
+    Joystick_Device_Added( event_ptr->jdevice.which );
+    return;
+  }
+  else if ( event_ptr->type == SDL_JOYDEVICEREMOVED ) {
+    Joystick_Device_Removed( event_ptr->jdevice.which );
+    return;
+  }
+
+  /* If joystick axis motion */
+  if ( event_ptr->type == SDL_JOYAXISMOTION ) {
+    joy_ptr = Joystick_Find( event_ptr->jaxis.which );
+    if ( joy_ptr == NULL ) return;
+    slot = joy_ptr->axis_slot[event_ptr->jaxis.axis];
+    /* if the motion is on an initialized axis, record the motion value */
+    if ( slot != -1 ) {
+      joy_ptr->state.axis_value[slot] = \
+        axis_value_2_double( event_ptr->jaxis.value, \
+        joy_ptr->axis_min[slot], joy_ptr->axis_max[slot], joy_ptr->axis_dz[slot], joy_ptr->axis_inv[slot] );
+      joy_ptr->changed = true;
+    }
+    return;
+  }
+
+  if ( event_ptr->type != SDL_JOYBUTTONDOWN && event_ptr->type != SDL_JOYBUTTONUP ) return;
+  joy_ptr = Joystick_Find( event_ptr->jbutton.which );
+  if ( joy_ptr == NULL ) return;
+  state_ptr = &joy_ptr->state;
+
+  /* buttons that reached their hold time before this event */
+  Joystick_Hold_Expire( joy_ptr, time_ns );
+
+  /* If joystick button press down */
+  if ( event_ptr->type == SDL_JOYBUTTONDOWN) {
+
+    /* if the button is initialized for short/long press mode */
+    slot = joy_ptr->button_slot_sl[event_ptr->jbutton.button];
+    if ( slot != -1 ) {
+      /* record press time */
+      joy_ptr->press_time_sl[slot] = time_ns;
+    }
+
+    /* if the button is initialized for short press/hold mode */
+    slot = joy_ptr->button_slot_sh[event_ptr->jbutton.button];
+    if ( slot != -1 ) {
+      /* record press time, and wait for the hold time */
+      joy_ptr->press_time_sh[slot] = time_ns;
+      Joystick_Hold_Remove( joy_ptr, slot );
+      Joystick_Hold_Push( joy_ptr, slot );
+      /* change state to -1  to indicate a press down */
+      state_ptr->button_value_sh[slot] = -1;
+      joy_ptr->changed = true;
+    }
+
+  }
+
+  /* If joystick button release */
+  else {
+
+    /* if the button is initialized for short/long press mode */
+    slot = joy_ptr->button_slot_sl[event_ptr->jbutton.button];
+    if ( slot != -1 ) {
+      /* compute the elaspsed time */
+      elapsedtime = ((int64_t) (time_ns - joy_ptr->press_time_sl[slot])) * 1e-9;
+
+      if ( elapsedtime >= joy_ptr->long_press_sec ) {
+        /* register this button as a long press */
+        state_ptr->button_value_sl[slot] = 2;
+        state_ptr->button_count_sl[slot] += 1;
+        joy_ptr->changed = true;
+      }
+      else if ( elapsedtime >= 0 ) {
+        /* register this button as a short press */
+        state_ptr->button_value_sl[slot] = 1;
+        state_ptr->button_count_sl[slot] += 1;
+        joy_ptr->changed = true;
+      }
+    }
+
+    /* if the button is initialized for short press/hold mode */
+    slot = joy_ptr->button_slot_sh[event_ptr->jbutton.button];
+    if ( slot != -1 ) {
+      Joystick_Hold_Remove( joy_ptr, slot );
+
+      /* if the button has not gone into hold state, it is a short press */
+      if ( state_ptr->button_value_sh[slot] == -1 ) {
+        /* register this button as a short press */
+        state_ptr->button_value_sh[slot] = 1;
+        state_ptr->button_count_sh[slot] += 1;
+        joy_ptr->changed = true;
+      }
+      /* if the button already gone into hold state, it is released from hold */
+      else if ( state_ptr->button_value_sh[slot] == 2 ) {
+        /* register this button as a released from a hold */
+        state_ptr->button_value_sh[slot] = 0;
+        joy_ptr->changed = true;
+      }
+    }
+
+  }
+  return;
+}
+
+
+/*
+ * A device was plugged in: open it again for the unplugged joystick with the
+ * same GUID, which keeps its mapping. SDL also reports the devices present at
+ * start, those already open are left alone.
+ */
+void Joystick_Device_Added( int device_index ) {
+  SDL_Joystick *sdl_ptr;
+  SDL_JoystickGUID guid;
+  joystick_t *joy_ptr;
+  int ii;
+
+  if (Joystick_Find( SDL_JoystickGetDeviceInstanceID( device_index ) ) != NULL) return;
+
+  guid = SDL_JoystickGetDeviceGUID( device_index );
+  for (ii = 0; ii < n_devices_; ii++) {
+    joy_ptr = devices_[ii];
+    if (joy_ptr->sdl_ptr != NULL || memcmp( joy_ptr->guid, guid.data, sizeof(joy_ptr->guid) ) != 0) continue;
+
+    sdl_ptr = SDL_JoystickOpen( device_index );
+    if (sdl_ptr == NULL) {
+      print_time();
+      fprintf(error_log_, "Could not open joystick %d after it was plugged in.\n", device_index);
+      fflush(error_log_);
+      return;
+    }
+    joy_ptr->sdl_ptr     = sdl_ptr;
+    joy_ptr->instance_id = SDL_JoystickInstanceID( sdl_ptr );
+    joy_ptr->state.connected   = 1;
+    joy_ptr->state.reconnects += 1;
+    joy_ptr->changed = true;
+    print_time();
+    fprintf(error_log_, "Joystick %s plugged back in.\n", SDL_JoystickName( sdl_ptr ));
+    fflush(error_log_);
+    return;
+  }
+  return;
+}
+
+
+/*
+ * A device was unplugged: close it, center its axes and release its buttons,
+ * so nothing keeps moving on the last values. The joystick waits to be
+ * plugged back in.
+ */
+void Joystick_Device_Removed( int instance_id ) {
+  joystick_t *joy_ptr;
+  joystickstate_t *state_ptr;
+  int ii;
+
+  joy_ptr = Joystick_Find( instance_id );
+  if (joy_ptr == NULL) return;
+  state_ptr = &joy_ptr->state;
+
+  print_time();
+  fprintf(error_log_, "Joystick %s unplugged, waiting for it to be plugged back in.\n", \
+    SDL_JoystickName( joy_ptr->sdl_ptr ));
+  fflush(error_log_);
+  SDL_JoystickClose( joy_ptr->sdl_ptr );
+  joy_ptr->sdl_ptr     = NULL;
+  joy_ptr->instance_id = -1;
+
+  for (ii = 0; ii < joy_ptr->n_axis; ii++) {
+    state_ptr->axis_value[ii] = 0.0;
+  }
+  for (ii = 0; ii < joy_ptr->n_button_sh; ii++) {
+    Joystick_Hold_Remove( joy_ptr, ii );
+    if (state_ptr->button_value_sh[ii] != 1) state_ptr->button_value_sh[ii] = 0;
+  }
+  state_ptr->connected = 0;
+  joy_ptr->changed = true;
+  return;
+}
+
+
+/*
+ * Copy the values of a joystick from or to the arrays of Joystick_Monitor
+ */
+void Joystick_Copy_Values( joystick_t *joy_ptr, double *axis_value, \
+  int *button_value_sl, int *button_value_sh, bool to_joystick ) {
+  joystickstate_t *state_ptr = &joy_ptr->state;
+
+  if (to_joystick) {
+    if (joy_ptr->n_axis > 0) memcpy( state_ptr->axis_value, axis_value, joy_ptr->n_axis * sizeof(double) );
+    if (joy_ptr->n_button_sl > 0) memcpy( state_ptr->button_value_sl, button_value_sl, joy_ptr->n_button_sl * sizeof(int) );
+    if (joy_ptr->n_button_sh > 0) memcpy( state_ptr->button_value_sh, button_value_sh, joy_ptr->n_button_sh * sizeof(int) );
+  }
+  else {
+    if (joy_ptr->n_axis > 0) memcpy( axis_value, state_ptr->axis_value, joy_ptr->n_axis * sizeof(double) );
+    if (joy_ptr->n_button_sl > 0) memcpy( button_value_sl, state_ptr->button_value_sl, joy_ptr->n_button_sl * sizeof(int) );
+    if (joy_ptr->n_button_sh > 0) memcpy( button_value_sh, state_ptr->button_value_sh, joy_ptr->n_button_sh * sizeof(int) );
+  }
+  return;
+}
+
+
+/*
+ * SDL event watch, called by SDL when an event is queued: signal the eventfd
+ */
+int Joystick_Event_Watch( void *userdata, SDL_Event *event_ptr ) {
+  eventfd_write( event_fd_, 1 );
+  return 0;
+}
+
+
+/*
+ * Thread function that pumps SDL for Joystick_Event_Fd
+ */
+void *Joystick_Pump_Thread( void *dummy ) {
+  while ( __atomic_load_n( &pump_running_, __ATOMIC_ACQUIRE ) ) {
+    SDL_PumpEvents();
+    nsleep( JOYSTICK_PUMP_NS );
+  }
+  return NULL;
+}
+
+
+/*
+ * Time an event happened, in monotonic_ns(). SDL stamps events in
+ * milliseconds of SDL_GetTicks(), so the age of the event is taken from the
+ * ticks and applied to the monotonic time.
+ *
+ * Arguments
+ *   event_ptr: [Input] the event
+ *   now_ns:    [Input] monotonic_ns() now
+ *   now_ticks: [Input] SDL_GetTicks() now
+ * Return
+ *   the time of the event
+ */
+uint64_t Joystick_Event_Ns( const SDL_Event *event_ptr, uint64_t now_ns, Uint32 now_ticks ) {
+  int32_t age_ms;
+
+  age_ms = (int32_t) (now_ticks - event_ptr->jbutton.timestamp);
+  if (age_ms < 0) age_ms = 0;
+  if ((uint64_t) age_ms * 1000000 > now_ns) return 0;
+  return now_ns - (uint64_t) age_ms * 1000000;
+}
+
+
+/*
+ * Time a short press/hold button pressed down goes into hold state
+ */
+uint64_t Joystick_Hold_Deadline( joystick_t *joy_ptr, int slot ) {
+  return joy_ptr->press_time_sh[slot] + (uint64_t) (joy_ptr->hold_sec * 1e9);
+}
+
+
+/*
+ * Add a button to the hold deadline heap
+ */
+void Joystick_Hold_Push( joystick_t *joy_ptr, int slot ) {
+  joy_ptr->hold_heap[joy_ptr->n_hold] = slot;
+  joy_ptr->hold_index[slot] = joy_ptr->n_hold;
+  joy_ptr->n_hold ++;
+  Joystick_Hold_Sift( joy_ptr, joy_ptr->n_hold - 1 );
+  return;
+}
+
+
+/*
+ * Remove a button from the hold deadline heap, if it is in it
+ */
+void Joystick_Hold_Remove( joystick_t *joy_ptr, int slot ) {
+  int index;
+  int *heap = joy_ptr->hold_heap;
+
+  index = joy_ptr->hold_index[slot];
+  if (index == -1) return;
+  joy_ptr->hold_index[slot] = -1;
+  joy_ptr->n_hold --;
+  if (index == joy_ptr->n_hold) return;
+  /* the last entry takes its place */
+  heap[index] = heap[joy_ptr->n_hold];
+  joy_ptr->hold_index[heap[index]] = index;
+  Joystick_Hold_Sift( joy_ptr, index );
+  return;
+}
+
+
+/*
+ * Move an entry of the hold deadline heap up or down to its place
+ */
+void Joystick_Hold_Sift( joystick_t *joy_ptr, int index ) {
+  int parent, child, slot;
+  int *heap = joy_ptr->hold_heap;
+  uint64_t deadline_ns;
+
+  slot = heap[index];
+  deadline_ns = Joystick_Hold_Deadline( joy_ptr, slot );
+  /* up, while earlier than the parent */
+  while (index > 0) {
+    parent = (index - 1) / 2;
+    if (Joystick_Hold_Deadline( joy_ptr, heap[parent] ) <= deadline_ns) break;
+    heap[index] = heap[parent];
+    joy_ptr->hold_index[heap[index]] = index;
+    index = parent;
+  }
+  /* down, while later than the earliest child */
+  while (2 * index + 1 < joy_ptr->n_hold) {
+    child = 2 * index + 1;
+    if (child + 1 < joy_ptr->n_hold && \
+      Joystick_Hold_Deadline( joy_ptr, heap[child + 1] ) < Joystick_Hold_Deadline( joy_ptr, heap[child] )) child ++;
+    if (deadline_ns <= Joystick_Hold_Deadline( joy_ptr, heap[child] )) break;
+    heap[index] = heap[child];
+    joy_ptr->hold_index[heap[index]] = index;
+    index = child;
+  }
+  heap[index] = slot;
+  joy_ptr->hold_index[slot] = index;
+  return;
+}
+
+
+/*
+ * Put the buttons whose hold time has passed into hold state, taking them
+ * from the top of the heap, so only expired buttons are looked at
+ *
+ * Arguments
+ *   joy_ptr:  [Input/Output] the joystick
+ *   until_ns: [Input] monotonic_ns() up to which the deadlines passed
+ * Return
+ *   None
+ */
+void Joystick_Hold_Expire( joystick_t *joy_ptr, uint64_t until_ns ) {
+  int slot;
+
+  while (joy_ptr->n_hold > 0 && Joystick_Hold_Deadline( joy_ptr, joy_ptr->hold_heap[0] ) <= until_ns) {
+    slot = joy_ptr->hold_heap[0];
+    Joystick_Hold_Remove( joy_ptr, slot );
+    /* if the button is still pressed down, register it as being held down */
+    if ( joy_ptr->state.button_value_sh[slot] == -1 ) {
+      joy_ptr->state.button_value_sh[slot] = 2;
+      joy_ptr->changed = true;
+    }
+  }
+  return;
+}
+
+
+/*
+ * Publish the state of a joystick as its next snapshot, see
+ * Joystick_Dev_Read. Only one thread publishes at a time.
+ */
+void Joystick_Publish( joystick_t *joy_ptr ) {
+  uint64_t words[JOYSTICK_STATE_WORDS];
+  uint64_t seq;
+  unsigned int ii;
+
+  seq = joy_ptr->seq;
+  joy_ptr->state.version = seq / 2 + 1;
+  joy_ptr->state.time_ns = monotonic_ns();
+  memcpy( words, &joy_ptr->state, sizeof(joystickstate_t) );
+
+  /* odd sequence while the words change */
+  __atomic_store_n( &joy_ptr->seq, seq + 1, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+  for (ii = 0; ii < JOYSTICK_STATE_WORDS; ii++) {
+    __atomic_store_n( &joy_ptr->words[ii], words[ii], __ATOMIC_RELAXED );
+  }
+  __atomic_store_n( &joy_ptr->seq, seq + 2, __ATOMIC_RELEASE );
+  joy_ptr->changed = false;
+  return;
+}
+
+
+/*
+ * Thread function of the input service: wait for the joysticks, Joystick_Update
+ * publishes the changes
+ */
+void *Joystick_Service_Thread( void *dummy ) {
+  while ( __atomic_load_n( &service_running_, __ATOMIC_ACQUIRE ) ) {
+    Joystick_Update_Wait( JOYSTICK_SERVICE_MS );
+  }
+  return NULL;
+}
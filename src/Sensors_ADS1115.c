@@ -1,7 +1,7 @@
 /* Data Sheet: https://www.ti.com/lit/ds/symlink/ads1114.pdf?ts=1609357468599&ref_url=https%253A%252F%252Fwww.google.com%252F */
 
-#include <wiringPiI2C.h>
 #include <CLibrary.h>
+#include <Sensors.h>
 
 
 /*=========================================================================
@@ -86,18 +86,36 @@
 #define ADS1115_CQUE_NONE  (0x0003) /* Disable the comparator and put ALERT/RDY in high state (default) */
 /*=========================================================================*/
 
+/* Margin added to the conversion time for the wake up from power-down and the
+ * tolerance of the internal oscillator (10%) */
+#define ADS1115_WAKEUP_NS 50000
+
 
 /**************** Static Global Variables and Static Function ****************/
-static int i2c_fd_;
-static uint16_t config_;
+/* device used by the functions without a device argument */
+static ads1115_t default_adc_ = { .i2c_fd = -1, .bus = -1 };
 
-static int ADS1115_SingleEnded_Config( double VRange, int DateRate );
+static int ADS1115_Config( ads1115_t *adc_ptr, double VRange, int DateRate );
+static int ADS1115_Channel_Mux( int channel );
+static double ADS1115_fsRange( uint16_t config );
+static int ADS1115_Write_Reg( ads1115_t *adc_ptr, uint8_t reg, uint16_t value );
+static int ADS1115_Read_Reg( ads1115_t *adc_ptr, uint8_t reg );
+static int ADS1115_Write_Config( ads1115_t *adc_ptr, uint16_t config );
+static void ADS1115_Start_Conversion( ads1115_t *adc_ptr, uint16_t config );
+static void ADS1115_Wait_Conversion( ads1115_t *adc_ptr );
+static void ADS1115_Wait_Continuous( ads1115_t *adc_ptr );
+static int16_t ADS1115_Read_Counts( ads1115_t *adc_ptr );
+static void ADS1115_Bus_Start( adcscan_t *scan_ptr, int channel );
+static void ADS1115_Bus_Read( adcscan_t *scan_ptr, int16_t *counts, bool *valid );
+static void *ADS1115_Scan_Thread( void *scan_void_ptr );
 
 
 
 /*
- * This function initializes ADS 1115 in a single-ended read mode
- * (not differential voltage measurement)
+ * This function initializes ADS 1115. Channels are chosen at each read, so
+ * single-ended and differential inputs can be mixed.
+ * It sets up the device used by the functions without a device argument,
+ * on the default I2C bus of the Raspberry Pi.
  *
  * Arguments:
  *   i2c_addr: [Input] the I2C address for ADS 1115, default should be 0x48
@@ -109,35 +127,85 @@ static int ADS1115_SingleEnded_Config( double VRange, int DateRate );
  *   0 on success or -1 on failure
  */
 int ADS1115_Init( int i2c_addr, double VRange, int DateRate ) {
+  return ADS1115_Dev_Open( &default_adc_, -1, i2c_addr, VRange, DateRate );
+}
+
+
+/*
+ * This function opens one ADS 1115. Channels are chosen at each read, so
+ * single-ended and differential inputs can be mixed. Up to four devices
+ * (addresses 0x48 to 0x4B) can be opened on each bus.
+ *
+ * Arguments:
+ *   adc_ptr:  [Output] the device
+ *   bus:      [Input] the I2C bus number N of /dev/i2c-N, or -1 for the
+ *                     default bus of the Raspberry Pi
+ *   i2c_addr: [Input] the I2C address for ADS 1115, 0x48 to 0x4B
+ *   VRange:   [Input] the voltage range, can be 0.256, 0.512, 1.024, 2.048, 4.096, or 6.144
+ *                     Input voltage on the analoge pins should not exceed Vcc regardless of this setting
+ *   DataRate: [Input] the data rate, can be 8, 16, 32, 64, 128, 250, 475 or 860
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int ADS1115_Dev_Open( ads1115_t *adc_ptr, int bus, int i2c_addr, double VRange, int DateRate ) {
   int config;
 
-  i2c_fd_ = wiringPiI2CSetup(i2c_addr);
-  if (i2c_fd_ == -1) {
-    printf("I2C Initialization failed. Most likely you are not root\n");
-    printf("Please remember to run as root.\n");
+  memset( adc_ptr, 0, sizeof(ads1115_t) );
+  adc_ptr->bus       = bus;
+  adc_ptr->i2c_addr  = i2c_addr;
+  adc_ptr->ready_ptr = NULL;
+
+  /* I2C_Open reports its failures */
+  adc_ptr->i2c_fd = I2C_Open( bus );
+  if (adc_ptr->i2c_fd == -1) return -1;
+
+  config = ADS1115_Config( adc_ptr, VRange, DateRate );
+  if (config == -1) {
+    printf("ADC configuration failed. Check configuration value.\n");
     print_time();
-    fprintf(error_log_, "I2C Initialization failed. Most likely you are not root\n");
-    fprintf(error_log_, "Please remember to run as root.\n");
+    fprintf(error_log_, "ADC configuration failed. Check configuration value.\n");
     fflush(error_log_);
+    ADS1115_Dev_Close( adc_ptr );
     return -1 ;
   }
-  config = ADS1115_SingleEnded_Config( VRange, DateRate );
+
+  /* Cache the config register as it is now, so that unchanged writes can be skipped */
+  config = ADS1115_Read_Reg( adc_ptr, ADS1115_REG_POINTER_CONFIG );
   if (config == -1) {
-    printf("ADC configuration failed. Check configuration value.\n");
     print_time();
-    fprintf(error_log_, "ADC configuration failed. Check configuration value.\n");
+    fprintf(error_log_, "No ADS1115 answering at address 0x%02x\n", i2c_addr);
     fflush(error_log_);
+    ADS1115_Dev_Close( adc_ptr );
     return -1 ;
   }
+  adc_ptr->register_config = config & ~ADS1115_OS_MASK;
+  adc_ptr->continuous = ((adc_ptr->register_config & ADS1115_MODE_MASK) == ADS1115_MODE_CONTIN);
   return 0;
 }
 
 
 /*
- * This function sets the global configuration integer for ADS 1115 in a
- * single-ended read mode (not differential voltage measurement)
+ * This function closes a device opened by ADS1115_Dev_Open
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *
+ * Return: None
+ */
+void ADS1115_Dev_Close( ads1115_t *adc_ptr ) {
+  if (adc_ptr->i2c_fd != -1) I2C_Close( adc_ptr->i2c_fd );
+  adc_ptr->i2c_fd = -1;
+  return;
+}
+
+
+/*
+ * This function sets the configuration integer of a device for ADS 1115,
+ * without the input multiplexer which is set for each conversion
  *
  * Arguments:
+ *   adc_ptr:  [Output] the device
  *   VRange:   [Input] the voltage range, can be 0.256, 0.512, 1.024, 2.048, 4.096, or 6.144
  *                     Input voltage on the analoge pins should not exceed Vcc regardless of this setting
  *   DataRate: [Input] the data rate, can be 8, 16, 32, 64, 128, 250, 475 or 860
@@ -145,7 +213,7 @@ int ADS1115_Init( int i2c_addr, double VRange, int DateRate ) {
  * Return:
  *   0 on success or -1 on failure
  */
-int ADS1115_SingleEnded_Config( double VRange, int DateRate ) {
+int ADS1115_Config( ads1115_t *adc_ptr, double VRange, int DateRate ) {
   uint16_t m_gain, m_dataRate;
 
 
@@ -203,8 +271,11 @@ int ADS1115_SingleEnded_Config( double VRange, int DateRate ) {
     break;
   }
 
-  /* generate a configuration int for single-ended operation */
-  config_ =
+  /* nominal conversion time */
+  adc_ptr->conversion_ns = 1000000000 / DateRate;
+
+  /* generate a configuration int, the channel is added for each conversion */
+  adc_ptr->config =
     ADS1115_CQUE_NONE    | /* Disable the comparator and put ALERT/RDY in high state (default) */
     ADS1115_CLAT_NONLAT  | /* Non-latching comparator                                (default) */
     ADS1115_CPOL_ACTVLOW | /* ALERT/RDY pin is low when active                       (default) */
@@ -215,86 +286,796 @@ int ADS1115_SingleEnded_Config( double VRange, int DateRate ) {
     0x0000               | /* Do not set channel information yet                               */
     ADS1115_OS_SINGLE;     /* Set 'start single-conversion' bit                                */
 
+  /* volts per count */
+  adc_ptr->lsb = ADS1115_fsRange( adc_ptr->config ) / 32768.0;
+
   return 0;
 }
 
 
 /*
- * This function read an analog input pin and return the voltage
+ * This function read an analog input pin of the default device and return
+ * the voltage
  *
  * Arguments
- *   channel: [Input] 0-3 for the channel to read
+ *   channel: [Input] 0-3 for a single-ended channel, or ADS1115_DIFF_* for a
+ *                    differential pair
  *
  * Return
  *   voltage read from the channel, or 0 on failure
  */
 double ADS1115_SingleEnded_Read( int channel ) {
+  return ADS1115_Dev_Read( &default_adc_, channel );
+}
+
+
+/*
+ * This function read an analog input pin of a device and return the voltage
+ * A single-shot read takes two I2C transactions: the config write that starts
+ * the conversion and the read of the result, the conversion time is slept.
+ * If the device is in continuous-conversion mode on the same channel, the
+ * config is not written and only the result is read.
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *   channel: [Input] 0-3 for a single-ended channel, or ADS1115_DIFF_* for a
+ *                    differential pair
+ *
+ * Return
+ *   voltage read from the channel, or 0 on failure
+ */
+double ADS1115_Dev_Read( ads1115_t *adc_ptr, int channel ) {
   uint16_t current_config;
-  uint16_t counts;
-  double fsRange;
+  int16_t counts;
+  int mux;
 
 
   /* set the channel */
+  mux = ADS1115_Channel_Mux( channel );
+  if (mux == -1) return 0;
+  /* the ADC already converts this channel */
+  if (adc_ptr->continuous && (adc_ptr->register_config & ADS1115_MUX_MASK) == mux) {
+    return ADS1115_Dev_Continuous_Read( adc_ptr );
+  }
+  current_config = adc_ptr->config | mux;
+
+  /* Start the conversion */
+  ADS1115_Start_Conversion( adc_ptr, current_config );
+
+  /* Wait for the conversion to complete */
+  ADS1115_Wait_Conversion( adc_ptr );
+
+  /* Read the conversion results */
+  counts = ADS1115_Read_Counts( adc_ptr );
+
+  /* Compute and return the voltage */
+  return ( counts * adc_ptr->lsb );
+}
+
+
+/*
+ * Continuous-conversion mode of the default device, see ADS1115_Dev_Continuous_Start
+ */
+int ADS1115_Continuous_Start( int channel ) {
+  return ADS1115_Dev_Continuous_Start( &default_adc_, channel );
+}
+
+double ADS1115_Continuous_Read( void ) {
+  return ADS1115_Dev_Continuous_Read( &default_adc_ );
+}
+
+void ADS1115_Continuous_Stop( void ) {
+  ADS1115_Dev_Continuous_Stop( &default_adc_ );
+  return;
+}
+
+
+/*
+ * This function puts the ADC in continuous-conversion mode on one channel.
+ * The ADC then converts back to back at the programmed data rate, and each
+ * ADS1115_Dev_Continuous_Read only needs to read the conversion register.
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *   channel: [Input] 0-3 for a single-ended channel, or ADS1115_DIFF_* for a
+ *                    differential pair
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int ADS1115_Dev_Continuous_Start( ads1115_t *adc_ptr, int channel ) {
+  uint16_t current_config;
+  int mux;
+
+  mux = ADS1115_Channel_Mux( channel );
+  if (mux == -1) return -1;
+
+  /* same settings as single-shot, in continuous mode and without the start bit */
+  current_config = (adc_ptr->config & ~(ADS1115_MODE_MASK | ADS1115_OS_MASK)) | ADS1115_MODE_CONTIN | mux;
+
+  /* already converting this channel with these settings */
+  if (adc_ptr->continuous && adc_ptr->register_config == current_config) return 0;
+
+  if (ADS1115_Write_Config( adc_ptr, current_config ) == -1) return -1;
+
+  /* The first result is ready one conversion after the config write,
+   * ADS1115_Wait_Continuous adds the margin for the oscillator tolerance */
+  adc_ptr->last_read_ns = monotonic_ns();
+
+  return 0;
+}
+
+
+/*
+ * This function reads the latest conversion in continuous-conversion mode.
+ * Reads are paced by the data rate: if the previous read was less than one
+ * conversion time (plus 10% for the oscillator tolerance) ago, it sleeps until
+ * the next conversion is done, so every call returns a new sample with a
+ * single I2C transaction. Without the ALERT/RDY pin, this reads up to 10%
+ * slower than the data rate, and some conversions of a fast part are skipped.
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *
+ * Return
+ *   voltage read from the channel set by ADS1115_Dev_Continuous_Start,
+ *   or 0 if continuous mode is not started
+ */
+double ADS1115_Dev_Continuous_Read( ads1115_t *adc_ptr ) {
+  int16_t counts;
+
+  if (!adc_ptr->continuous) return 0;
+
+  /* wait for the next conversion */
+  ADS1115_Wait_Continuous( adc_ptr );
+
+  /* Read the conversion results */
+  counts = ADS1115_Read_Counts( adc_ptr );
+
+  return ( counts * adc_ptr->lsb );
+}
+
+
+/*
+ * Batch read of the default device, see ADS1115_Dev_Read_Raw
+ */
+int ADS1115_Read_Raw( int channel, int16_t *raw, uint64_t *time_ns, int n_samples ) {
+  return ADS1115_Dev_Read_Raw( &default_adc_, channel, raw, time_ns, n_samples );
+}
+
+
+/*
+ * This function reads consecutive conversions of one channel as raw counts.
+ * The device is put in continuous-conversion mode on the channel (if it is
+ * not already), so every sample costs one I2C transaction. The device stays
+ * in continuous mode, call ADS1115_Dev_Continuous_Stop to power it down.
+ * Convert the counts with ADC_Calibrate, using the lsb of the device as gain
+ * to get volts.
+ *
+ * Arguments
+ *   adc_ptr:   [Input]  the device
+ *   channel:   [Input]  0-3 for a single-ended channel, or ADS1115_DIFF_* for
+ *                       a differential pair
+ *   raw:       [Output, array size n_samples] conversion results in counts
+ *   time_ns:   [Output, array size n_samples] monotonic_ns() when each
+ *                       conversion was read, can be NULL
+ *   n_samples: [Input]  number of samples to read
+ *
+ * Return
+ *   number of samples read, or -1 on failure
+ */
+int ADS1115_Dev_Read_Raw( ads1115_t *adc_ptr, int channel, int16_t *raw, uint64_t *time_ns, int n_samples ) {
+  int ii;
+
+  if (ADS1115_Dev_Continuous_Start( adc_ptr, channel ) == -1) return -1;
+
+  for (ii = 0; ii < n_samples; ii++) {
+    ADS1115_Wait_Continuous( adc_ptr );
+    raw[ii] = ADS1115_Read_Counts( adc_ptr );
+    if (time_ns != NULL) time_ns[ii] = monotonic_ns();
+  }
+  return n_samples;
+}
+
+
+/*
+ * This function ends continuous-conversion mode and powers the ADC down, as
+ * after a single-shot conversion
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *
+ * Return: None
+ */
+void ADS1115_Dev_Continuous_Stop( ads1115_t *adc_ptr ) {
+  if (!adc_ptr->continuous) return;
+  ADS1115_Write_Config( adc_ptr, adc_ptr->config & ~ADS1115_OS_MASK );
+  return;
+}
+
+
+/*
+ * ALERT/RDY pin of the default device, see ADS1115_Dev_Ready_Pin_Init
+ */
+int ADS1115_Ready_Pin_Init( gpioedge_t *ready_ptr ) {
+  return ADS1115_Dev_Ready_Pin_Init( &default_adc_, ready_ptr );
+}
+
+
+/*
+ * This function sets up the ALERT/RDY pin as conversion-ready signal, so reads
+ * wait for its edge instead of polling the OS bit over I2C. The pin is open
+ * drain and needs a pull-up. It is set active low, so wait for falling edges.
+ * Every device needs its own pin. Call after ADS1115_Dev_Open.
+ *
+ * Arguments
+ *   adc_ptr:   [Input] the device
+ *   ready_ptr: [Input] edge event line connected to ALERT/RDY (see GPIO_Edge_Open,
+ *                      or GPIO_Edge_Open_Mock for testing), it must stay valid
+ *                      while it is used. NULL to go back to polling.
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int ADS1115_Dev_Ready_Pin_Init( ads1115_t *adc_ptr, gpioedge_t *ready_ptr ) {
+  int returnval;
+
+  /* Clear the comparator settings */
+  adc_ptr->config &= ~(ADS1115_CQUE_MASK | ADS1115_CLAT_MASK | ADS1115_CPOL_MASK | ADS1115_CMODE_MASK);
+
+  if (ready_ptr == NULL) {
+    /* Disable the comparator and put ALERT/RDY in high state (default) */
+    adc_ptr->config |= ADS1115_CQUE_NONE;
+    adc_ptr->ready_ptr = NULL;
+    return 0;
+  }
+
+  /* Conversion-ready mode is selected by setting the MSB of the high threshold
+   * register to 1 and the MSB of the low threshold register to 0 */
+  returnval  = ADS1115_Write_Reg( adc_ptr, ADS1115_REG_POINTER_HITHRESH , 0x8000 );
+  returnval |= ADS1115_Write_Reg( adc_ptr, ADS1115_REG_POINTER_LOWTHRESH, 0x0000 );
+  if (returnval == -1) {
+    adc_ptr->config |= ADS1115_CQUE_NONE;
+    return -1;
+  }
+
+  adc_ptr->config |=
+    ADS1115_CQUE_1CONV   | /* Assert ALERT/RDY after every conversion */
+    ADS1115_CLAT_NONLAT  | /* Non-latching                            */
+    ADS1115_CPOL_ACTVLOW | /* ALERT/RDY pin is low when active        */
+    ADS1115_CMODE_TRAD;
+  adc_ptr->ready_ptr = ready_ptr;
+
+  return 0;
+}
+
+
+/*
+ * This function starts a background scan of the default device,
+ * see ADS1115_Bus_Scan_Start
+ *
+ * Arguments
+ *   scan_ptr:   [Output] the scan, must stay valid until ADS1115_Scan_Stop
+ *   channels:   [Input, array size n_channels] channels to convert in order,
+ *                       0-3 or ADS1115_DIFF_*
+ *   n_channels: [Input] number of channels, 1 to ADCSCANMAX
+ *   scan_rate:  [Input] number of times per second the whole list is
+ *                       converted, 0 to convert as fast as the ADC allows
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int ADS1115_Scan_Start( adcscan_t *scan_ptr, const int *channels, int n_channels, double scan_rate ) {
+  ads1115_t *devices[1];
+
+  devices[0] = &default_adc_;
+  return ADS1115_Bus_Scan_Start( scan_ptr, devices, 1, channels, n_channels, scan_rate );
+}
+
+
+/*
+ * This function starts a background scan of the devices on one I2C bus: a
+ * thread converts the listed channels one after the other in single-shot
+ * mode, and puts the samples with their time into the ring of the scan.
+ * All devices convert the same channel at the same time, then they are read
+ * one after the other. The next conversions are started right after the
+ * results are read, and the samples are stored while they run. A read that
+ * fails gives no sample, and is counted in ring.failed.
+ * Devices on separate buses work in parallel, so use one scan per bus.
+ * The scan owns its devices, no other ADS1115 function should be used on
+ * them until ADS1115_Scan_Stop.
+ *
+ * Arguments
+ *   scan_ptr:   [Output] the scan, must stay valid until ADS1115_Scan_Stop
+ *   devices:    [Input, array size n_devices] devices to convert, all on the
+ *                       same bus, samples name them by their index
+ *   n_devices:  [Input] number of devices, 1 to ADCSCANDEVICES
+ *   channels:   [Input, array size n_channels] channels to convert in order,
+ *                       0-3 or ADS1115_DIFF_*, a channel can be listed more
+ *                       than once
+ *   n_channels: [Input] number of channels, 1 to ADCSCANMAX
+ *   scan_rate:  [Input] number of times per second the whole list is
+ *                       converted, 0 to convert as fast as the ADC allows
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int ADS1115_Bus_Scan_Start( adcscan_t *scan_ptr, ads1115_t **devices, int n_devices, \
+  const int *channels, int n_channels, double scan_rate ) {
+  int ii;
+
+  if (n_devices < 1 || n_devices > ADCSCANDEVICES) return -1;
+  for (ii = 0; ii < n_devices; ii++) {
+    if (devices[ii]->i2c_fd == -1 || devices[ii]->bus != devices[0]->bus) return -1;
+    scan_ptr->devices[ii] = devices[ii];
+  }
+  scan_ptr->n_devices = n_devices;
+
+  if (n_channels < 1 || n_channels > ADCSCANMAX) return -1;
+  for (ii = 0; ii < n_channels; ii++) {
+    if (ADS1115_Channel_Mux( channels[ii] ) == -1) return -1;
+    scan_ptr->channels[ii] = channels[ii];
+  }
+  scan_ptr->n_channels = n_channels;
+
+  scan_ptr->period_ns  = (scan_rate > 0) ? (uint64_t) (1e9 / scan_rate) : 0;
+  scan_ptr->ring.head    = 0;
+  scan_ptr->ring.tail    = 0;
+  scan_ptr->ring.dropped = 0;
+  scan_ptr->ring.failed  = 0;
+  scan_ptr->batch_read = (n_devices > 1);
+  scan_ptr->running    = true;
+  if (pthread_create( &scan_ptr->thread, NULL, ADS1115_Scan_Thread, scan_ptr ) != 0) {
+    print_time();
+    fprintf(error_log_, "Could not start ADC scan thread.\n");
+    fflush(error_log_);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * This function takes the samples converted by a scan since the last call,
+ * without waiting
+ *
+ * Arguments
+ *   scan_ptr:    [Input]  the scan
+ *   samples:     [Output, array size max_samples] the samples, oldest first
+ *   max_samples: [Input]  size of samples
+ *
+ * Return
+ *   number of samples written to samples
+ */
+int ADS1115_Scan_Read( adcscan_t *scan_ptr, adcsample_t *samples, int max_samples ) {
+  uint32_t head, tail, n, ii;
+
+  /* only this function writes tail, only the scan thread writes head */
+  tail = scan_ptr->ring.tail;
+  head = __atomic_load_n( &scan_ptr->ring.head, __ATOMIC_ACQUIRE );
+
+  n = head - tail;
+  if (n > (uint32_t) max_samples) n = max_samples;
+  for (ii = 0; ii < n; ii++) {
+    samples[ii] = scan_ptr->ring.samples[(tail + ii) & (ADCRINGSIZE - 1)];
+  }
+
+  /* hand the slots back to the scan thread */
+  __atomic_store_n( &scan_ptr->ring.tail, tail + n, __ATOMIC_RELEASE );
+  return n;
+}
+
+
+/*
+ * This function stops a scan and waits for its thread to finish
+ *
+ * Arguments
+ *   scan_ptr: [Input] the scan
+ *
+ * Return: None
+ */
+void ADS1115_Scan_Stop( adcscan_t *scan_ptr ) {
+  __atomic_store_n( &scan_ptr->running, false, __ATOMIC_RELEASE );
+  pthread_join( scan_ptr->thread, NULL );
+  return;
+}
+
+
+/*
+ * Thread function of a scan
+ *
+ * Arguments
+ *   scan_void_ptr: [Input] pointer to the adcscan_t
+ *
+ * Return
+ *   NULL
+ */
+void *ADS1115_Scan_Thread( void *scan_void_ptr ) {
+  adcscan_t *scan_ptr;
+  adcsample_t sample[ADCSCANDEVICES];
+  int16_t counts[ADCSCANDEVICES];
+  bool valid[ADCSCANDEVICES];
+  int index, channel, ii;
+  uint32_t head, tail;
+  uint64_t now_ns, next_scan_ns, time_ns;
+
+  scan_ptr = (adcscan_t *) scan_void_ptr;
+
+  /* Start the first conversions */
+  index = 0;
+  next_scan_ns = monotonic_ns() + scan_ptr->period_ns;
+  ADS1115_Bus_Start( scan_ptr, scan_ptr->channels[0] );
+
+  while ( __atomic_load_n( &scan_ptr->running, __ATOMIC_ACQUIRE ) ) {
+    /* Wait for the conversions, they ran in parallel so only the first device
+     * is waited on for long, then read them all */
+    for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+      ADS1115_Wait_Conversion( scan_ptr->devices[ii] );
+    }
+    ADS1115_Bus_Read( scan_ptr, counts, valid );
+    time_ns = monotonic_ns();
+    channel = scan_ptr->channels[index];
+    for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+      sample[ii].raw     = counts[ii];
+      sample[ii].time_ns = time_ns;
+      sample[ii].channel = channel;
+      sample[ii].device  = ii;
+      sample[ii].volts   = counts[ii] * scan_ptr->devices[ii]->lsb;
+    }
+
+    /* Move to the next channel, at the end of the list wait for the next scan */
+    index ++;
+    if (index == scan_ptr->n_channels) {
+      index = 0;
+      if (scan_ptr->period_ns != 0) {
+        now_ns = monotonic_ns();
+        if (now_ns < next_scan_ns) nsleep( next_scan_ns - now_ns );
+        /* do not try to catch up on scans that were missed */
+        next_scan_ns = (now_ns < next_scan_ns ? next_scan_ns : now_ns) + scan_ptr->period_ns;
+      }
+    }
+
+    /* Start the next conversions before storing the samples */
+    ADS1115_Bus_Start( scan_ptr, scan_ptr->channels[index] );
+
+    /* Store the samples, or drop them if the reader is too far behind. A
+     * failed read gives no sample. */
+    for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+      if (!valid[ii]) {
+        scan_ptr->ring.failed ++;
+        continue;
+      }
+      head = scan_ptr->ring.head;
+      tail = __atomic_load_n( &scan_ptr->ring.tail, __ATOMIC_ACQUIRE );
+      if (head - tail < ADCRINGSIZE) {
+        scan_ptr->ring.samples[head & (ADCRINGSIZE - 1)] = sample[ii];
+        __atomic_store_n( &scan_ptr->ring.head, head + 1, __ATOMIC_RELEASE );
+      }
+      else {
+        scan_ptr->ring.dropped ++;
+      }
+    }
+  }
+
+  /* let the last conversions finish, which powers the ADCs down */
+  for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+    ADS1115_Wait_Conversion( scan_ptr->devices[ii] );
+  }
+  return NULL;
+}
+
+
+/*
+ * Start a single-shot conversion of one channel on all devices of a scan,
+ * with one I2C transfer for the whole bus
+ *
+ * Arguments
+ *   scan_ptr: [Input] the scan
+ *   channel:  [Input] channel to convert
+ *
+ * Return: None
+ */
+void ADS1115_Bus_Start( adcscan_t *scan_ptr, int channel ) {
+  i2cxfer_t xfers[ADCSCANDEVICES];
+  uint8_t data[ADCSCANDEVICES][2];
+  uint16_t config;
+  uint64_t now_ns;
+  ads1115_t *adc_ptr;
+  int ii;
+
+  for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+    adc_ptr = scan_ptr->devices[ii];
+    /* Forget edges of earlier conversions */
+    if (adc_ptr->ready_ptr != NULL) GPIO_Edge_Flush( adc_ptr->ready_ptr );
+
+    config = adc_ptr->config | ADS1115_Channel_Mux( channel );
+    data[ii][0] = config >> 8;
+    data[ii][1] = config & 0xff;
+    xfers[ii].addr   = adc_ptr->i2c_addr;
+    xfers[ii].reg    = ADS1115_REG_POINTER_CONFIG;
+    xfers[ii].read   = false;
+    xfers[ii].data   = data[ii];
+    xfers[ii].length = 2;
+    adc_ptr->register_config = config & ~ADS1115_OS_MASK;
+    adc_ptr->continuous = false;
+  }
+
+  I2C_Transfer( scan_ptr->devices[0]->i2c_fd, xfers, scan_ptr->n_devices );
+
+  now_ns = monotonic_ns();
+  for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+    adc_ptr = scan_ptr->devices[ii];
+    adc_ptr->ready_ns = now_ns + adc_ptr->conversion_ns + adc_ptr->conversion_ns/10 + ADS1115_WAKEUP_NS;
+  }
+  return;
+}
+
+
+/*
+ * Read the conversion results of all devices of a scan, with one I2C transfer
+ * for the whole bus if the bus supports it. Some controllers, like the
+ * i2c-bcm2835 of the Raspberry Pi, only take a read as the last message of a
+ * transfer. If the batch fails but the devices can be read one by one, they
+ * are read one by one from then on.
+ *
+ * Arguments
+ *   scan_ptr: [Input/Output] the scan
+ *   counts:   [Output, array size n_devices of the scan] results in counts
+ *   valid:    [Output, array size n_devices of the scan] false if the read of
+ *                            the device failed, its count is then 0
+ *
+ * Return: None
+ */
+void ADS1115_Bus_Read( adcscan_t *scan_ptr, int16_t *counts, bool *valid ) {
+  i2cxfer_t xfers[ADCSCANDEVICES];
+  uint8_t data[ADCSCANDEVICES][2];
+  int ii, fd, n_valid;
+
+  for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+    xfers[ii].addr   = scan_ptr->devices[ii]->i2c_addr;
+    xfers[ii].reg    = ADS1115_REG_POINTER_CONVERT;
+    xfers[ii].read   = true;
+    xfers[ii].data   = data[ii];
+    xfers[ii].length = 2;
+  }
+
+  fd = scan_ptr->devices[0]->i2c_fd;
+  if (scan_ptr->batch_read && I2C_Transfer( fd, xfers, scan_ptr->n_devices ) == 0) {
+    for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+      counts[ii] = (int16_t) ((data[ii][0] << 8) | data[ii][1]);
+      valid[ii]  = true;
+    }
+    return;
+  }
+
+  /* one pointer write and read per transfer */
+  n_valid = 0;
+  for (ii = 0; ii < scan_ptr->n_devices; ii++) {
+    valid[ii]  = (I2C_Transfer( fd, &xfers[ii], 1 ) == 0);
+    counts[ii] = valid[ii] ? (int16_t) ((data[ii][0] << 8) | data[ii][1]) : 0;
+    if (valid[ii]) n_valid ++;
+  }
+  if (scan_ptr->batch_read && n_valid == scan_ptr->n_devices) {
+    scan_ptr->batch_read = false;
+    print_time();
+    fprintf(error_log_, "I2C bus %d does not take batched reads, the ADCs are read one by one.\n", \
+      scan_ptr->devices[0]->bus);
+    fflush(error_log_);
+  }
+  return;
+}
+
+
+/*
+ * Write the config register and keep a copy of it in the device
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *   config:  [Input] config register value
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int ADS1115_Write_Config( ads1115_t *adc_ptr, uint16_t config ) {
+  /* Write config to the config register of the ADC */
+  if (ADS1115_Write_Reg( adc_ptr, ADS1115_REG_POINTER_CONFIG, config ) == -1) return -1;
+
+  /* the OS bit only starts a conversion, it is not stored */
+  adc_ptr->register_config = config & ~ADS1115_OS_MASK;
+  adc_ptr->continuous = ((config & ADS1115_MODE_MASK) == ADS1115_MODE_CONTIN);
+  return 0;
+}
+
+
+/*
+ * Write a single-shot config to start a conversion
+ * The write is needed even if the config did not change, as the OS bit
+ * starts the conversion.
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *   config:  [Input] config register value including the mux and the OS bit
+ *
+ * Return: None
+ */
+void ADS1115_Start_Conversion( ads1115_t *adc_ptr, uint16_t config ) {
+  /* Forget edges of earlier conversions */
+  if (adc_ptr->ready_ptr != NULL) GPIO_Edge_Flush( adc_ptr->ready_ptr );
+
+  ADS1115_Write_Config( adc_ptr, config );
+  adc_ptr->ready_ns = monotonic_ns() + adc_ptr->conversion_ns + adc_ptr->conversion_ns/10 + ADS1115_WAKEUP_NS;
+  return;
+}
+
+
+/*
+ * Wait for a single-shot conversion to complete
+ * With the ALERT/RDY pin, wait for its edge. Allow twice the conversion time
+ * in case an edge is missed. Without it, sleep until the conversion time of
+ * the programmed data rate has passed, which costs no I2C transaction.
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *
+ * Return: None
+ */
+void ADS1115_Wait_Conversion( ads1115_t *adc_ptr ) {
+  uint64_t now_ns;
+
+  if (adc_ptr->ready_ptr != NULL && GPIO_Edge_Wait( adc_ptr->ready_ptr, 2*adc_ptr->conversion_ns ) == 1) return;
+
+  now_ns = monotonic_ns();
+  if (now_ns < adc_ptr->ready_ns) nsleep( adc_ptr->ready_ns - now_ns );
+  return;
+}
+
+
+/*
+ * Wait for the next conversion in continuous-conversion mode
+ * With the ALERT/RDY pin, a conversion that finished since the last read is
+ * read right away, otherwise wait for the pulse of the next one. Without it,
+ * reads are paced by the conversion time plus 10%, the tolerance of the
+ * internal oscillator, so a slow part still has a new conversion ready.
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *
+ * Return: None
+ */
+void ADS1115_Wait_Continuous( ads1115_t *adc_ptr ) {
+  uint64_t now_ns, next_ns;
+
+  if (adc_ptr->ready_ptr != NULL) {
+    if (GPIO_Edge_Flush( adc_ptr->ready_ptr ) == 0) GPIO_Edge_Wait( adc_ptr->ready_ptr, 2*adc_ptr->conversion_ns );
+    return;
+  }
+
+  now_ns  = monotonic_ns();
+  next_ns = adc_ptr->last_read_ns + adc_ptr->conversion_ns + adc_ptr->conversion_ns/10;
+  if (now_ns < next_ns) nsleep( next_ns - now_ns );
+  /* keep the pace of the ADC unless the caller fell behind */
+  adc_ptr->last_read_ns = (now_ns < next_ns) ? next_ns : now_ns;
+  return;
+}
+
+
+/*
+ * Read the conversion register
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *
+ * Return
+ *   the signed conversion result in counts
+ */
+int16_t ADS1115_Read_Counts( ads1115_t *adc_ptr ) {
+  int counts;
+
+  counts = ADS1115_Read_Reg( adc_ptr, ADS1115_REG_POINTER_CONVERT );
+  if (counts == -1) return 0;
+  return (int16_t) counts;
+}
+
+
+/*
+ * Write a 16-bit register in one I2C transfer
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *   reg:     [Input] ADS1115_REG_POINTER_* register
+ *   value:   [Input] register value
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int ADS1115_Write_Reg( ads1115_t *adc_ptr, uint8_t reg, uint16_t value ) {
+  uint8_t data[2];
+
+  /* ADS1115 registers are sent Most Significant Byte first */
+  data[0] = value >> 8;
+  data[1] = value & 0xff;
+  return I2C_Write( adc_ptr->i2c_fd, adc_ptr->i2c_addr, reg, data, 2 );
+}
+
+
+/*
+ * Read a 16-bit register in one I2C transfer (pointer write and read)
+ *
+ * Arguments
+ *   adc_ptr: [Input] the device
+ *   reg:     [Input] ADS1115_REG_POINTER_* register
+ *
+ * Return
+ *   register value, or -1 on failure
+ */
+int ADS1115_Read_Reg( ads1115_t *adc_ptr, uint8_t reg ) {
+  uint8_t data[2];
+
+  if (I2C_Read( adc_ptr->i2c_fd, adc_ptr->i2c_addr, reg, data, 2 ) == -1) return -1;
+  /* ADS1115 registers are sent Most Significant Byte first */
+  return (data[0] << 8) | data[1];
+}
+
+
+/*
+ * Convert a channel number into the config register mux bits
+ *
+ * Arguments
+ *   channel: [Input] 0-3 for a single-ended channel, or ADS1115_DIFF_* for a
+ *                    differential pair
+ *
+ * Return
+ *   the ADS1115_MUX_* value, or -1 for an invalid channel
+ */
+int ADS1115_Channel_Mux( int channel ) {
   switch (channel) {
   case 0:
-    current_config = config_ | ADS1115_MUX_SINGLE_0;
-    break;
+    return ADS1115_MUX_SINGLE_0;
   case 1:
-    current_config = config_ | ADS1115_MUX_SINGLE_1;
-    break;
+    return ADS1115_MUX_SINGLE_1;
   case 2:
-    current_config = config_ | ADS1115_MUX_SINGLE_2;
-    break;
+    return ADS1115_MUX_SINGLE_2;
   case 3:
-    current_config = config_ | ADS1115_MUX_SINGLE_3;
-    break;
+    return ADS1115_MUX_SINGLE_3;
+  case ADS1115_DIFF_0_1:
+    return ADS1115_MUX_DIFF_0_1;
+  case ADS1115_DIFF_0_3:
+    return ADS1115_MUX_DIFF_0_3;
+  case ADS1115_DIFF_1_3:
+    return ADS1115_MUX_DIFF_1_3;
+  case ADS1115_DIFF_2_3:
+    return ADS1115_MUX_DIFF_2_3;
   default:
-    return 0;
+    return -1;
   }
+}
 
-  /* byte swap is needed as ADS1115 read and write starts with the Most Significant Bit */
-  current_config = (current_config>>8) | ((current_config<<8)&0xffff);
-  /* Write config to the config register of the ADC */
-  wiringPiI2CWriteReg16(i2c_fd_, ADS1115_REG_POINTER_CONFIG, current_config);
-
-  /* Wait for the conversion to complete
-   * First read the configuration register, mask with ADS1115_OS_MASK to get only the OS value,
-   * then compare with ADS1115_OS_BUSY to see if it is still doing the conversion */
-  while ( ((wiringPiI2CReadReg16(i2c_fd_, ADS1115_REG_POINTER_CONFIG) & ADS1115_OS_MASK ) == ADS1115_OS_BUSY) ) {
-    nsleep(1000);
-  }
 
-  /* Read the conversion results */
-  counts = wiringPiI2CReadReg16( i2c_fd_, ADS1115_REG_POINTER_CONVERT);
-  /* byte swap is needed as ADS1115 read and write starts with the Most Significant Bit */
-  counts = (counts>>8) | ((counts<<8)&0xffff);
-
-  /* Compute the fsRange from config */
-  switch (ADS1115_PGA_MASK & current_config) {
+/*
+ * Compute the full scale range from config
+ *
+ * Arguments
+ *   config: [Input] config register value
+ *
+ * Return
+ *   full scale range in volts
+ */
+double ADS1115_fsRange( uint16_t config ) {
+  switch (ADS1115_PGA_MASK & config) {
   case ADS1115_PGA_6_144V:
-    fsRange = 6.144;
-    break;
+    return 6.144;
   case ADS1115_PGA_4_096V:
-    fsRange = 4.096;
-    break;
+    return 4.096;
   case ADS1115_PGA_2_048V:
-    fsRange = 2.048;
-    break;
+    return 2.048;
   case ADS1115_PGA_1_024V:
-    fsRange = 1.024;
-    break;
+    return 1.024;
   case ADS1115_PGA_0_512V:
-    fsRange = 0.512;
-    break;
+    return 0.512;
   case ADS1115_PGA_0_256V:
-    fsRange = 0.256;
-    break;
+    return 0.256;
   default:
-    fsRange = 0.0;
+    return 0.0;
   }
-
-  /* Compute and return the voltage */
-  return ( counts * (fsRange / 32768.0) );
 }
 
 
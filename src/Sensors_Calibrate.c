@@ -0,0 +1,94 @@
+/* Conversion of raw ADC counts into calibrated values, over whole arrays
+ *
+ * value = raw * gain + offset, where gain is in units per count. For volts,
+ * gain is the lsb of the device and offset is 0. A sensor with a calibration
+ * of units = volts * k + b uses gain = lsb * k and offset = b.
+ *
+ * The loops have no branches and no aliasing (restrict), so they are
+ * vectorized by the compiler at -O3 (NEON on the Raspberry Pi, SSE/AVX on x86).
+ */
+
+#include <CLibrary.h>
+#include <Sensors.h>
+
+
+
+/*
+ * This function converts samples of one channel
+ *
+ * Arguments
+ *   raw:       [Input,  array size n_samples] conversion results in counts
+ *   n_samples: [Input]  number of samples
+ *   gain:      [Input]  units per count
+ *   offset:    [Input]  units at 0 count
+ *   values:    [Output, array size n_samples] calibrated values
+ *
+ * Return: None
+ */
+void ADC_Calibrate( const int16_t *restrict raw, int n_samples, double gain, double offset, double *restrict values ) {
+  int ii;
+
+  for (ii = 0; ii < n_samples; ii++) {
+    values[ii] = raw[ii] * gain + offset;
+  }
+  return;
+}
+
+
+/*
+ * This function converts samples of mixed channels, such as those of a scan,
+ * with the gain and offset of each sample's channel
+ *
+ * Arguments
+ *   raw:       [Input,  array size n_samples] conversion results in counts
+ *   channels:  [Input,  array size n_samples] channel of each sample
+ *   n_samples: [Input]  number of samples
+ *   gain:      [Input,  array size ADS1115_CHANNELS] units per count of each channel
+ *   offset:    [Input,  array size ADS1115_CHANNELS] units at 0 count of each channel
+ *   values:    [Output, array size n_samples] calibrated values
+ *
+ * Return: None
+ */
+void ADC_Calibrate_Channels( const int16_t *restrict raw, const uint8_t *restrict channels, int n_samples, \
+  const double *restrict gain, const double *restrict offset, double *restrict values ) {
+  int ii;
+
+  for (ii = 0; ii < n_samples; ii++) {
+    values[ii] = raw[ii] * gain[channels[ii]] + offset[channels[ii]];
+  }
+  return;
+}
+
+
+/*
+ * This function converts samples that repeat a fixed channel order, sample ii
+ * being of the channel at position ii % n_channels in the order. This is
+ * faster than ADC_Calibrate_Channels as no lookup is needed.
+ *
+ * Arguments
+ *   raw:        [Input,  array size n_samples] conversion results in counts
+ *   n_samples:  [Input]  number of samples
+ *   n_channels: [Input]  number of channels in the order
+ *   gain:       [Input,  array size n_channels] units per count, in channel order
+ *   offset:     [Input,  array size n_channels] units at 0 count, in channel order
+ *   values:     [Output, array size n_samples] calibrated values
+ *
+ * Return: None
+ */
+void ADC_Calibrate_Interleaved( const int16_t *restrict raw, int n_samples, int n_channels, \
+  const double *restrict gain, const double *restrict offset, double *restrict values ) {
+  int ii, jj, n_frames;
+
+  /* whole frames, the inner loop is the same for every frame */
+  n_frames = n_samples / n_channels;
+  for (ii = 0; ii < n_frames; ii++) {
+    for (jj = 0; jj < n_channels; jj++) {
+      values[ii*n_channels + jj] = raw[ii*n_channels + jj] * gain[jj] + offset[jj];
+    }
+  }
+  /* last partial frame */
+  for (jj = 0; jj < n_samples - n_frames*n_channels; jj++) {
+    values[n_frames*n_channels + jj] = raw[n_frames*n_channels + jj] * gain[jj] + offset[jj];
+  }
+  return;
+}
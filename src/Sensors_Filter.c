@@ -0,0 +1,460 @@
+/* Streaming filters for sensor samples
+ *
+ * A filter is a chain of stages, each run over a whole block of samples before
+ * the next one, so the inner loops stay small and work on contiguous arrays.
+ * Every stage keeps its state between blocks, so a stream can be fed in blocks
+ * of any size (for example what ADS1115_Scan_Read returned for one channel).
+ *
+ * Stages:
+ *   boxcar:   moving average over the last N samples
+ *   biquad:   cascade of second order IIR sections (transposed direct form II)
+ *   median:   median of the last N samples, removes spikes
+ *   CIC:      cascaded integrator-comb of order M, decimating by R, with the
+ *             gain of R^M removed
+ *
+ * Example: 860 SPS to 50 Hz with spike removal and a 20 Hz low pass
+ *   Filter_Init( &filter );
+ *   Filter_Add_Median( &filter, 3 );
+ *   Filter_Add_CIC( &filter, 17, 3 );
+ *   Filter_Add_Lowpass( &filter, 20.0, 860.0/17, 2 );
+ *   n_out = Filter_Process( &filter, volts, n_in, filtered );
+ */
+
+#include <CLibrary.h>
+#include <Sensors.h>
+#include <math.h>
+
+
+/************ Static Functions Limited to Access within this File ************/
+static filterstage_t *Filter_New_Stage( filter_t *filter_ptr, int type );
+static int Filter_Boxcar( filterstage_t *stage_ptr, double *data, int n_samples );
+static int Filter_Biquad( filterstage_t *stage_ptr, double *data, int n_samples );
+static int Filter_Median( filterstage_t *stage_ptr, double *data, int n_samples );
+static int Filter_CIC( filterstage_t *stage_ptr, double *data, int n_samples );
+
+
+
+/*
+ * This function initializes a filter without stages, which passes samples
+ * through unchanged
+ *
+ * Arguments
+ *   filter_ptr: [Output] the filter
+ *
+ * Return: None
+ */
+void Filter_Init( filter_t *filter_ptr ) {
+  memset( filter_ptr, 0, sizeof(filter_t) );
+  return;
+}
+
+
+/*
+ * This function adds a moving average stage
+ *
+ * Arguments
+ *   filter_ptr: [Input] the filter
+ *   length:     [Input] number of samples averaged, 1 to FILTERMAXTAPS
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Filter_Add_Boxcar( filter_t *filter_ptr, int length ) {
+  filterstage_t *stage_ptr;
+
+  if (length < 1 || length > FILTERMAXTAPS) return -1;
+  stage_ptr = Filter_New_Stage( filter_ptr, FILTER_BOXCAR );
+  if (stage_ptr == NULL) return -1;
+  stage_ptr->length = length;
+  return 0;
+}
+
+
+/*
+ * This function adds a cascade of second order IIR sections, each being
+ *   y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] - a1 y[n-1] - a2 y[n-2]
+ *
+ * Arguments
+ *   filter_ptr: [Input] the filter
+ *   coeffs:     [Input, array size n_biquads] b0, b1, b2, a1, a2 of each
+ *                       section, normalized so that a0 is 1
+ *   n_biquads:  [Input] number of sections, 1 to FILTERMAXBIQUADS
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Filter_Add_Biquad( filter_t *filter_ptr, const double coeffs[][5], int n_biquads ) {
+  filterstage_t *stage_ptr;
+
+  if (n_biquads < 1 || n_biquads > FILTERMAXBIQUADS) return -1;
+  stage_ptr = Filter_New_Stage( filter_ptr, FILTER_BIQUAD );
+  if (stage_ptr == NULL) return -1;
+  memcpy( stage_ptr->coeffs, coeffs, n_biquads * sizeof(coeffs[0]) );
+  stage_ptr->length = n_biquads;
+  return 0;
+}
+
+
+/*
+ * This function adds a Butterworth low pass of order 2*n_biquads, as a
+ * cascade of second order sections (bilinear transform)
+ *
+ * Arguments
+ *   filter_ptr:  [Input] the filter
+ *   cutoff:      [Input] -3 dB frequency in Hz, below sample_rate/2
+ *   sample_rate: [Input] sample rate at this stage in Hz, after any decimation
+ *                        by earlier stages
+ *   n_biquads:   [Input] number of sections, 1 to FILTERMAXBIQUADS
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Filter_Add_Lowpass( filter_t *filter_ptr, double cutoff, double sample_rate, int n_biquads ) {
+  double coeffs[FILTERMAXBIQUADS][5];
+  double w0, alpha, q, a0;
+  int ii;
+
+  if (cutoff <= 0 || cutoff >= sample_rate/2) return -1;
+  if (n_biquads < 1 || n_biquads > FILTERMAXBIQUADS) return -1;
+
+  w0 = 2 * M_PI * cutoff / sample_rate;
+  for (ii = 0; ii < n_biquads; ii++) {
+    /* Q of each section places the poles of the Butterworth polynomial */
+    q = 1.0 / (2 * sin( (2*ii + 1) * M_PI / (4 * n_biquads) ));
+    alpha = sin(w0) / (2*q);
+    a0 = 1 + alpha;
+    coeffs[ii][0] = (1 - cos(w0)) / 2 / a0;
+    coeffs[ii][1] = (1 - cos(w0)) / a0;
+    coeffs[ii][2] = (1 - cos(w0)) / 2 / a0;
+    coeffs[ii][3] = -2 * cos(w0) / a0;
+    coeffs[ii][4] = (1 - alpha) / a0;
+  }
+  return Filter_Add_Biquad( filter_ptr, (const double (*)[5]) coeffs, n_biquads );
+}
+
+
+/*
+ * This function adds a median stage
+ *
+ * Arguments
+ *   filter_ptr: [Input] the filter
+ *   length:     [Input] number of samples the median is taken over, odd,
+ *                       1 to FILTERMAXTAPS. The cost grows with length,
+ *                       3 to 7 is enough to remove single spikes.
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Filter_Add_Median( filter_t *filter_ptr, int length ) {
+  filterstage_t *stage_ptr;
+
+  if (length < 1 || length > FILTERMAXTAPS || length % 2 == 0) return -1;
+  stage_ptr = Filter_New_Stage( filter_ptr, FILTER_MEDIAN );
+  if (stage_ptr == NULL) return -1;
+  stage_ptr->length = length;
+  return 0;
+}
+
+
+/*
+ * This function adds a CIC decimator: order M moving sums of R samples,
+ * keeping one output every R input samples. Order 1 is a block average.
+ *
+ * Arguments
+ *   filter_ptr: [Input] the filter
+ *   factor:     [Input] decimation factor R, 1 or more
+ *   order:      [Input] number of integrator and comb pairs M, 1 to FILTERMAXCIC,
+ *                       (order-1)*factor can be at most FILTERHISTORY
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Filter_Add_CIC( filter_t *filter_ptr, int factor, int order ) {
+  filterstage_t *stage_ptr;
+
+  if (factor < 1 || order < 1 || order > FILTERMAXCIC) return -1;
+  if ((order - 1) * factor > FILTERHISTORY) return -1;
+  stage_ptr = Filter_New_Stage( filter_ptr, FILTER_CIC );
+  if (stage_ptr == NULL) return -1;
+  stage_ptr->length = factor;
+  stage_ptr->order  = order;
+  return 0;
+}
+
+
+/*
+ * This function runs a block of samples through all stages
+ *
+ * Arguments
+ *   filter_ptr: [Input]  the filter
+ *   input:      [Input,  array size n_samples] samples, oldest first
+ *   n_samples:  [Input]  number of samples
+ *   output:     [Output, array size n_samples] filtered samples, can be the
+ *                        same array as input. Fewer samples than given come
+ *                        out when there are decimating stages.
+ *
+ * Return
+ *   number of samples written to output
+ */
+int Filter_Process( filter_t *filter_ptr, const double *input, int n_samples, double *output ) {
+  filterstage_t *stage_ptr;
+  uint64_t start_ns;
+  int ii, n_in;
+
+  if (output != input) memcpy( output, input, n_samples * sizeof(double) );
+
+  /* every stage works in place, decimation only moves samples to lower indices */
+  for (ii = 0; ii < filter_ptr->n_stages; ii++) {
+    stage_ptr = &filter_ptr->stages[ii];
+    n_in = n_samples;
+    start_ns = monotonic_ns();
+    switch (stage_ptr->type) {
+    case FILTER_BOXCAR:
+      n_samples = Filter_Boxcar( stage_ptr, output, n_samples );
+      break;
+    case FILTER_BIQUAD:
+      n_samples = Filter_Biquad( stage_ptr, output, n_samples );
+      break;
+    case FILTER_MEDIAN:
+      n_samples = Filter_Median( stage_ptr, output, n_samples );
+      break;
+    case FILTER_CIC:
+      n_samples = Filter_CIC( stage_ptr, output, n_samples );
+      break;
+    }
+    stage_ptr->time_ns += monotonic_ns() - start_ns;
+    stage_ptr->n_samples += n_in;
+  }
+  return n_samples;
+}
+
+
+/*
+ * This function gives the average processing time of a stage
+ *
+ * Arguments
+ *   filter_ptr: [Input] the filter
+ *   stage:      [Input] index of the stage, in the order they were added
+ *
+ * Return
+ *   nanoseconds per input sample of the stage, or 0 if it has not run
+ */
+double Filter_Stage_Cost( filter_t *filter_ptr, int stage ) {
+  filterstage_t *stage_ptr;
+
+  if (stage < 0 || stage >= filter_ptr->n_stages) return 0;
+  stage_ptr = &filter_ptr->stages[stage];
+  if (stage_ptr->n_samples == 0) return 0;
+  return (double) stage_ptr->time_ns / stage_ptr->n_samples;
+}
+
+
+/*
+ * This function clears the state of all stages, as if no sample had been
+ * processed, the stages and their cost are kept
+ *
+ * Arguments
+ *   filter_ptr: [Input] the filter
+ *
+ * Return: None
+ */
+void Filter_Reset( filter_t *filter_ptr ) {
+  filterstage_t *stage_ptr;
+  int ii;
+
+  for (ii = 0; ii < filter_ptr->n_stages; ii++) {
+    stage_ptr = &filter_ptr->stages[ii];
+    memset( stage_ptr->state, 0, sizeof(stage_ptr->state) );
+    memset( stage_ptr->cic_sums, 0, sizeof(stage_ptr->cic_sums) );
+    memset( stage_ptr->history, 0, sizeof(stage_ptr->history) );
+    stage_ptr->position = 0;
+    stage_ptr->count    = 0;
+    stage_ptr->sum      = 0;
+  }
+  return;
+}
+
+
+
+/*
+ * Append a cleared stage to a filter
+ *
+ * Arguments
+ *   filter_ptr: [Input] the filter
+ *   type:       [Input] FILTER_* type of the stage
+ *
+ * Return
+ *   the new stage, or NULL if the filter is full
+ */
+filterstage_t *Filter_New_Stage( filter_t *filter_ptr, int type ) {
+  filterstage_t *stage_ptr;
+
+  if (filter_ptr->n_stages == FILTERMAXSTAGES) return NULL;
+  stage_ptr = &filter_ptr->stages[filter_ptr->n_stages];
+  memset( stage_ptr, 0, sizeof(filterstage_t) );
+  stage_ptr->type = type;
+  filter_ptr->n_stages ++;
+  return stage_ptr;
+}
+
+
+/*
+ * Moving average with a running sum. Until length samples have been seen,
+ * the average is over the samples seen so far.
+ * The sum is recomputed from the history once per turn of the history, so
+ * rounding errors do not build up.
+ */
+int Filter_Boxcar( filterstage_t *stage_ptr, double *data, int n_samples ) {
+  double sum;
+  int ii, jj, position, count, length;
+
+  sum      = stage_ptr->sum;
+  position = stage_ptr->position;
+  count    = stage_ptr->count;
+  length   = stage_ptr->length;
+
+  for (ii = 0; ii < n_samples; ii++) {
+    sum += data[ii] - stage_ptr->history[position];
+    stage_ptr->history[position] = data[ii];
+    if (count < length) count ++;
+    data[ii] = sum / count;
+
+    position ++;
+    if (position == length) {
+      position = 0;
+      sum = 0;
+      for (jj = 0; jj < length; jj++) sum += stage_ptr->history[jj];
+    }
+  }
+
+  stage_ptr->sum      = sum;
+  stage_ptr->position = position;
+  stage_ptr->count    = count;
+  return n_samples;
+}
+
+
+/*
+ * Biquad cascade, transposed direct form II. Each section runs over the whole
+ * block before the next one, with its coefficients and state in registers.
+ */
+int Filter_Biquad( filterstage_t *stage_ptr, double *data, int n_samples ) {
+  double b0, b1, b2, a1, a2, s1, s2, x, y;
+  int ii, jj;
+
+  for (jj = 0; jj < stage_ptr->length; jj++) {
+    b0 = stage_ptr->coeffs[jj][0];
+    b1 = stage_ptr->coeffs[jj][1];
+    b2 = stage_ptr->coeffs[jj][2];
+    a1 = stage_ptr->coeffs[jj][3];
+    a2 = stage_ptr->coeffs[jj][4];
+    s1 = stage_ptr->state[jj][0];
+    s2 = stage_ptr->state[jj][1];
+
+    for (ii = 0; ii < n_samples; ii++) {
+      x  = data[ii];
+      y  = b0*x + s1;
+      s1 = b1*x - a1*y + s2;
+      s2 = b2*x - a2*y;
+      data[ii] = y;
+    }
+
+    stage_ptr->state[jj][0] = s1;
+    stage_ptr->state[jj][1] = s2;
+  }
+  return n_samples;
+}
+
+
+/*
+ * Median of the last length samples. The window is kept sorted: the oldest
+ * sample is removed and the new one inserted, which moves at most length
+ * values. Until length samples have been seen, the median is over the samples
+ * seen so far.
+ */
+int Filter_Median( filterstage_t *stage_ptr, double *data, int n_samples ) {
+  double *sorted, old;
+  int ii, jj, position, count, length;
+
+  /* the first part of history is the window in time order, the second part sorted */
+  sorted   = stage_ptr->history + FILTERMAXTAPS;
+  position = stage_ptr->position;
+  count    = stage_ptr->count;
+  length   = stage_ptr->length;
+
+  for (ii = 0; ii < n_samples; ii++) {
+    /* remove the oldest sample from the sorted window */
+    if (count == length) {
+      old = stage_ptr->history[position];
+      for (jj = 0; jj < count - 1 && sorted[jj] != old; jj++);
+      for (; jj < count - 1; jj++) sorted[jj] = sorted[jj+1];
+      count --;
+    }
+    stage_ptr->history[position] = data[ii];
+    position = (position + 1 == length) ? 0 : position + 1;
+
+    /* insert the new one */
+    for (jj = count; jj > 0 && sorted[jj-1] > data[ii]; jj--) sorted[jj] = sorted[jj-1];
+    sorted[jj] = data[ii];
+    count ++;
+
+    data[ii] = (count % 2) ? sorted[count/2] : (sorted[count/2 - 1] + sorted[count/2]) / 2;
+  }
+
+  stage_ptr->position = position;
+  stage_ptr->count    = count;
+  return n_samples;
+}
+
+
+/*
+ * CIC decimator. An integrator and a comb of delay R make a moving sum of R
+ * samples, so the order M filter is computed as M-1 moving sums followed by a
+ * sum of each block of R samples, which is the decimating last section.
+ * In floating point this avoids the integrators growing without bound, which
+ * would lose precision where fixed point integrators simply wrap around.
+ * The moving sums are recomputed once per turn so rounding errors do not
+ * build up, and the output is divided by factor^order for unity gain.
+ */
+int Filter_CIC( filterstage_t *stage_ptr, double *data, int n_samples ) {
+  double *sums, *window, value, gain;
+  int ii, jj, kk, n_out, factor, position;
+
+  sums     = stage_ptr->cic_sums; /* moving sums, then the block sum */
+  factor   = stage_ptr->length;
+  position = stage_ptr->position;
+  gain     = pow( factor, stage_ptr->order );
+
+  n_out = 0;
+  for (ii = 0; ii < n_samples; ii++) {
+    value = data[ii];
+    for (jj = 0; jj < stage_ptr->order - 1; jj++) {
+      window = stage_ptr->history + jj*factor;
+      sums[jj] += value - window[position];
+      window[position] = value;
+      value = sums[jj];
+    }
+
+    position ++;
+    if (position == factor) {
+      position = 0;
+      for (jj = 0; jj < stage_ptr->order - 1; jj++) {
+        window = stage_ptr->history + jj*factor;
+        sums[jj] = 0;
+        for (kk = 0; kk < factor; kk++) sums[jj] += window[kk];
+      }
+    }
+
+    /* decimate: one output per block of factor samples */
+    sums[FILTERMAXCIC] += value;
+    stage_ptr->count ++;
+    if (stage_ptr->count == factor) {
+      data[n_out++] = sums[FILTERMAXCIC] / gain;
+      sums[FILTERMAXCIC] = 0;
+      stage_ptr->count = 0;
+    }
+  }
+
+  stage_ptr->position = position;
+  return n_out;
+}
@@ -0,0 +1,163 @@
+/* GPIO edge events through the Linux GPIO character device (/dev/gpiochipN)
+ * Documentation: https://www.kernel.org/doc/html/latest/userspace-api/gpio/chardev_v1.html */
+
+#include <linux/gpio.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <CLibrary.h>
+#include <Sensors.h>
+
+
+/*
+ * This function requests edge events on one GPIO line
+ *
+ * Arguments:
+ *   edge_ptr:  [Output] the edge event line
+ *   chip_path: [Input]  path of the GPIO chip, "/dev/gpiochip0" on a Raspberry Pi
+ *   line:      [Input]  line offset on the chip, the BCM GPIO number on a Raspberry Pi
+ *   rising:    [Input]  true for rising edges, false for falling edges
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int GPIO_Edge_Open( gpioedge_t *edge_ptr, const char *chip_path, int line, bool rising ) {
+  int chip_fd;
+  struct gpioevent_request request;
+
+  edge_ptr->fd   = -1;
+  edge_ptr->mock = false;
+
+  chip_fd = open( chip_path, O_RDONLY );
+  if (chip_fd == -1) {
+    print_time();
+    fprintf(error_log_, "Could not open GPIO chip %s, errno code %i\n", chip_path, errno);
+    fflush(error_log_);
+    return -1;
+  }
+
+  memset( &request, 0, sizeof(request) );
+  request.lineoffset  = line;
+  request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  request.eventflags  = rising ? GPIOEVENT_REQUEST_RISING_EDGE : GPIOEVENT_REQUEST_FALLING_EDGE;
+  strncpy( request.consumer_label, "CLibrary", sizeof(request.consumer_label) - 1 );
+
+  if (ioctl( chip_fd, GPIO_GET_LINEEVENT_IOCTL, &request ) == -1) {
+    print_time();
+    fprintf(error_log_, "Could not request edge events on GPIO line %d, errno code %i\n", line, errno);
+    fflush(error_log_);
+    close( chip_fd );
+    return -1;
+  }
+  /* the event fd stays valid after the chip is closed */
+  close( chip_fd );
+
+  edge_ptr->fd = request.fd;
+  return 0;
+}
+
+
+/*
+ * This function creates a mock edge event line, for testing without hardware.
+ * Edges are generated by calling GPIO_Edge_Trigger_Mock.
+ *
+ * Arguments:
+ *   edge_ptr: [Output] the mock edge event line
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int GPIO_Edge_Open_Mock( gpioedge_t *edge_ptr ) {
+  edge_ptr->fd   = eventfd( 0, 0 );
+  edge_ptr->mock = true;
+  return (edge_ptr->fd == -1) ? -1 : 0;
+}
+
+
+/*
+ * This function generates one edge on a mock edge event line
+ *
+ * Arguments:
+ *   edge_ptr: [Input] the mock edge event line
+ *
+ * Return: None
+ */
+void GPIO_Edge_Trigger_Mock( gpioedge_t *edge_ptr ) {
+  uint64_t one = 1;
+
+  if (!edge_ptr->mock) return;
+  if (write( edge_ptr->fd, &one, sizeof(one) ) != sizeof(one)) {
+    print_time();
+    fprintf(error_log_, "Mock GPIO trigger failed, errno code %i\n", errno);
+    fflush(error_log_);
+  }
+  return;
+}
+
+
+/*
+ * This function waits for the next edge
+ *
+ * Arguments:
+ *   edge_ptr:   [Input] the edge event line
+ *   timeout_ns: [Input] maximum time to wait in nanoseconds
+ *
+ * Return:
+ *   1 if an edge occured, 0 on timeout, -1 on failure
+ */
+int GPIO_Edge_Wait( gpioedge_t *edge_ptr, uint64_t timeout_ns ) {
+  struct pollfd pfd;
+  struct gpioevent_data event;
+  uint64_t count;
+  int returnval;
+
+  pfd.fd     = edge_ptr->fd;
+  pfd.events = POLLIN;
+  /* round the timeout up to whole milliseconds */
+  returnval = poll( &pfd, 1, (int) ((timeout_ns + 999999) / 1000000) );
+  if (returnval <= 0) return returnval;
+
+  /* consume the event */
+  if (edge_ptr->mock) {
+    returnval = read( edge_ptr->fd, &count, sizeof(count) );
+  }
+  else {
+    returnval = read( edge_ptr->fd, &event, sizeof(event) );
+  }
+  return (returnval > 0) ? 1 : -1;
+}
+
+
+/*
+ * This function discards all edges that already occured, without waiting
+ *
+ * Arguments:
+ *   edge_ptr: [Input] the edge event line
+ *
+ * Return:
+ *   number of edges discarded
+ */
+int GPIO_Edge_Flush( gpioedge_t *edge_ptr ) {
+  int count;
+
+  count = 0;
+  while (GPIO_Edge_Wait( edge_ptr, 0 ) == 1) {
+    count ++;
+  }
+  return count;
+}
+
+
+/*
+ * This function releases an edge event line
+ *
+ * Arguments:
+ *   edge_ptr: [Input] the edge event line
+ *
+ * Return: None
+ */
+void GPIO_Edge_Close( gpioedge_t *edge_ptr ) {
+  if (edge_ptr->fd != -1) close( edge_ptr->fd );
+  edge_ptr->fd = -1;
+  return;
+}
@@ -0,0 +1,316 @@
+/* I2C access through the Linux I2C character device (/dev/i2c-N)
+ * Documentation: https://www.kernel.org/doc/html/latest/i2c/dev-interface.html
+ *
+ * All transfers use the I2C_RDWR ioctl, where every message carries the
+ * address of its device. So one file descriptor serves all devices of a bus,
+ * a register read is a single transfer (pointer write, repeated start, read),
+ * and a batch of register accesses, even to several devices, is a single
+ * system call.
+ *
+ * Register data is sent and received as it is on the wire, each driver puts
+ * the bytes of multi-byte registers in the order of its device.
+ *
+ * The transfers can be sent to another backend instead of the kernel, such as
+ * the device simulator of Sensors_I2CSim.c, and are counted in either case so
+ * the bus traffic of a driver can be measured.
+ */
+
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <CLibrary.h>
+#include <Sensors.h>
+
+
+/************ Static Variables Available in and only in this file ************/
+/* open buses, shared by all devices on them */
+static int bus_number_[I2CMAXBUS];
+static int bus_fd_[I2CMAXBUS];
+static int bus_users_[I2CMAXBUS];
+static pthread_mutex_t bus_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+static const i2cbackend_t *backend_ptr_ = NULL; /* NULL for /dev/i2c-N */
+static i2cstats_t stats_;
+
+
+/************ Static Functions Limited to Access within this File ************/
+static int I2C_Dev_Transfer( int fd, i2cxfer_t *xfers, int n_xfers );
+
+
+
+/*
+ * This function opens an I2C bus. A bus that is already open is shared, and
+ * stays open until every I2C_Open of it is matched by an I2C_Close.
+ *
+ * Arguments:
+ *   bus: [Input] the bus number N of /dev/i2c-N, or -1 for I2C_DEFAULT_BUS
+ *
+ * Return:
+ *   file descriptor of the bus, or -1 on failure
+ */
+int I2C_Open( int bus ) {
+  char device[32];
+  int ii, slot;
+
+  if (bus == -1) bus = I2C_DEFAULT_BUS;
+
+  pthread_mutex_lock( &bus_mutex_ );
+  slot = -1;
+  for (ii = 0; ii < I2CMAXBUS; ii++) {
+    if (bus_users_[ii] > 0 && bus_number_[ii] == bus) {
+      bus_users_[ii] ++;
+      pthread_mutex_unlock( &bus_mutex_ );
+      return bus_fd_[ii];
+    }
+    if (bus_users_[ii] == 0 && slot == -1) slot = ii;
+  }
+  if (slot == -1) {
+    pthread_mutex_unlock( &bus_mutex_ );
+    print_time();
+    fprintf(error_log_, "Too many I2C buses open, at most %d\n", I2CMAXBUS);
+    fflush(error_log_);
+    return -1;
+  }
+
+  snprintf( device, sizeof(device), "/dev/i2c-%d", bus );
+  if (backend_ptr_ != NULL) {
+    bus_fd_[slot] = (*backend_ptr_->open_func_ptr)( bus );
+  }
+  else {
+    bus_fd_[slot] = open( device, O_RDWR );
+  }
+  if (bus_fd_[slot] == -1) {
+    pthread_mutex_unlock( &bus_mutex_ );
+    printf("Could not open %s. Most likely you are not root or I2C is not enabled\n", device);
+    print_time();
+    fprintf(error_log_, "Could not open %s, errno code %i\n", device, errno);
+    fflush(error_log_);
+    return -1;
+  }
+  bus_number_[slot] = bus;
+  bus_users_[slot]  = 1;
+  pthread_mutex_unlock( &bus_mutex_ );
+  return bus_fd_[slot];
+}
+
+
+/*
+ * This function releases a bus opened by I2C_Open
+ *
+ * Arguments:
+ *   fd: [Input] file descriptor of the bus
+ *
+ * Return: None
+ */
+void I2C_Close( int fd ) {
+  int ii;
+
+  pthread_mutex_lock( &bus_mutex_ );
+  for (ii = 0; ii < I2CMAXBUS; ii++) {
+    if (bus_users_[ii] > 0 && bus_fd_[ii] == fd) {
+      bus_users_[ii] --;
+      if (bus_users_[ii] == 0) {
+        if (backend_ptr_ != NULL) {
+          (*backend_ptr_->close_func_ptr)( fd );
+        }
+        else {
+          close( fd );
+        }
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock( &bus_mutex_ );
+  return;
+}
+
+
+/*
+ * This function writes consecutive registers of a device in one transfer.
+ * The device must auto-increment its register pointer for length > 1.
+ *
+ * Arguments:
+ *   fd:     [Input] file descriptor of the bus
+ *   addr:   [Input] 7-bit address of the device
+ *   reg:    [Input] first register
+ *   data:   [Input, array size length] bytes to write
+ *   length: [Input] number of bytes, 1 to I2CMAXWRITE
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int I2C_Write( int fd, uint8_t addr, uint8_t reg, const uint8_t *data, int length ) {
+  i2cxfer_t xfer;
+
+  xfer.addr   = addr;
+  xfer.reg    = reg;
+  xfer.read   = false;
+  xfer.data   = (uint8_t *) data;
+  xfer.length = length;
+  return I2C_Transfer( fd, &xfer, 1 );
+}
+
+
+/*
+ * This function reads consecutive registers of a device in one transfer: the
+ * register pointer is written, then the data is read after a repeated start.
+ *
+ * Arguments:
+ *   fd:     [Input]  file descriptor of the bus
+ *   addr:   [Input]  7-bit address of the device
+ *   reg:    [Input]  first register
+ *   data:   [Output, array size length] bytes read
+ *   length: [Input]  number of bytes
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int I2C_Read( int fd, uint8_t addr, uint8_t reg, uint8_t *data, int length ) {
+  i2cxfer_t xfer;
+
+  xfer.addr   = addr;
+  xfer.reg    = reg;
+  xfer.read   = true;
+  xfer.data   = data;
+  xfer.length = length;
+  return I2C_Transfer( fd, &xfer, 1 );
+}
+
+
+/*
+ * This function runs a batch of register reads and writes, to one or more
+ * devices of a bus, in a single system call. The accesses are done in order,
+ * separated by repeated starts. Some controllers, like the i2c-bcm2835 of the
+ * Raspberry Pi, refuse a batch unless its only read is the last access.
+ *
+ * Arguments:
+ *   fd:      [Input] file descriptor of the bus
+ *   xfers:   [Input, array size n_xfers] the register accesses, data of the
+ *                    reads is filled in
+ *   n_xfers: [Input] number of accesses, 1 to I2CMAXBATCH
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int I2C_Transfer( int fd, i2cxfer_t *xfers, int n_xfers ) {
+  uint64_t messages, bytes_written, bytes_read;
+  int ii;
+
+  if (n_xfers < 1 || n_xfers > I2CMAXBATCH) return -1;
+
+  /* count the traffic, including the pointer byte of every access */
+  messages = bytes_written = bytes_read = 0;
+  for (ii = 0; ii < n_xfers; ii++) {
+    if (xfers[ii].read) {
+      messages += 2;
+      bytes_written += 1;
+      bytes_read += xfers[ii].length;
+    }
+    else {
+      messages += 1;
+      bytes_written += 1 + xfers[ii].length;
+    }
+  }
+  /* several threads can use separate buses at the same time */
+  __atomic_fetch_add( &stats_.transfers    , 1            , __ATOMIC_RELAXED );
+  __atomic_fetch_add( &stats_.messages     , messages     , __ATOMIC_RELAXED );
+  __atomic_fetch_add( &stats_.bytes_written, bytes_written, __ATOMIC_RELAXED );
+  __atomic_fetch_add( &stats_.bytes_read   , bytes_read   , __ATOMIC_RELAXED );
+
+  if (backend_ptr_ != NULL) return (*backend_ptr_->transfer_func_ptr)( fd, xfers, n_xfers );
+  return I2C_Dev_Transfer( fd, xfers, n_xfers );
+}
+
+
+/*
+ * This function sends the transfers to another backend, for example
+ * I2C_Sim_Backend to run the drivers against simulated devices. Buses must
+ * be opened after the backend is set, and closed before it is changed.
+ *
+ * Arguments:
+ *   backend_ptr: [Input] the backend, NULL for the /dev/i2c-N devices
+ *
+ * Return: None
+ */
+void I2C_Set_Backend( const i2cbackend_t *backend_ptr ) {
+  backend_ptr_ = backend_ptr;
+  return;
+}
+
+
+/*
+ * This function gives the I2C traffic since the start of the program or the
+ * last I2C_Reset_Stats
+ *
+ * Arguments:
+ *   stats_ptr: [Output] the counters
+ *
+ * Return: None
+ */
+void I2C_Get_Stats( i2cstats_t *stats_ptr ) {
+  stats_ptr->transfers     = __atomic_load_n( &stats_.transfers    , __ATOMIC_RELAXED );
+  stats_ptr->messages      = __atomic_load_n( &stats_.messages     , __ATOMIC_RELAXED );
+  stats_ptr->bytes_written = __atomic_load_n( &stats_.bytes_written, __ATOMIC_RELAXED );
+  stats_ptr->bytes_read    = __atomic_load_n( &stats_.bytes_read   , __ATOMIC_RELAXED );
+  return;
+}
+
+
+/*
+ * This function clears the I2C traffic counters
+ *
+ * Return: None
+ */
+void I2C_Reset_Stats( void ) {
+  __atomic_store_n( &stats_.transfers    , 0, __ATOMIC_RELAXED );
+  __atomic_store_n( &stats_.messages     , 0, __ATOMIC_RELAXED );
+  __atomic_store_n( &stats_.bytes_written, 0, __ATOMIC_RELAXED );
+  __atomic_store_n( &stats_.bytes_read   , 0, __ATOMIC_RELAXED );
+  return;
+}
+
+
+
+/*
+ * Run a batch through the I2C_RDWR ioctl of /dev/i2c-N, see I2C_Transfer
+ */
+int I2C_Dev_Transfer( int fd, i2cxfer_t *xfers, int n_xfers ) {
+  struct i2c_msg msgs[2*I2CMAXBATCH];
+  struct i2c_rdwr_ioctl_data batch;
+  uint8_t buffers[I2CMAXBATCH][I2CMAXWRITE + 1];
+  int ii, n_msgs;
+
+  n_msgs = 0;
+  for (ii = 0; ii < n_xfers; ii++) {
+    if (xfers[ii].read) {
+      /* pointer write, then read */
+      buffers[ii][0] = xfers[ii].reg;
+      msgs[n_msgs].addr  = xfers[ii].addr;
+      msgs[n_msgs].flags = 0;
+      msgs[n_msgs].len   = 1;
+      msgs[n_msgs].buf   = buffers[ii];
+      n_msgs ++;
+      msgs[n_msgs].addr  = xfers[ii].addr;
+      msgs[n_msgs].flags = I2C_M_RD;
+      msgs[n_msgs].len   = xfers[ii].length;
+      msgs[n_msgs].buf   = xfers[ii].data;
+      n_msgs ++;
+    }
+    else {
+      /* pointer and data in one write */
+      if (xfers[ii].length > I2CMAXWRITE) return -1;
+      buffers[ii][0] = xfers[ii].reg;
+      memcpy( buffers[ii] + 1, xfers[ii].data, xfers[ii].length );
+      msgs[n_msgs].addr  = xfers[ii].addr;
+      msgs[n_msgs].flags = 0;
+      msgs[n_msgs].len   = xfers[ii].length + 1;
+      msgs[n_msgs].buf   = buffers[ii];
+      n_msgs ++;
+    }
+  }
+
+  batch.msgs  = msgs;
+  batch.nmsgs = n_msgs;
+  if (ioctl( fd, I2C_RDWR, &batch ) == -1) return -1;
+  return 0;
+}
@@ -0,0 +1,470 @@
+/* Register level simulation of I2C devices, to run the drivers without the
+ * hardware (tests, benchmarks, CI)
+ *
+ * Usage:
+ *   I2C_Set_Backend( &I2C_Sim_Backend );
+ *   I2C_Sim_Add_ADS1115( 1, 0x48, input_function );
+ *   I2C_Sim_Add_PCA9685( 1, 0x40 );
+ *   then use ADS1115_* and PCA9685_* as usual, bus -1 being bus 1
+ *
+ * ADS1115 model: config, conversion and threshold registers. Conversions take
+ * the nominal time of the programmed data rate, in single-shot mode the OS bit
+ * reads 0 until the conversion is done, and the result is the input voltage
+ * at the end of the conversion, given by a user function, scaled by the PGA
+ * and clamped. Continuous mode converts back to back from the config write.
+ *
+ * PCA9685 model: all registers, auto-increment (LED registers roll over from
+ * 0x45 to 0x00), the prescaler which can only be written while sleeping, the
+ * ALL_LED registers, and the LED All Call address.
+ *
+ * Like the i2c-bcm2835 controller of the Raspberry Pi, a transfer can only
+ * have one read, as its last access, other batches fail.
+ *
+ * The model state is computed when the registers are accessed, there is no
+ * thread. I2C_Sim_Set_Bus_Speed adds the time the transfers would take on a
+ * real bus, so timings are realistic.
+ */
+
+#include <CLibrary.h>
+#include <Sensors.h>
+#include <math.h>
+
+#define I2CSIM_MAXDEVICES 32    /* Most simulated devices                  */
+#define I2CSIM_FD_BASE    10000 /* Fake file descriptors are this plus bus */
+
+#define I2CSIM_ADS1115 0
+#define I2CSIM_PCA9685 1
+
+/* Simulated device */
+typedef struct i2csimdevice_t {
+  int type;      /* I2CSIM_* */
+  int bus;
+  uint8_t addr;
+  /* ADS1115 */
+  uint16_t regs[4];          /* conversion, config, low and high threshold */
+  uint64_t start_ns;         /* start of the conversion, or of continuous mode */
+  uint64_t done_ns;          /* end of the single-shot conversion              */
+  bool pending;              /* single-shot result not latched yet             */
+  double (*input_func_ptr)(int input, uint64_t time_ns);
+  /* PCA9685 */
+  uint8_t pca_regs[256];
+} i2csimdevice_t;
+
+
+/************ Static Variables Available in and only in this file ************/
+static i2csimdevice_t devices_[I2CSIM_MAXDEVICES];
+static int n_devices_ = 0;
+static double bus_hz_ = 0; /* 0 for transfers that take no time */
+static pthread_mutex_t sim_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+/* ADS1115 data rate of each DR setting, in samples per second */
+static const int ads1115_rates_[8] = {8, 16, 32, 64, 128, 250, 475, 860};
+
+
+/************ Static Functions Limited to Access within this File ************/
+static int I2C_Sim_Open( int bus );
+static void I2C_Sim_Close( int fd );
+static int I2C_Sim_Transfer( int fd, i2cxfer_t *xfers, int n_xfers );
+static i2csimdevice_t *I2C_Sim_Find( int bus, uint8_t addr, int skip );
+static void ADS1115_Sim_Update( i2csimdevice_t *device_ptr, uint64_t now_ns );
+static int16_t ADS1115_Sim_Convert( i2csimdevice_t *device_ptr, uint64_t time_ns );
+static void ADS1115_Sim_Access( i2csimdevice_t *device_ptr, i2cxfer_t *xfer_ptr );
+static void PCA9685_Sim_Access( i2csimdevice_t *device_ptr, i2cxfer_t *xfer_ptr );
+
+
+/* Backend to give to I2C_Set_Backend */
+const i2cbackend_t I2C_Sim_Backend = { I2C_Sim_Open, I2C_Sim_Close, I2C_Sim_Transfer };
+
+
+
+/*
+ * This function adds a simulated ADS1115, in its power-on state
+ *
+ * Arguments:
+ *   bus:            [Input] bus number, -1 for I2C_DEFAULT_BUS
+ *   addr:           [Input] I2C address, 0x48 to 0x4B
+ *   input_func_ptr: [Input] function giving the voltage of input 0-3 (AIN0-AIN3)
+ *                           at a monotonic_ns() time, NULL for all inputs at 0 V
+ *
+ * Return:
+ *   0 on success or -1 if there are too many devices
+ */
+int I2C_Sim_Add_ADS1115( int bus, uint8_t addr, double (*input_func_ptr)(int input, uint64_t time_ns) ) {
+  i2csimdevice_t *device_ptr;
+
+  pthread_mutex_lock( &sim_mutex_ );
+  if (n_devices_ == I2CSIM_MAXDEVICES) {
+    pthread_mutex_unlock( &sim_mutex_ );
+    return -1;
+  }
+  device_ptr = &devices_[n_devices_++];
+  memset( device_ptr, 0, sizeof(i2csimdevice_t) );
+  device_ptr->type = I2CSIM_ADS1115;
+  device_ptr->bus  = (bus == -1) ? I2C_DEFAULT_BUS : bus;
+  device_ptr->addr = addr;
+  device_ptr->input_func_ptr = input_func_ptr;
+  /* reset values from the data sheet */
+  device_ptr->regs[0] = 0x0000;
+  device_ptr->regs[1] = 0x8583;
+  device_ptr->regs[2] = 0x8000;
+  device_ptr->regs[3] = 0x7FFF;
+  pthread_mutex_unlock( &sim_mutex_ );
+  return 0;
+}
+
+
+/*
+ * This function adds a simulated PCA9685, in its power-on state
+ *
+ * Arguments:
+ *   bus:  [Input] bus number, -1 for I2C_DEFAULT_BUS
+ *   addr: [Input] I2C address, 0x40 to 0x7F
+ *
+ * Return:
+ *   0 on success or -1 if there are too many devices
+ */
+int I2C_Sim_Add_PCA9685( int bus, uint8_t addr ) {
+  i2csimdevice_t *device_ptr;
+  int ii;
+
+  pthread_mutex_lock( &sim_mutex_ );
+  if (n_devices_ == I2CSIM_MAXDEVICES) {
+    pthread_mutex_unlock( &sim_mutex_ );
+    return -1;
+  }
+  device_ptr = &devices_[n_devices_++];
+  memset( device_ptr, 0, sizeof(i2csimdevice_t) );
+  device_ptr->type = I2CSIM_PCA9685;
+  device_ptr->bus  = (bus == -1) ? I2C_DEFAULT_BUS : bus;
+  device_ptr->addr = addr;
+  /* reset values from the data sheet: sleeping, answering All Call, all LEDs full off */
+  device_ptr->pca_regs[0x00] = 0x11;
+  device_ptr->pca_regs[0x01] = 0x04;
+  device_ptr->pca_regs[0x02] = 0xE2;
+  device_ptr->pca_regs[0x03] = 0xE4;
+  device_ptr->pca_regs[0x04] = 0xE8;
+  device_ptr->pca_regs[0x05] = 0xE0;
+  for (ii = 0; ii < 16; ii++) {
+    device_ptr->pca_regs[0x09 + 4*ii] = 0x10;
+  }
+  device_ptr->pca_regs[0xFE] = 0x1E;
+  pthread_mutex_unlock( &sim_mutex_ );
+  return 0;
+}
+
+
+/*
+ * This function removes all simulated devices
+ *
+ * Return: None
+ */
+void I2C_Sim_Clear( void ) {
+  pthread_mutex_lock( &sim_mutex_ );
+  n_devices_ = 0;
+  pthread_mutex_unlock( &sim_mutex_ );
+  return;
+}
+
+
+/*
+ * This function makes every transfer take the time it would on a real bus,
+ * 9 clock cycles per byte including the address bytes
+ *
+ * Arguments:
+ *   bus_hz: [Input] bus clock, 100000 or 400000 for the usual speeds,
+ *                   0 for transfers that take no time (default)
+ *
+ * Return: None
+ */
+void I2C_Sim_Set_Bus_Speed( double bus_hz ) {
+  bus_hz_ = bus_hz;
+  return;
+}
+
+
+/*
+ * This function gives the PWM frequency a simulated PCA9685 is set to
+ *
+ * Arguments:
+ *   bus:  [Input] bus number, -1 for I2C_DEFAULT_BUS
+ *   addr: [Input] I2C address
+ *
+ * Return:
+ *   frequency in Hz, or 0 if there is no such device
+ */
+double I2C_Sim_PCA9685_Frequency( int bus, uint8_t addr ) {
+  i2csimdevice_t *device_ptr;
+  double freq;
+
+  pthread_mutex_lock( &sim_mutex_ );
+  device_ptr = I2C_Sim_Find( (bus == -1) ? I2C_DEFAULT_BUS : bus, addr, 0 );
+  freq = 0;
+  if (device_ptr != NULL && device_ptr->type == I2CSIM_PCA9685) {
+    freq = 25000000.0 / (4096.0 * (device_ptr->pca_regs[0xFE] + 1));
+  }
+  pthread_mutex_unlock( &sim_mutex_ );
+  return freq;
+}
+
+
+/*
+ * This function gives the on and off ticks of one output of a simulated PCA9685
+ *
+ * Arguments:
+ *   bus:     [Input]  bus number, -1 for I2C_DEFAULT_BUS
+ *   addr:    [Input]  I2C address
+ *   channel: [Input]  output, 0 to 15
+ *   on_ptr:  [Output] LEDn_ON register, bit 12 being full on
+ *   off_ptr: [Output] LEDn_OFF register, bit 12 being full off
+ *
+ * Return:
+ *   0 on success or -1 if there is no such device
+ */
+int I2C_Sim_PCA9685_Channel( int bus, uint8_t addr, int channel, uint16_t *on_ptr, uint16_t *off_ptr ) {
+  i2csimdevice_t *device_ptr;
+  uint8_t *led;
+
+  if (channel < 0 || channel > 15) return -1;
+  pthread_mutex_lock( &sim_mutex_ );
+  device_ptr = I2C_Sim_Find( (bus == -1) ? I2C_DEFAULT_BUS : bus, addr, 0 );
+  if (device_ptr == NULL || device_ptr->type != I2CSIM_PCA9685) {
+    pthread_mutex_unlock( &sim_mutex_ );
+    return -1;
+  }
+  led = device_ptr->pca_regs + 0x06 + 4*channel;
+  *on_ptr  = led[0] | (led[1] << 8);
+  *off_ptr = led[2] | (led[3] << 8);
+  pthread_mutex_unlock( &sim_mutex_ );
+  return 0;
+}
+
+
+
+/*
+ * Backend open: every bus exists, the file descriptor encodes the bus number
+ */
+int I2C_Sim_Open( int bus ) {
+  return I2CSIM_FD_BASE + bus;
+}
+
+
+/*
+ * Backend close: nothing to release
+ */
+void I2C_Sim_Close( int fd ) {
+  return;
+}
+
+
+/*
+ * Backend transfer: apply the accesses to the devices in order. As a real bus
+ * would NACK, an access to an address without a device fails the transfer,
+ * after the accesses before it were done.
+ */
+int I2C_Sim_Transfer( int fd, i2cxfer_t *xfers, int n_xfers ) {
+  i2csimdevice_t *device_ptr;
+  uint64_t bits;
+  int ii, jj, bus, returnval;
+
+  bus = fd - I2CSIM_FD_BASE;
+  returnval = 0;
+  bits = 0;
+
+  /* only the last access can be a read */
+  for (ii = 0; ii < n_xfers - 1; ii++) {
+    if (xfers[ii].read) return -1;
+  }
+
+  pthread_mutex_lock( &sim_mutex_ );
+  for (ii = 0; ii < n_xfers && returnval == 0; ii++) {
+    /* address, pointer and data bytes, plus the address again to read */
+    bits += 9 * (2 + xfers[ii].length + (xfers[ii].read ? 1 : 0));
+
+    /* a write to the All Call address reaches several devices */
+    jj = 0;
+    device_ptr = I2C_Sim_Find( bus, xfers[ii].addr, jj );
+    if (device_ptr == NULL) returnval = -1;
+    while (device_ptr != NULL) {
+      if (device_ptr->type == I2CSIM_ADS1115) {
+        ADS1115_Sim_Access( device_ptr, &xfers[ii] );
+      }
+      else {
+        PCA9685_Sim_Access( device_ptr, &xfers[ii] );
+      }
+      if (xfers[ii].read) break;
+      device_ptr = I2C_Sim_Find( bus, xfers[ii].addr, ++jj );
+    }
+  }
+  pthread_mutex_unlock( &sim_mutex_ );
+
+  if (bus_hz_ > 0) nsleep( (uint64_t) (bits * 1e9 / bus_hz_) );
+  return returnval;
+}
+
+
+/*
+ * Find a device answering an address on a bus
+ *
+ * Arguments:
+ *   bus:  [Input] bus number
+ *   addr: [Input] I2C address
+ *   skip: [Input] number of matching devices to skip, to find all devices
+ *                 answering an All Call address
+ *
+ * Return:
+ *   the device, or NULL if there is none
+ */
+i2csimdevice_t *I2C_Sim_Find( int bus, uint8_t addr, int skip ) {
+  i2csimdevice_t *device_ptr;
+  bool match;
+  int ii;
+
+  for (ii = 0; ii < n_devices_; ii++) {
+    device_ptr = &devices_[ii];
+    if (device_ptr->bus != bus) continue;
+    match = (device_ptr->addr == addr);
+    /* PCA9685 All Call: MODE1 bit 0, the address is in bits 7:1 of ALLCALLADR */
+    if (device_ptr->type == I2CSIM_PCA9685 && (device_ptr->pca_regs[0x00] & 0x01) && \
+      (device_ptr->pca_regs[0x05] >> 1) == addr) match = true;
+    if (!match) continue;
+    if (skip == 0) return device_ptr;
+    skip --;
+  }
+  return NULL;
+}
+
+
+/*
+ * ADS1115 register access
+ */
+void ADS1115_Sim_Access( i2csimdevice_t *device_ptr, i2cxfer_t *xfer_ptr ) {
+  uint16_t value;
+  uint64_t now_ns;
+  uint8_t reg;
+
+  now_ns = monotonic_ns();
+  ADS1115_Sim_Update( device_ptr, now_ns );
+  reg = xfer_ptr->reg & 0x03;
+
+  if (xfer_ptr->read) {
+    value = device_ptr->regs[reg];
+    /* OS bit: 0 while a single-shot conversion runs */
+    if (reg == 1) value = (value & 0x7FFF) | (device_ptr->pending ? 0x0000 : 0x8000);
+    /* registers are sent MSB first, then repeated */
+    if (xfer_ptr->length > 0) xfer_ptr->data[0] = value >> 8;
+    if (xfer_ptr->length > 1) xfer_ptr->data[1] = value & 0xff;
+    return;
+  }
+
+  /* a pointer-only write just selects the register */
+  if (xfer_ptr->length < 2) return;
+  value = (xfer_ptr->data[0] << 8) | xfer_ptr->data[1];
+  if (reg == 0) return; /* the conversion register is read only */
+
+  device_ptr->regs[reg] = value;
+  if (reg != 1) return;
+
+  if ((value & 0x0100) == 0) {
+    /* continuous mode */
+    device_ptr->start_ns = now_ns;
+    device_ptr->pending  = false;
+  }
+  else if (value & 0x8000) {
+    /* start a single-shot conversion */
+    device_ptr->start_ns = now_ns;
+    device_ptr->done_ns  = now_ns + 1000000000 / ads1115_rates_[(value >> 5) & 7];
+    device_ptr->pending  = true;
+  }
+  return;
+}
+
+
+/*
+ * Bring the ADS1115 conversion register up to date
+ */
+void ADS1115_Sim_Update( i2csimdevice_t *device_ptr, uint64_t now_ns ) {
+  uint64_t period_ns, n_done;
+
+  if ((device_ptr->regs[1] & 0x0100) == 0) {
+    /* continuous mode: the last finished conversion */
+    period_ns = 1000000000 / ads1115_rates_[(device_ptr->regs[1] >> 5) & 7];
+    n_done = (now_ns - device_ptr->start_ns) / period_ns;
+    if (n_done > 0) {
+      device_ptr->regs[0] = ADS1115_Sim_Convert( device_ptr, device_ptr->start_ns + n_done * period_ns );
+    }
+  }
+  else if (device_ptr->pending && now_ns >= device_ptr->done_ns) {
+    device_ptr->regs[0] = ADS1115_Sim_Convert( device_ptr, device_ptr->done_ns );
+    device_ptr->pending = false;
+  }
+  return;
+}
+
+
+/*
+ * ADS1115 conversion of the inputs selected by the mux at a time
+ */
+int16_t ADS1115_Sim_Convert( i2csimdevice_t *device_ptr, uint64_t time_ns ) {
+  /* positive and negative input of each mux setting, -1 for GND */
+  static const int positive[8] = {0, 0, 1, 2, 0, 1, 2, 3};
+  static const int negative[8] = {1, 3, 3, 3, -1, -1, -1, -1};
+  static const double fs_range[8] = {6.144, 4.096, 2.048, 1.024, 0.512, 0.256, 0.256, 0.256};
+  double volts, counts;
+  int mux;
+
+  if (device_ptr->input_func_ptr == NULL) return 0;
+
+  mux = (device_ptr->regs[1] >> 12) & 7;
+  volts = (*device_ptr->input_func_ptr)( positive[mux], time_ns );
+  if (negative[mux] != -1) volts -= (*device_ptr->input_func_ptr)( negative[mux], time_ns );
+
+  counts = round( volts / fs_range[(device_ptr->regs[1] >> 9) & 7] * 32768.0 );
+  if (counts >  32767) counts =  32767;
+  if (counts < -32768) counts = -32768;
+  return (int16_t) counts;
+}
+
+
+/*
+ * PCA9685 register access
+ */
+void PCA9685_Sim_Access( i2csimdevice_t *device_ptr, i2cxfer_t *xfer_ptr ) {
+  uint8_t *regs, reg, value;
+  int ii, jj;
+
+  regs = device_ptr->pca_regs;
+  reg  = xfer_ptr->reg;
+
+  for (ii = 0; ii < xfer_ptr->length; ii++) {
+    if (xfer_ptr->read) {
+      /* the ALL_LED registers read as 0 */
+      xfer_ptr->data[ii] = (reg >= 0xFA && reg <= 0xFD) ? 0 : regs[reg];
+    }
+    else {
+      value = xfer_ptr->data[ii];
+      if (reg >= 0xFA && reg <= 0xFD) {
+        /* ALL_LED: load the register of every LED */
+        for (jj = 0; jj < 16; jj++) {
+          regs[0x06 + 4*jj + (reg - 0xFA)] = value;
+        }
+      }
+      else if (reg == 0xFE) {
+        /* the prescaler can only be set while sleeping, and is at least 3 */
+        if (regs[0x00] & 0x10) regs[0xFE] = (value < 3) ? 3 : value;
+      }
+      else if (reg == 0x00) {
+        /* writing 1 to RESTART clears it */
+        regs[0x00] = value & ~0x80;
+      }
+      else if (reg != 0xFF) {
+        regs[reg] = value;
+      }
+    }
+
+    /* auto-increment, LED registers roll over to MODE1 */
+    if (regs[0x00] & 0x20) {
+      reg = (reg == 0x45) ? 0x00 : reg + 1;
+    }
+  }
+  return;
+}
@@ -1,7 +1,7 @@
 /* Data Sheet: https://www.nxp.com/docs/en/data-sheet/PCA9685.pdf */
 
-#include <wiringPiI2C.h>
 #include <CLibrary.h>
+#include <Sensors.h>
 
 /* REGISTER ADDRESSES */
 #define PCA9685_MODE1      0x00 /* Mode Register 1              */
@@ -45,20 +45,30 @@
 #define PCA9685_PRESCALE_MIN 3   /* minimum prescale value */
 #define PCA9685_PRESCALE_MAX 255 /* maximum prescale value */
 
+#define PCA9685_ALLCALL_ADDRESS 0x70 /* LED All Call I2C address used for chains, the power-on value */
+
 
 /**************** Static Global Variables and Static Function ****************/
-static int i2c_fd_;
+/* board used by the functions without a board argument */
+static pca9685_t default_pwm_ = { .i2c_fd = -1 };
 
-static void PCA9685_setPWMFreq( double freq);
-static void PCA9685_setOutputMode( bool totempole);
-static void PCA9685_setPWM( uint8_t PinNum, uint16_t on, uint16_t off);
+static int PCA9685_Write_Reg( pca9685_t *pwm_ptr, uint8_t reg, uint8_t value );
+static void PCA9685_setPWMFreq( pca9685_t *pwm_ptr, double freq);
+static void PCA9685_setOutputMode( pca9685_t *pwm_ptr, bool totempole);
+static int PCA9685_Read_Shadow( pca9685_t *pwm_ptr );
+static void PCA9685_Ticks( uint16_t PWMval, uint8_t *data );
+static int PCA9685_Add_Runs( pca9685_t *pwm_ptr, bool span, i2cxfer_t *xfers );
+static void PCA9685_Actuator_Period( pca9685actuator_t *act_ptr );
+static void PCA9685_Actuator_Drain( pca9685actuator_t *act_ptr );
+static void *PCA9685_Actuator_Thread( void *act_void_ptr );
 
 
 /*
- * This function initializes PCA9685
+ * This function initializes PCA9685, as the board used by the functions
+ * without a board argument, on the default I2C bus of the Raspberry Pi.
  *
  * Arguments:
- *   i2c_addr:  [Input] the I2C address for ADS 1115, default should be 0x48
+ *   i2c_addr:  [Input] the I2C address for PCA9685, default should be 0x40
  *   freq:      [Input] PWM fequency, should be between 23 and 1600 Hz
  *   totempole: [Input] Totempole if true, open drain if false.
  *                      LEDs with integrated zener diodes should only be driven in open drain mode.
@@ -67,35 +77,77 @@ static void PCA9685_setPWM( uint8_t PinNum, uint16_t on, uint16_t off);
  *   0 on success or -1 on failure
  */
 int PCA9685_Init( int i2c_addr, double freq, bool totempole ) {
-  i2c_fd_ = wiringPiI2CSetup(i2c_addr);
-  if (i2c_fd_ == -1) {
-    printf("I2C Initialization failed. Most likely you are not root\n");
-    printf("Please remember to run as root.\n");
-    print_time();
-    fprintf(error_log_, "I2C Initialization failed. Most likely you are not root\n");
-    fprintf(error_log_, "Please remember to run as root.\n");
-    fflush(error_log_);
-    return -1 ;
+  return PCA9685_Dev_Open( &default_pwm_, -1, i2c_addr, freq, totempole );
+}
+
+
+/*
+ * This function opens one PCA9685 board
+ *
+ * Arguments:
+ *   pwm_ptr:   [Output] the board
+ *   bus:       [Input] the I2C bus number N of /dev/i2c-N, or -1 for the
+ *                      default bus of the Raspberry Pi
+ *   i2c_addr:  [Input] the I2C address for PCA9685, 0x40 to 0x7F
+ *   freq:      [Input] PWM fequency, should be between 23 and 1600 Hz
+ *   totempole: [Input] Totempole if true, open drain if false.
+ *                      LEDs with integrated zener diodes should only be driven in open drain mode.
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Dev_Open( pca9685_t *pwm_ptr, int bus, int i2c_addr, double freq, bool totempole ) {
+  memset( pwm_ptr, 0, sizeof(pca9685_t) );
+  pwm_ptr->bus      = bus;
+  pwm_ptr->i2c_addr = i2c_addr;
+  pwm_ptr->mode1    = PCA9685_MODE1_AI;
+
+  /* I2C_Open reports its failures */
+  pwm_ptr->i2c_fd = I2C_Open( bus );
+  if (pwm_ptr->i2c_fd == -1) return -1 ;
+
+  PCA9685_setPWMFreq( pwm_ptr, freq );
+  PCA9685_setOutputMode( pwm_ptr, totempole );
+
+  if (PCA9685_Read_Shadow( pwm_ptr ) == -1) {
+    PCA9685_Dev_Close( pwm_ptr );
+    return -1;
   }
-  PCA9685_setPWMFreq( freq );
-  PCA9685_setOutputMode( totempole );
   return 0;
 }
 
 
 /*
- * Set the PWM frequency of the chip
+ * This function closes a board opened by PCA9685_Dev_Open, the outputs keep
+ * their state
+ *
+ * Arguments
+ *   pwm_ptr: [Input] the board
+ *
+ * Return: None
+ */
+void PCA9685_Dev_Close( pca9685_t *pwm_ptr ) {
+  if (pwm_ptr->i2c_fd != -1) I2C_Close( pwm_ptr->i2c_fd );
+  pwm_ptr->i2c_fd = -1;
+  return;
+}
+
+
+/*
+ * Set the PWM frequency of the chip, or of all chips when pwm_ptr is the All
+ * Call address of a chain
  * Arguments
- *   freq: [Input] PWM fequency, should be between 23 and 1600 Hz
+ *   pwm_ptr: [Input] the board
+ *   freq:    [Input] PWM fequency, should be between 23 and 1600 Hz
  * Return None
  */
-void PCA9685_setPWMFreq( double freq) {
+void PCA9685_setPWMFreq( pca9685_t *pwm_ptr, double freq) {
   int prescaleval;
   uint8_t prescale, mode;
 
 
   /* Disable all output first for an orderly shutdown, by writting a logic 1 to bit 4 in register ALL_LED_OFF_H */
-  wiringPiI2CWriteReg8(i2c_fd_, PCA9685_ALLLED_OFF_H, 0x10);
+  PCA9685_Write_Reg( pwm_ptr, PCA9685_ALLLED_OFF_H, 0x10);
 
   /* Limit the frequency between 23 and 1600 Hz for the internal 25MHz oscillator */
   if (freq < 23) freq = 23;
@@ -108,25 +160,26 @@ void PCA9685_setPWMFreq( double freq) {
   if (prescaleval < PCA9685_PRESCALE_MIN) prescaleval = PCA9685_PRESCALE_MIN;
   if (prescaleval > PCA9685_PRESCALE_MAX) prescaleval = PCA9685_PRESCALE_MAX;
   prescale = (uint8_t) prescaleval;
+  pwm_ptr->freq = PCA9685_FREQUENCY_OSCILLATOR / (4096.0 * (prescale + 1));
 
-  /* Set the restart, external clock, SUB1, SUB2, SUB3, ALLCALL to 0
-   * set the sleep and auto increment to 1 */
-  mode = PCA9685_MODE1_SLEEP | PCA9685_MODE1_AI;
+  /* Set the restart, external clock, SUB1, SUB2, SUB3 to 0, ALLCALL as the
+   * board is used, set the sleep and auto increment to 1 */
+  mode = PCA9685_MODE1_SLEEP | pwm_ptr->mode1;
   /* Put the board to sleep */
-  wiringPiI2CWriteReg8(i2c_fd_, PCA9685_MODE1, mode);
+  PCA9685_Write_Reg( pwm_ptr, PCA9685_MODE1, mode);
   /* Set the prescalar */
-  wiringPiI2CWriteReg8(i2c_fd_, PCA9685_PRESCALE, prescale);
+  PCA9685_Write_Reg( pwm_ptr, PCA9685_PRESCALE, prescale);
   /* Set the sleep bit to 0 */
   mode = (mode & ~PCA9685_MODE1_SLEEP);
   /* Wake up the board */
-  wiringPiI2CWriteReg8(i2c_fd_, PCA9685_MODE1, mode);
+  PCA9685_Write_Reg( pwm_ptr, PCA9685_MODE1, mode);
   /* Wait at least 500 us before restart, as required by datasheet */
   nsleep(5000000);
 
   /* Set the restart bit to 1  */
   mode = (mode | PCA9685_MODE1_RESTART);
   /* Restart */
-  wiringPiI2CWriteReg8(i2c_fd_, PCA9685_MODE1, mode);
+  PCA9685_Write_Reg( pwm_ptr, PCA9685_MODE1, mode);
 
   return;
 }
@@ -134,75 +187,742 @@ void PCA9685_setPWMFreq( double freq) {
 
 /*
  * Sets the output mode of the PCA9685 to either open drain or push pull / totempole.
+ * Outputs change on the I2C STOP (OCH cleared), so all the writes of one
+ * transfer take effect together.
  * Warning: LEDs with integrated zener diodes should only be driven in open drain mode.
  * Parameter:
+ *   pwm_ptr:   [Input] the board
  *   totempole: [Input] Totempole if true, open drain if false.
  * Return: None
  */
-void PCA9685_setOutputMode( bool totempole) {
+void PCA9685_setOutputMode( pca9685_t *pwm_ptr, bool totempole) {
   uint8_t oldmode, newmode;
 
-  oldmode = wiringPiI2CReadReg8(i2c_fd_, PCA9685_MODE2);
+  if (I2C_Read( pwm_ptr->i2c_fd, pwm_ptr->i2c_addr, PCA9685_MODE2, &oldmode, 1 ) == -1) return;
   if (totempole) {
     newmode = oldmode | PCA9685_MODE2_OUTDRV;
   } else {
     newmode = oldmode & ~PCA9685_MODE2_OUTDRV;
   }
-  wiringPiI2CWriteReg8(i2c_fd_, PCA9685_MODE2, newmode);
+  newmode &= ~PCA9685_MODE2_OCH;
+  PCA9685_Write_Reg( pwm_ptr, PCA9685_MODE2, newmode);
   return;
 }
 
 
 /*
- * Sets the PWM output of one of the PCA9685 pins
+ * Set pin PWM output. Sets pin without having to deal with on/off tick
+ * placement and properly handles a zero value as completely off and 4095 as
+ * completely on.
+
  * Parameter:
- *   PinNum: [Input] PWM pin number, from 0 to 15
- *   on:     [Input] At what point in the 4096-part cycle to turn the PWM output ON
- *   off:    [Input] At what point in the 4096-part cycle to turn the PWM output OFF
+ *   PinNum:    [Input] PWM pin number, from 0 to 15
+ *   PWMval:    [Input] The number of ticks out of 4096 to be active, should be
+ *                      a value from 0 to 4095 inclusive.
  * Return: None
  */
-void PCA9685_setPWM( uint8_t PinNum, uint16_t on, uint16_t off) {
-  wiringPiI2CWriteReg16(i2c_fd_, PCA9685_LED0_ON_L + 4 * PinNum, on);
-  wiringPiI2CWriteReg16(i2c_fd_, PCA9685_LED0_ON_L + 4 * PinNum + 2, off);
+void PCA9685_setPinPWM( uint8_t PinNum, uint16_t PWMval) {
+  PCA9685_Dev_setPinPWM( &default_pwm_, PinNum, PWMval );
   return;
 }
 
 
 /*
- * Set pin PWM output. Sets pin without having to deal with on/off tick
- * placement and properly handles a zero value as completely off and 4095 as
- * completely on.
+ * Set the PWM output of consecutive pins in a single I2C write, see
+ * PCA9685_Dev_setPinsPWM
+ */
+int PCA9685_setPinsPWM( uint8_t FirstPin, const uint16_t *PWMvals, int n_pins ) {
+  return PCA9685_Dev_setPinsPWM( &default_pwm_, FirstPin, PWMvals, n_pins );
+}
+
 
+/*
+ * Set the PWM output of a pin in the shadow registers only, see
+ * PCA9685_Dev_updatePinPWM
+ */
+void PCA9685_updatePinPWM( uint8_t PinNum, uint16_t PWMval ) {
+  PCA9685_Dev_updatePinPWM( &default_pwm_, PinNum, PWMval );
+  return;
+}
+
+
+/*
+ * Set the PWM output of consecutive pins in the shadow registers only, see
+ * PCA9685_Dev_updatePinsPWM
+ */
+int PCA9685_updatePinsPWM( uint8_t FirstPin, const uint16_t *PWMvals, int n_pins ) {
+  return PCA9685_Dev_updatePinsPWM( &default_pwm_, FirstPin, PWMvals, n_pins );
+}
+
+
+/*
+ * Write the pins changed by PCA9685_updatePinPWM, see PCA9685_Dev_flush
+ */
+int PCA9685_flush( void ) {
+  return PCA9685_Dev_flush( &default_pwm_ );
+}
+
+
+void PCA9685_cleanup( void ) {
+  uint16_t zeros[PCA9685_CHANNELS] = { 0 };
+
+  /* set all pins to 0, in one write, this drops pending updates */
+  PCA9685_setPinsPWM( 0, zeros, PCA9685_CHANNELS );
+
+  return;
+}
+
+
+/*
+ * Set pin PWM output of a board at once, see PCA9685_setPinPWM
+ *
  * Parameter:
- *   PinNum:    [Input] PWM pin number, from 0 to 15
- *   PWMval:    [Input] The number of ticks out of 4096 to be active, should be
- *                      a value from 0 to 4095 inclusive.
+ *   pwm_ptr: [Input] the board
+ *   PinNum:  [Input] PWM pin number, from 0 to 15
+ *   PWMval:  [Input] The number of ticks out of 4096 to be active
  * Return: None
  */
-void PCA9685_setPinPWM( uint8_t PinNum, uint16_t PWMval) {
+void PCA9685_Dev_setPinPWM( pca9685_t *pwm_ptr, uint8_t PinNum, uint16_t PWMval ) {
+  uint8_t data[4];
+
+  if (PinNum >= PCA9685_CHANNELS) return;
+  PCA9685_Ticks( PWMval, data );
+  if (I2C_Write( pwm_ptr->i2c_fd, pwm_ptr->i2c_addr, PCA9685_LED0_ON_L + 4 * PinNum, data, 4 ) == -1) return;
+  memcpy( pwm_ptr->shadow + 4 * PinNum, data, 4 );
+  pwm_ptr->dirty &= ~(1u << PinNum);
+  return;
+}
+
+
+/*
+ * Set the PWM output of consecutive pins in a single I2C write. The LEDn
+ * registers of the pins are contiguous and the register pointer
+ * auto-increments, so a frame of all 16 pins is one 64-byte block write
+ * instead of 16 transactions. Values are handled as in PCA9685_setPinPWM.
+ *
+ * Parameter:
+ *   pwm_ptr:  [Input] the board
+ *   FirstPin: [Input] first PWM pin number, from 0 to 15
+ *   PWMvals:  [Input, array size n_pins] the number of ticks out of 4096 to be
+ *                     active for pins FirstPin to FirstPin + n_pins - 1
+ *   n_pins:   [Input] number of pins, FirstPin + n_pins at most 16
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Dev_setPinsPWM( pca9685_t *pwm_ptr, uint8_t FirstPin, const uint16_t *PWMvals, int n_pins ) {
+  uint8_t data[4*PCA9685_CHANNELS];
+  int ii;
+
+  if (n_pins < 1 || FirstPin + n_pins > PCA9685_CHANNELS) return -1;
+  for ( ii = 0; ii < n_pins; ii ++ ) {
+    PCA9685_Ticks( PWMvals[ii], data + 4 * ii );
+  }
+  if (I2C_Write( pwm_ptr->i2c_fd, pwm_ptr->i2c_addr, PCA9685_LED0_ON_L + 4 * FirstPin, data, 4 * n_pins ) == -1) return -1;
+  memcpy( pwm_ptr->shadow + 4 * FirstPin, data, 4 * n_pins );
+  pwm_ptr->dirty &= ~(((1u << n_pins) - 1) << FirstPin);
+  return 0;
+}
+
+
+/*
+ * Set the PWM output of a pin in the shadow registers only. Nothing is sent
+ * until PCA9685_Dev_flush, and a value equal to the one in the shadow changes
+ * nothing, so a control loop can set every pin on every tick and only the
+ * changes go to the bus. Values are handled as in PCA9685_setPinPWM.
+ *
+ * Parameter:
+ *   pwm_ptr: [Input] the board
+ *   PinNum:  [Input] PWM pin number, from 0 to 15
+ *   PWMval:  [Input] the number of ticks out of 4096 to be active
+ * Return: None
+ */
+void PCA9685_Dev_updatePinPWM( pca9685_t *pwm_ptr, uint8_t PinNum, uint16_t PWMval ) {
+  uint8_t data[4];
+
+  if (PinNum >= PCA9685_CHANNELS) return;
+  PCA9685_Ticks( PWMval, data );
+  if (memcmp( pwm_ptr->shadow + 4 * PinNum, data, 4 ) == 0) return;
+  memcpy( pwm_ptr->shadow + 4 * PinNum, data, 4 );
+  pwm_ptr->dirty |= 1u << PinNum;
+  return;
+}
+
+
+/*
+ * Set the PWM output of consecutive pins in the shadow registers only, see
+ * PCA9685_Dev_updatePinPWM
+ *
+ * Parameter:
+ *   pwm_ptr:  [Input] the board
+ *   FirstPin: [Input] first PWM pin number, from 0 to 15
+ *   PWMvals:  [Input, array size n_pins] the number of ticks out of 4096 to be
+ *                     active for pins FirstPin to FirstPin + n_pins - 1
+ *   n_pins:   [Input] number of pins, FirstPin + n_pins at most 16
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Dev_updatePinsPWM( pca9685_t *pwm_ptr, uint8_t FirstPin, const uint16_t *PWMvals, int n_pins ) {
+  int ii;
+
+  if (n_pins < 1 || FirstPin + n_pins > PCA9685_CHANNELS) return -1;
+  for ( ii = 0; ii < n_pins; ii ++ ) {
+    PCA9685_Dev_updatePinPWM( pwm_ptr, FirstPin + ii, PWMvals[ii] );
+  }
+  return 0;
+}
+
+
+/*
+ * Write the pins changed by PCA9685_Dev_updatePinPWM to the chip. Adjacent
+ * changed pins are merged into one auto-increment write, and all the writes
+ * go in a single I2C transfer, so they take effect together at its STOP.
+ * Nothing is sent when no pin has changed.
+ *
+ * Parameter:
+ *   pwm_ptr: [Input] the board
+ *
+ * Return:
+ *   number of pins written, or -1 on failure, the pins then stay pending
+ */
+int PCA9685_Dev_flush( pca9685_t *pwm_ptr ) {
+  i2cxfer_t xfers[PCA9685_CHANNELS/2];
+  int n_pins;
+
+  if (pwm_ptr->dirty == 0) return 0;
+
+  n_pins = __builtin_popcount( pwm_ptr->dirty );
+  if (I2C_Transfer( pwm_ptr->i2c_fd, xfers, PCA9685_Add_Runs( pwm_ptr, false, xfers ) ) == -1) return -1;
+  pwm_ptr->dirty = 0;
+  return n_pins;
+}
+
+
+/*
+ * This function opens a chain of PCA9685 boards on one bus, to be driven as
+ * one device. The channels are numbered across the boards: channel
+ * 16 * board + pin, boards in the order of i2c_addrs.
+ * Every board is made to answer the LED All Call address 0x70, so that
+ * settings common to all boards are a single write to all of them, and the
+ * outputs of all boards change together. Other PCA9685 on the bus must not
+ * answer All Call (MODE1 ALLCALL is set at power-on, PCA9685_Dev_Open clears it).
+ *
+ * Arguments:
+ *   chain_ptr: [Output] the chain
+ *   bus:       [Input] the I2C bus number N of /dev/i2c-N, or -1 for the
+ *                      default bus of the Raspberry Pi
+ *   i2c_addrs: [Input, array size n_boards] the I2C addresses of the boards,
+ *                      0x40 to 0x7F except 0x70
+ *   n_boards:  [Input] number of boards, 1 to PCA9685MAXBOARDS
+ *   freq:      [Input] PWM fequency, should be between 23 and 1600 Hz
+ *   totempole: [Input] Totempole if true, open drain if false.
+ *                      LEDs with integrated zener diodes should only be driven in open drain mode.
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Chain_Open( pca9685chain_t *chain_ptr, int bus, const int *i2c_addrs, int n_boards, \
+  double freq, bool totempole ) {
+  pca9685_t *pwm_ptr;
+  int ii;
+
+  memset( chain_ptr, 0, sizeof(pca9685chain_t) );
+  chain_ptr->all.i2c_fd = -1;
+  if (n_boards < 1 || n_boards > PCA9685MAXBOARDS) {
+    print_time();
+    fprintf(error_log_, "PCA9685 chain of %d boards, it can have 1 to %d\n", n_boards, PCA9685MAXBOARDS);
+    fflush(error_log_);
+    return -1;
+  }
+
+  /* the All Call address, as a board of its own for the writes common to all */
+  chain_ptr->all.bus      = bus;
+  chain_ptr->all.i2c_addr = PCA9685_ALLCALL_ADDRESS;
+  chain_ptr->all.mode1    = PCA9685_MODE1_AI | PCA9685_MODE1_ALLCAL;
+  chain_ptr->all.i2c_fd   = I2C_Open( bus );
+  if (chain_ptr->all.i2c_fd == -1) return -1;
+
+  /* each board answers All Call, and sleeps until the frequency is set */
+  for (ii = 0; ii < n_boards; ii++) {
+    pwm_ptr = &chain_ptr->boards[ii];
+    pwm_ptr->bus      = bus;
+    pwm_ptr->i2c_addr = i2c_addrs[ii];
+    pwm_ptr->mode1    = chain_ptr->all.mode1;
+    pwm_ptr->i2c_fd   = I2C_Open( bus );
+    if (pwm_ptr->i2c_fd == -1) {
+      PCA9685_Chain_Close( chain_ptr );
+      return -1;
+    }
+    chain_ptr->n_boards ++;
+    if (PCA9685_Write_Reg( pwm_ptr, PCA9685_ALLCALLADR, PCA9685_ALLCALL_ADDRESS << 1 ) == -1 || \
+      PCA9685_Write_Reg( pwm_ptr, PCA9685_MODE1, PCA9685_MODE1_SLEEP | pwm_ptr->mode1 ) == -1) {
+      print_time();
+      fprintf(error_log_, "No PCA9685 answering at address 0x%02x\n", i2c_addrs[ii]);
+      fflush(error_log_);
+      PCA9685_Chain_Close( chain_ptr );
+      return -1;
+    }
+  }
+
+  /* then the settings go to all boards at once, MODE2 is written whole as
+   * All Call cannot read it */
+  PCA9685_setPWMFreq( &chain_ptr->all, freq );
+  PCA9685_Write_Reg( &chain_ptr->all, PCA9685_MODE2, totempole ? PCA9685_MODE2_OUTDRV : 0 );
+
+  for (ii = 0; ii < n_boards; ii++) {
+    chain_ptr->boards[ii].freq = chain_ptr->all.freq;
+    if (PCA9685_Read_Shadow( &chain_ptr->boards[ii] ) == -1) {
+      PCA9685_Chain_Close( chain_ptr );
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+ * This function closes a chain opened by PCA9685_Chain_Open, the outputs
+ * keep their state
+ *
+ * Arguments
+ *   chain_ptr: [Input] the chain
+ *
+ * Return: None
+ */
+void PCA9685_Chain_Close( pca9685chain_t *chain_ptr ) {
+  int ii;
+
+  for (ii = 0; ii < chain_ptr->n_boards; ii++) {
+    PCA9685_Dev_Close( &chain_ptr->boards[ii] );
+  }
+  chain_ptr->n_boards = 0;
+  PCA9685_Dev_Close( &chain_ptr->all );
+  return;
+}
+
+
+/*
+ * This function changes the PWM frequency of all boards of a chain with the
+ * same writes. The outputs are turned off during the change, and get their
+ * values back at the next PCA9685_Chain_flush.
+ *
+ * Arguments
+ *   chain_ptr: [Input] the chain
+ *   freq:      [Input] PWM fequency, should be between 23 and 1600 Hz
+ *
+ * Return: None
+ */
+void PCA9685_Chain_setPWMFreq( pca9685chain_t *chain_ptr, double freq ) {
+  int ii;
+
+  PCA9685_setPWMFreq( &chain_ptr->all, freq );
+  for (ii = 0; ii < chain_ptr->n_boards; ii++) {
+    chain_ptr->boards[ii].freq  = chain_ptr->all.freq;
+    chain_ptr->boards[ii].dirty = 0xFFFF;
+  }
+  return;
+}
+
+
+/*
+ * This function sets every output of every board of a chain to the same
+ * value in one write through the ALL_LED registers, for example 0 to turn
+ * everything off. Pending updates are dropped.
+ *
+ * Arguments
+ *   chain_ptr: [Input] the chain
+ *   PWMval:    [Input] the number of ticks out of 4096 to be active
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Chain_setAllPWM( pca9685chain_t *chain_ptr, uint16_t PWMval ) {
+  uint8_t data[4];
+  int ii, jj;
+
+  PCA9685_Ticks( PWMval, data );
+  if (I2C_Write( chain_ptr->all.i2c_fd, chain_ptr->all.i2c_addr, PCA9685_ALLLED_ON_L, data, 4 ) == -1) return -1;
+  for (ii = 0; ii < chain_ptr->n_boards; ii++) {
+    for (jj = 0; jj < PCA9685_CHANNELS; jj++) {
+      memcpy( chain_ptr->boards[ii].shadow + 4 * jj, data, 4 );
+    }
+    chain_ptr->boards[ii].dirty = 0;
+  }
+  return 0;
+}
+
+
+/*
+ * This function sets the PWM output of a channel of a chain in the shadow
+ * registers only, see PCA9685_Dev_updatePinPWM
+ *
+ * Arguments
+ *   chain_ptr: [Input] the chain
+ *   channel:   [Input] channel, 16 * board + pin
+ *   PWMval:    [Input] the number of ticks out of 4096 to be active
+ *
+ * Return: None
+ */
+void PCA9685_Chain_updatePWM( pca9685chain_t *chain_ptr, int channel, uint16_t PWMval ) {
+  if (channel < 0 || channel >= PCA9685_CHANNELS * chain_ptr->n_boards) return;
+  PCA9685_Dev_updatePinPWM( &chain_ptr->boards[channel / PCA9685_CHANNELS], channel % PCA9685_CHANNELS, PWMval );
+  return;
+}
+
+
+/*
+ * This function sets the PWM output of consecutive channels of a chain in
+ * the shadow registers only, the channels can span several boards
+ *
+ * Arguments
+ *   chain_ptr:     [Input] the chain
+ *   first_channel: [Input] first channel, 16 * board + pin
+ *   PWMvals:       [Input, array size n_channels] the number of ticks out of
+ *                          4096 to be active of each channel
+ *   n_channels:    [Input] number of channels
+ *
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Chain_updatePWMs( pca9685chain_t *chain_ptr, int first_channel, const uint16_t *PWMvals, int n_channels ) {
+  int ii;
+
+  if (first_channel < 0 || n_channels < 1 || \
+    first_channel + n_channels > PCA9685_CHANNELS * chain_ptr->n_boards) return -1;
+  for (ii = 0; ii < n_channels; ii++) {
+    PCA9685_Chain_updatePWM( chain_ptr, first_channel + ii, PWMvals[ii] );
+  }
+  return 0;
+}
+
+
+/*
+ * This function writes the channels changed in the shadow registers of all
+ * boards of a chain in a single I2C transfer. The transfer has one STOP, at
+ * its end, and the outputs change on the STOP, so all boards change at the
+ * same time instead of one after the other down the chain.
+ *
+ * Arguments
+ *   chain_ptr: [Input] the chain
+ *
+ * Return:
+ *   number of channels written, or -1 on failure, the channels then stay pending
+ */
+int PCA9685_Chain_flush( pca9685chain_t *chain_ptr ) {
+  i2cxfer_t xfers[I2CMAXBATCH];
+  pca9685_t *pwm_ptr;
+  int ii, n_runs, n_xfers, n_channels;
+  bool span;
+
+  /* runs of dirty pins: a dirty pin whose lower neighbour is clean starts one */
+  n_runs = n_channels = 0;
+  for (ii = 0; ii < chain_ptr->n_boards; ii++) {
+    pwm_ptr = &chain_ptr->boards[ii];
+    n_runs     += __builtin_popcount( pwm_ptr->dirty & ~(pwm_ptr->dirty << 1) );
+    n_channels += __builtin_popcount( pwm_ptr->dirty );
+  }
+  if (n_runs == 0) return 0;
+
+  /* too many runs for one transfer: one write per board from its first to
+   * its last dirty pin, the clean pins in between are rewritten unchanged */
+  span = (n_runs > I2CMAXBATCH);
+  n_xfers = 0;
+  for (ii = 0; ii < chain_ptr->n_boards; ii++) {
+    n_xfers += PCA9685_Add_Runs( &chain_ptr->boards[ii], span, xfers + n_xfers );
+  }
+
+  if (I2C_Transfer( chain_ptr->all.i2c_fd, xfers, n_xfers ) == -1) return -1;
+  for (ii = 0; ii < chain_ptr->n_boards; ii++) {
+    chain_ptr->boards[ii].dirty = 0;
+  }
+  return n_channels;
+}
+
+
+/*
+ * This function starts a thread that writes to a chain in the background.
+ * The thread owns the bus: the chain must not be used otherwise until
+ * PCA9685_Actuator_Stop. Channels are set with PCA9685_Actuator_Set, which
+ * does not block, and written every periods PWM periods, so each output gets
+ * at most one new value per PWM cycle(s), whatever the rate of the setters.
+ *
+ * Arguments
+ *   act_ptr:   [Output] the actuator, must stay valid until PCA9685_Actuator_Stop
+ *   chain_ptr: [Input]  an open chain
+ *   periods:   [Input]  PWM periods between writes, at least 1
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Actuator_Start( pca9685actuator_t *act_ptr, pca9685chain_t *chain_ptr, int periods ) {
+  if (chain_ptr->n_boards < 1 || periods < 1) return -1;
+
+  memset( act_ptr, 0, sizeof(pca9685actuator_t) );
+  act_ptr->chain_ptr = chain_ptr;
+  act_ptr->periods   = periods;
+  act_ptr->running   = true;
+  PCA9685_Actuator_Period( act_ptr );
+  if (pthread_create( &act_ptr->thread, NULL, PCA9685_Actuator_Thread, act_ptr ) != 0) {
+    print_time();
+    fprintf(error_log_, "Could not start PCA9685 actuator thread.\n");
+    fflush(error_log_);
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * This function posts the value of a channel to the actuator thread. It only
+ * stores the value, a value posted before it and not written yet is
+ * replaced. Any thread can post, a channel should be posted by one thread.
+ *
+ * Arguments
+ *   act_ptr: [Input] the actuator
+ *   channel: [Input] channel, 16 * board + pin
+ *   PWMval:  [Input] the number of ticks out of 4096 to be active
+ *
+ * Return: None
+ */
+void PCA9685_Actuator_Set( pca9685actuator_t *act_ptr, int channel, uint16_t PWMval ) {
+  if (channel < 0 || channel >= PCA9685_CHANNELS * act_ptr->chain_ptr->n_boards) return;
+
+  /* the value is published by the release of the posted bit */
+  __atomic_store_n( &act_ptr->values[channel], PWMval, __ATOMIC_RELAXED );
+  __atomic_fetch_or( &act_ptr->posted[channel / PCA9685_CHANNELS], 1u << (channel % PCA9685_CHANNELS), \
+    __ATOMIC_RELEASE );
+  return;
+}
+
+
+/*
+ * This function posts a PWM frequency change to the actuator thread, which
+ * does it with PCA9685_Chain_setPWMFreq. The flush period follows the new
+ * frequency.
+ *
+ * Arguments
+ *   act_ptr: [Input] the actuator
+ *   freq:    [Input] PWM fequency, should be between 23 and 1600 Hz
+ *
+ * Return: None
+ */
+void PCA9685_Actuator_Set_Freq( pca9685actuator_t *act_ptr, double freq ) {
+  if (freq < 0.001) return;
+  __atomic_store_n( &act_ptr->freq_mhz, (uint32_t) (freq * 1000.0), __ATOMIC_RELEASE );
+  return;
+}
+
+
+/*
+ * This function stops the actuator thread, after it has written the values
+ * posted so far, and waits for it to finish
+ *
+ * Arguments
+ *   act_ptr: [Input] the actuator
+ *
+ * Return: None
+ */
+void PCA9685_Actuator_Stop( pca9685actuator_t *act_ptr ) {
+  __atomic_store_n( &act_ptr->running, false, __ATOMIC_RELEASE );
+  pthread_join( act_ptr->thread, NULL );
+  return;
+}
+
+
+/*
+ * Thread function of an actuator
+ *
+ * Arguments
+ *   act_void_ptr: [Input] pointer to the pca9685actuator_t
+ *
+ * Return
+ *   NULL
+ */
+void *PCA9685_Actuator_Thread( void *act_void_ptr ) {
+  pca9685actuator_t *act_ptr;
+  uint32_t freq_mhz;
+  uint64_t now_ns, next_ns;
+
+  act_ptr = (pca9685actuator_t *) act_void_ptr;
+
+  next_ns = monotonic_ns() + act_ptr->period_ns;
+  while ( __atomic_load_n( &act_ptr->running, __ATOMIC_ACQUIRE ) ) {
+    now_ns = monotonic_ns();
+    if (now_ns < next_ns) {
+      nsleep( next_ns - now_ns );
+    }
+    else if (now_ns - next_ns >= act_ptr->period_ns) {
+      act_ptr->overruns += (now_ns - next_ns) / act_ptr->period_ns;
+    }
+    /* keep the flushes on the grid of periods, without catching up on
+     * the ones that were missed */
+    next_ns = (now_ns < next_ns) ? next_ns + act_ptr->period_ns : \
+      next_ns + ((now_ns - next_ns) / act_ptr->period_ns + 1) * act_ptr->period_ns;
+
+    /* the 5 ms of a frequency change are spent here, not in the caller */
+    freq_mhz = __atomic_exchange_n( &act_ptr->freq_mhz, 0, __ATOMIC_ACQUIRE );
+    if (freq_mhz != 0) {
+      PCA9685_Chain_setPWMFreq( act_ptr->chain_ptr, freq_mhz / 1000.0 );
+      PCA9685_Actuator_Period( act_ptr );
+      next_ns = monotonic_ns() + act_ptr->period_ns;
+    }
+
+    PCA9685_Actuator_Drain( act_ptr );
+    if (PCA9685_Chain_flush( act_ptr->chain_ptr ) > 0) act_ptr->flushes ++;
+  }
+
+  /* write what was posted before the stop */
+  PCA9685_Actuator_Drain( act_ptr );
+  if (PCA9685_Chain_flush( act_ptr->chain_ptr ) > 0) act_ptr->flushes ++;
+  return NULL;
+}
+
+
+/*
+ * Set the flush period of an actuator from the PWM frequency of its chain
+ *
+ * Arguments
+ *   act_ptr: [Input] the actuator
+ *
+ * Return: None
+ */
+void PCA9685_Actuator_Period( pca9685actuator_t *act_ptr ) {
+  act_ptr->period_ns = (uint64_t) (act_ptr->periods * 1e9 / act_ptr->chain_ptr->all.freq);
+  return;
+}
+
+
+/*
+ * Move the values posted since the last call into the shadow registers of the
+ * chain, only the newest value of each channel is seen
+ *
+ * Arguments
+ *   act_ptr: [Input] the actuator
+ *
+ * Return: None
+ */
+void PCA9685_Actuator_Drain( pca9685actuator_t *act_ptr ) {
+  uint32_t posted;
+  int board, pin;
+
+  for (board = 0; board < act_ptr->chain_ptr->n_boards; board++) {
+    /* take the posted bits, a value posted from now on sets its bit again */
+    posted = __atomic_exchange_n( &act_ptr->posted[board], 0, __ATOMIC_ACQUIRE );
+    while (posted != 0) {
+      pin = __builtin_ctz( posted );
+      posted &= posted - 1;
+      PCA9685_Dev_updatePinPWM( &act_ptr->chain_ptr->boards[board], pin, \
+        __atomic_load_n( &act_ptr->values[board * PCA9685_CHANNELS + pin], __ATOMIC_RELAXED ) );
+    }
+  }
+  return;
+}
+
+
+/*
+ * Write one 8-bit register
+ * Parameter:
+ *   pwm_ptr: [Input] the board
+ *   reg:     [Input] register address
+ *   value:   [Input] register value
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Write_Reg( pca9685_t *pwm_ptr, uint8_t reg, uint8_t value ) {
+  return I2C_Write( pwm_ptr->i2c_fd, pwm_ptr->i2c_addr, reg, &value, 1 );
+}
+
+
+/*
+ * Start the shadow of a board from the chip, in one read
+ * Parameter:
+ *   pwm_ptr: [Input] the board
+ * Return:
+ *   0 on success or -1 on failure
+ */
+int PCA9685_Read_Shadow( pca9685_t *pwm_ptr ) {
+  pwm_ptr->dirty = 0;
+  if (I2C_Read( pwm_ptr->i2c_fd, pwm_ptr->i2c_addr, PCA9685_LED0_ON_L, pwm_ptr->shadow, \
+    sizeof(pwm_ptr->shadow) ) == -1) {
+    print_time();
+    fprintf(error_log_, "Could not read the LED registers of PCA9685 at address 0x%02x\n", pwm_ptr->i2c_addr);
+    fflush(error_log_);
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * Convert a number of active ticks into the ON_L, ON_H, OFF_L, OFF_H register
+ * bytes of a pin. A zero value is completely off and 4095 completely on.
+ * Parameter:
+ *   PWMval: [Input]  the number of ticks out of 4096 to be active, clamped to 4095
+ *   data:   [Output, array size 4] register bytes
+ * Return: None
+ */
+void PCA9685_Ticks( uint16_t PWMval, uint8_t *data ) {
+  uint16_t on, off;
+
   /* Clamp value between 0 and 4095 inclusive. */
   if (PWMval > 4095) PWMval = 4095;
 
   if (PWMval == 4095) {
     /* Special value for signal fully on. */
-    PCA9685_setPWM( PinNum, 4096, 0);
+    on = 4096;
+    off = 0;
   } else if (PWMval == 0) {
     /* Special value for signal fully off. */
-    PCA9685_setPWM( PinNum, 0, 4096);
+    on = 0;
+    off = 4096;
   } else {
-    PCA9685_setPWM( PinNum, 0, PWMval);
+    on = 0;
+    off = PWMval;
   }
+  data[0] = on & 0xff;
+  data[1] = on >> 8;
+  data[2] = off & 0xff;
+  data[3] = off >> 8;
   return;
 }
 
 
-void PCA9685_cleanup( void ) {
-  int ii;
-
-  /* set all pins to 0 */
-  for ( ii = 0; ii < 16; ii ++ ) {
-    PCA9685_setPinPWM( ii, 0);
+/*
+ * Add the writes of the dirty pins of a board to a batch: one write per run
+ * of adjacent dirty pins, at most 8, or with span one write from the first to
+ * the last dirty pin.
+ * Parameter:
+ *   pwm_ptr: [Input]  the board
+ *   span:    [Input]  true for a single write
+ *   xfers:   [Output] the writes
+ * Return:
+ *   number of writes added
+ */
+int PCA9685_Add_Runs( pca9685_t *pwm_ptr, bool span, i2cxfer_t *xfers ) {
+  int pin, first, last, n_xfers;
+
+  n_xfers = 0;
+  pin = 0;
+  while (pin < PCA9685_CHANNELS) {
+    if (!(pwm_ptr->dirty & (1u << pin))) {
+      pin ++;
+      continue;
+    }
+    first = pin;
+    if (span) {
+      last = PCA9685_CHANNELS - 1 - __builtin_clz( (unsigned int) pwm_ptr->dirty << 16 );
+      pin = last + 1;
+    }
+    else {
+      while (pin < PCA9685_CHANNELS && (pwm_ptr->dirty & (1u << pin))) pin ++;
+    }
+    xfers[n_xfers].addr   = pwm_ptr->i2c_addr;
+    xfers[n_xfers].reg    = PCA9685_LED0_ON_L + 4 * first;
+    xfers[n_xfers].read   = false;
+    xfers[n_xfers].data   = pwm_ptr->shadow + 4 * first;
+    xfers[n_xfers].length = 4 * (pin - first);
+    n_xfers ++;
   }
-
-  return;
+  return n_xfers;
 }
@@ -0,0 +1,391 @@
+/* Servo motion engine on a PCA9685 chain
+ *
+ * A thread computes the setpoint of every channel at a fixed rate and writes
+ * them with PCA9685_Chain_flush, so only the channels that moved go to the
+ * bus, in one transfer, and the motion stays smooth whatever the caller does.
+ * Positions are in PWM ticks out of 4096 (at 50 Hz a tick is 4.88 us, so a
+ * 1000 to 2000 us servo pulse is 205 to 410 ticks).
+ *
+ * Each channel moves in one of two ways:
+ *   velocity: Servo_Move goes to a target as fast as the velocity and
+ *             acceleration limits of the channel allow, accelerating, cruising
+ *             and braking to stop on the target (trapezoidal profile)
+ *   keyframe: Servo_Keyframe reaches a target after a given time, on a
+ *             cubic Hermite curve from the current speed to zero speed at
+ *             the target (ease-in ease-out from rest)
+ * A new command takes over from the current position and velocity.
+ *
+ * The state is kept as one array per quantity with an entry per channel, and
+ * the step has no branches, both ways being computed for every channel and
+ * the result selected, so the compiler vectorizes it across channels. This
+ * needs -fno-math-errno and -fno-trapping-math (set in buildSensor/Makefile),
+ * without them sqrt and the compares keep the loop scalar.
+ */
+
+#include <CLibrary.h>
+#include <Sensors.h>
+#include <math.h>
+
+#define SERVO_NONE -1 /* no move in a command, only the limits */
+
+
+/************ Static Functions Limited to Access within this File ************/
+static int Servo_Command( servomotion_t *motion_ptr, int channel, int mode, double target, double duration );
+static void Servo_Take_Commands( servomotion_t *motion_ptr, double time );
+static void Servo_Step( servomotion_t *motion_ptr, double time, double dt );
+static void *Servo_Thread( void *motion_void_ptr );
+
+
+
+/*
+ * This function starts the motion engine of a chain. The engine owns the
+ * chain until Servo_Stop: the chain must not be used otherwise meanwhile.
+ * All channels start idle, not driven, and without limits.
+ *
+ * Arguments
+ *   motion_ptr: [Output] the engine, must stay valid until Servo_Stop
+ *   chain_ptr:  [Input]  an open chain
+ *   rate:       [Input]  setpoints per second, at most the PWM frequency
+ *                        of the chain is useful
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Servo_Start( servomotion_t *motion_ptr, pca9685chain_t *chain_ptr, double rate ) {
+  int ii;
+
+  if (chain_ptr->n_boards < 1 || rate <= 0) return -1;
+
+  memset( motion_ptr, 0, sizeof(servomotion_t) );
+  motion_ptr->chain_ptr  = chain_ptr;
+  motion_ptr->n_channels = chain_ptr->n_boards * PCA9685_CHANNELS;
+  motion_ptr->period_ns  = (uint64_t) (1e9 / rate);
+  for (ii = 0; ii < SERVOMAXCHANNELS; ii++) {
+    motion_ptr->mode[ii]             = SERVO_IDLE;
+    motion_ptr->max_velocity[ii]     = INFINITY;
+    motion_ptr->max_acceleration[ii] = INFINITY;
+    motion_ptr->key_duration[ii]     = 1.0;
+    motion_ptr->cmd_mode[ii]         = SERVO_NONE;
+    motion_ptr->cmd_max_velocity[ii]     = INFINITY;
+    motion_ptr->cmd_max_acceleration[ii] = INFINITY;
+  }
+  pthread_mutex_init( &motion_ptr->mutex, NULL );
+
+  motion_ptr->running  = true;
+  motion_ptr->start_ns = monotonic_ns();
+  if (pthread_create( &motion_ptr->thread, NULL, Servo_Thread, motion_ptr ) != 0) {
+    print_time();
+    fprintf(error_log_, "Could not start servo motion thread.\n");
+    fflush(error_log_);
+    pthread_mutex_destroy( &motion_ptr->mutex );
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * This function sets the limits of the velocity moves of a channel
+ *
+ * Arguments
+ *   motion_ptr:       [Input] the engine
+ *   channel:          [Input] channel, 16 * board + pin
+ *   max_velocity:     [Input] ticks per second, INFINITY for no limit
+ *   max_acceleration: [Input] ticks per second squared, INFINITY for no limit
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Servo_Set_Limits( servomotion_t *motion_ptr, int channel, double max_velocity, double max_acceleration ) {
+  if (channel < 0 || channel >= motion_ptr->n_channels) return -1;
+  if (!(max_velocity > 0) || !(max_acceleration > 0)) return -1;
+
+  pthread_mutex_lock( &motion_ptr->mutex );
+  motion_ptr->cmd_max_velocity[channel]     = max_velocity;
+  motion_ptr->cmd_max_acceleration[channel] = max_acceleration;
+  motion_ptr->cmd_pending[channel] = true;
+  pthread_mutex_unlock( &motion_ptr->mutex );
+  return 0;
+}
+
+
+/*
+ * This function moves a channel to a target within its velocity and
+ * acceleration limits. An idle channel has no known position and goes to the
+ * target at once.
+ *
+ * Arguments
+ *   motion_ptr: [Input] the engine
+ *   channel:    [Input] channel, 16 * board + pin
+ *   target:     [Input] position in ticks, 0 to 4095
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Servo_Move( servomotion_t *motion_ptr, int channel, double target ) {
+  return Servo_Command( motion_ptr, channel, SERVO_VELOCITY, target, 0 );
+}
+
+
+/*
+ * This function moves a channel to a target in a given time, starting at
+ * its current speed and ending at zero speed. An idle channel has no known position and goes to
+ * the target at once.
+ *
+ * Arguments
+ *   motion_ptr: [Input] the engine
+ *   channel:    [Input] channel, 16 * board + pin
+ *   target:     [Input] position in ticks, 0 to 4095
+ *   duration:   [Input] seconds to reach the target
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Servo_Keyframe( servomotion_t *motion_ptr, int channel, double target, double duration ) {
+  if (!(duration >= 0)) return -1;
+  return Servo_Command( motion_ptr, channel, SERVO_KEYFRAME, target, duration );
+}
+
+
+/*
+ * This function stops driving a channel: its output is turned off, which
+ * lets a servo go limp, and it becomes idle
+ *
+ * Arguments
+ *   motion_ptr: [Input] the engine
+ *   channel:    [Input] channel, 16 * board + pin
+ *
+ * Return
+ *   0 on success or -1 on failure
+ */
+int Servo_Release( servomotion_t *motion_ptr, int channel ) {
+  return Servo_Command( motion_ptr, channel, SERVO_IDLE, 0, 0 );
+}
+
+
+/*
+ * This function gives the last setpoint written for a channel
+ *
+ * Arguments
+ *   motion_ptr: [Input] the engine
+ *   channel:    [Input] channel, 16 * board + pin
+ *
+ * Return
+ *   position in ticks, 0 for an idle channel, NAN for a bad channel
+ */
+double Servo_Position( servomotion_t *motion_ptr, int channel ) {
+  double position;
+
+  if (channel < 0 || channel >= motion_ptr->n_channels) return NAN;
+  pthread_mutex_lock( &motion_ptr->mutex );
+  position = motion_ptr->setpoints[channel];
+  pthread_mutex_unlock( &motion_ptr->mutex );
+  return position;
+}
+
+
+/*
+ * This function stops the motion engine and waits for its thread to finish.
+ * The outputs keep their last setpoint.
+ *
+ * Arguments
+ *   motion_ptr: [Input] the engine
+ *
+ * Return: None
+ */
+void Servo_Stop( servomotion_t *motion_ptr ) {
+  __atomic_store_n( &motion_ptr->running, false, __ATOMIC_RELEASE );
+  pthread_join( motion_ptr->thread, NULL );
+  pthread_mutex_destroy( &motion_ptr->mutex );
+  return;
+}
+
+
+
+/*
+ * Hand a command for a channel to the thread, replacing a command it has not
+ * taken yet
+ */
+int Servo_Command( servomotion_t *motion_ptr, int channel, int mode, double target, double duration ) {
+  if (channel < 0 || channel >= motion_ptr->n_channels) return -1;
+  if (!(target >= 0 && target <= 4095)) return -1;
+
+  pthread_mutex_lock( &motion_ptr->mutex );
+  motion_ptr->cmd_mode[channel]     = mode;
+  motion_ptr->cmd_target[channel]   = target;
+  motion_ptr->cmd_duration[channel] = duration;
+  motion_ptr->cmd_pending[channel]  = true;
+  pthread_mutex_unlock( &motion_ptr->mutex );
+  return 0;
+}
+
+
+/*
+ * Apply the commands given since the last step, and publish the setpoints
+ *
+ * Arguments
+ *   motion_ptr: [Input] the engine
+ *   time:       [Input] seconds since the start
+ *
+ * Return: None
+ */
+void Servo_Take_Commands( servomotion_t *motion_ptr, double time ) {
+  int ii;
+
+  pthread_mutex_lock( &motion_ptr->mutex );
+  memcpy( motion_ptr->setpoints, motion_ptr->position, motion_ptr->n_channels * sizeof(double) );
+  for (ii = 0; ii < motion_ptr->n_channels; ii++) {
+    if (!motion_ptr->cmd_pending[ii]) continue;
+    motion_ptr->cmd_pending[ii] = false;
+    motion_ptr->max_velocity[ii]     = motion_ptr->cmd_max_velocity[ii];
+    motion_ptr->max_acceleration[ii] = motion_ptr->cmd_max_acceleration[ii];
+    if (motion_ptr->cmd_mode[ii] == SERVO_NONE) continue;
+
+    /* an idle channel starts on its target */
+    if (motion_ptr->mode[ii] == SERVO_IDLE) {
+      motion_ptr->position[ii] = motion_ptr->cmd_target[ii];
+      motion_ptr->velocity[ii] = 0;
+    }
+    motion_ptr->mode[ii]         = motion_ptr->cmd_mode[ii];
+    motion_ptr->target[ii]       = motion_ptr->cmd_target[ii];
+    motion_ptr->key_start[ii]    = motion_ptr->position[ii];
+    motion_ptr->key_velocity[ii] = motion_ptr->velocity[ii];
+    motion_ptr->key_time[ii]     = time;
+    /* a keyframe of no time takes one step */
+    motion_ptr->key_duration[ii] = (motion_ptr->cmd_duration[ii] > 0) ? motion_ptr->cmd_duration[ii] : 1e-9;
+    motion_ptr->cmd_mode[ii]     = SERVO_NONE;
+    /* a released channel is turned off once, then left alone */
+    if (motion_ptr->mode[ii] == SERVO_IDLE) {
+      motion_ptr->position[ii] = 0;
+      motion_ptr->velocity[ii] = 0;
+      PCA9685_Chain_updatePWM( motion_ptr->chain_ptr, ii, 0 );
+    }
+  }
+  pthread_mutex_unlock( &motion_ptr->mutex );
+  return;
+}
+
+
+/*
+ * Advance the setpoints of all channels by one step
+ *
+ * Arguments
+ *   motion_ptr: [Input] the engine
+ *   time:       [Input] seconds since the start, at the end of the step
+ *   dt:         [Input] seconds since the last step
+ *
+ * Return: None
+ */
+void Servo_Step( servomotion_t *motion_ptr, double time, double dt ) {
+  double *restrict position = motion_ptr->position;
+  double *restrict velocity = motion_ptr->velocity;
+  const double *restrict target       = motion_ptr->target;
+  const double *restrict max_velocity = motion_ptr->max_velocity;
+  const double *restrict max_acceleration = motion_ptr->max_acceleration;
+  const double *restrict key_start    = motion_ptr->key_start;
+  const double *restrict key_velocity = motion_ptr->key_velocity;
+  const double *restrict key_time     = motion_ptr->key_time;
+  const double *restrict key_duration = motion_ptr->key_duration;
+  const double *restrict mode         = motion_ptr->mode;
+  double error, distance, braking, wanted, limit, change, step, speed;
+  double s, s2, s3, key_position, velocity_position;
+  bool land;
+  int ii;
+
+  for (ii = 0; ii < motion_ptr->n_channels; ii++) {
+    /* velocity: the fastest speed that can still brake to a stop on the
+     * target, reached within the acceleration limit. Braking n steps of dt at
+     * a covers a dt^2 n (n+1) / 2, so the speed n a dt for a distance d is
+     * 4 d / (dt (1 + sqrt(1 + 8 d / (a dt^2)))), v^2 = 2 a d for small dt,
+     * and the last step before the target is at most a dt. Limits are applied
+     * with compares, which vectorize where fmin and fmax do not. */
+    error    = target[ii] - position[ii];
+    distance = fabs( error );
+    braking  = 4.0 * distance / (dt * (1.0 + sqrt( 1.0 + 8.0 * distance / (max_acceleration[ii] * dt * dt) )));
+    wanted   = copysign( max_velocity[ii] < braking ? max_velocity[ii] : braking, error );
+    limit    = max_acceleration[ii] * dt;
+    change   = wanted - velocity[ii];
+    change   = change >  limit ?  limit : change;
+    change   = change < -limit ? -limit : change;
+    speed    = velocity[ii] + change;
+    step     = speed * dt;
+    /* land on the target rather than overshoot it, only when moving toward
+     * it: a channel still moving away brakes first */
+    land     = (step * error > 0) && (fabs( step ) >= distance);
+    velocity_position = land ? target[ii] : position[ii] + step;
+    speed    = land ? 0.0 : speed;
+    /* a move can still overshoot, for example when Servo_Set_Limits lowers
+     * the acceleration while braking, it then stops at the end of the PWM
+     * range rather than wrapping around in the ticks */
+    speed    = (velocity_position < 0.0 || velocity_position > 4095.0) ? 0.0 : speed;
+    velocity_position = velocity_position > 4095.0 ? 4095.0 : velocity_position;
+    velocity_position = velocity_position < 0.0 ? 0.0 : velocity_position;
+
+    /* keyframe: cubic Hermite from the start position and velocity to the
+     * target at zero speed, a smoothstep when starting at rest. The curve can
+     * overshoot from a fast start, so it is kept within the PWM range. */
+    s  = (time - key_time[ii]) / key_duration[ii];
+    s  = s > 1.0 ? 1.0 : s;
+    s  = s < 0.0 ? 0.0 : s;
+    s2 = s * s;
+    s3 = s2 * s;
+    key_position = key_start[ii] + (target[ii] - key_start[ii]) * (3.0 * s2 - 2.0 * s3) \
+      + key_velocity[ii] * key_duration[ii] * (s3 - 2.0 * s2 + s);
+    key_position = key_position > 4095.0 ? 4095.0 : key_position;
+    key_position = key_position < 0.0 ? 0.0 : key_position;
+
+    /* select, idle channels do not move */
+    step  = (mode[ii] == SERVO_KEYFRAME) ? key_position : velocity_position;
+    speed = (mode[ii] == SERVO_KEYFRAME) ? (step - position[ii]) / dt : speed;
+    step  = (mode[ii] == SERVO_IDLE) ? position[ii] : step;
+    speed = (mode[ii] == SERVO_IDLE) ? 0.0 : speed;
+    velocity[ii] = speed;
+    position[ii] = step;
+  }
+  return;
+}
+
+
+/*
+ * Thread function of the motion engine
+ *
+ * Arguments
+ *   motion_void_ptr: [Input] pointer to the servomotion_t
+ *
+ * Return
+ *   NULL
+ */
+void *Servo_Thread( void *motion_void_ptr ) {
+  servomotion_t *motion_ptr;
+  uint64_t now_ns, next_ns, last_ns;
+  int ii;
+
+  motion_ptr = (servomotion_t *) motion_void_ptr;
+
+  last_ns = motion_ptr->start_ns;
+  next_ns = last_ns + motion_ptr->period_ns;
+  while ( __atomic_load_n( &motion_ptr->running, __ATOMIC_ACQUIRE ) ) {
+    now_ns = monotonic_ns();
+    if (now_ns < next_ns) {
+      nsleep( next_ns - now_ns );
+      now_ns = next_ns;
+    }
+    else if (now_ns - next_ns >= motion_ptr->period_ns) {
+      motion_ptr->overruns += (now_ns - next_ns) / motion_ptr->period_ns;
+    }
+    next_ns += ((now_ns - next_ns) / motion_ptr->period_ns + 1) * motion_ptr->period_ns;
+
+    /* the step covers the time since the last one, also after an overrun */
+    Servo_Take_Commands( motion_ptr, (now_ns - motion_ptr->start_ns) * 1e-9 );
+    Servo_Step( motion_ptr, (now_ns - motion_ptr->start_ns) * 1e-9, (now_ns - last_ns) * 1e-9 );
+    last_ns = now_ns;
+
+    /* only the channels whose ticks changed are written */
+    for (ii = 0; ii < motion_ptr->n_channels; ii++) {
+      if (motion_ptr->mode[ii] == SERVO_IDLE) continue;
+      PCA9685_Chain_updatePWM( motion_ptr->chain_ptr, ii, (uint16_t) lrint( motion_ptr->position[ii] ) );
+    }
+    PCA9685_Chain_flush( motion_ptr->chain_ptr );
+  }
+  return NULL;
+}